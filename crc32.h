@@ -0,0 +1,13 @@
+#ifndef _SDLOCKER_CRC32_
+#define _SDLOCKER_CRC32_
+
+
+/*
+ *  CRC-32 as zlib computes it (reflected polynomial 0xEDB88320, inverted
+ *  in and out), so manifests can be checked with any zip tool.  Calls
+ *  chain: start from 0 and pass each result back in.  It works a nibble
+ *  at a time from a 16-entry table, 64 bytes of flash rather than 1 KB.
+ */
+extern uint32_t crc32_update(uint32_t crc, const uint8_t *p, uint16_t len);
+
+#endif /* _SDLOCKER_CRC32_ */
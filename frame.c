@@ -0,0 +1,118 @@
+#include <avr/io.h>
+#include <stdio.h>
+#include <util/crc16.h>
+#include "uart.h"
+#include "frame.h"
+#include "lz.h"
+
+
+static uint16_t frame_crc;
+
+static uint8_t rx_pos;              /* control frame parser */
+static uint8_t rx_type;
+static uint32_t rx_block;
+static uint16_t rx_crc;
+
+
+void frame_byte(uint8_t c) {
+    uart_putbyte(c);
+    frame_crc = _crc_xmodem_update(frame_crc, c);
+}
+
+
+void frame_dword(uint32_t d) {
+    frame_byte(d);
+    frame_byte(d >> 8);
+    frame_byte(d >> 16);
+    frame_byte(d >> 24);
+}
+
+
+void frame_begin(uint8_t type, uint16_t len, uint32_t block) {
+    uart_putbyte(FRAME_SYNC);
+    frame_crc = 0;
+    frame_byte(type);
+    frame_byte(len);
+    frame_byte(len >> 8);
+    frame_dword(block);
+}
+
+
+void frame_end(void) {
+    uint16_t crc;
+
+    crc = frame_crc;
+    uart_putbyte(crc);
+    uart_putbyte(crc >> 8);
+}
+
+
+/*
+ *  Send a 512-byte block as FRAME_PACKED if that is shorter, else as
+ *  FRAME_DATA.  The packed frame carries the CRC of the unpacked block so
+ *  the host can check its decoder's output as well as the wire.
+ */
+void frame_block(uint32_t block, const uint8_t *data) {
+    uint16_t packed;
+    uint16_t crc;
+    uint16_t i;
+
+    packed = lz_pack(data, 512, NULL);
+    if (packed + 2 >= 512) {
+        frame_begin(FRAME_DATA, 512, block);
+        for (i = 0; i < 512; i++) {
+            frame_byte(data[i]);
+        }
+        frame_end();
+        return;
+    }
+
+    crc = 0;
+    for (i = 0; i < 512; i++) {
+        crc = _crc_xmodem_update(crc, data[i]);
+    }
+    frame_begin(FRAME_PACKED, packed + 2, block);
+    frame_byte(crc);
+    frame_byte(crc >> 8);
+    lz_pack(data, 512, frame_byte);
+    frame_end();
+}
+
+
+/*
+ *  Feed one received byte to the control frame parser.  Returns the frame
+ *  type, with its block in *block, when a good header-only frame is
+ *  complete, else 0.  A bad frame is dropped; the host repeats itself.
+ */
+uint8_t frame_recv(uint8_t c, uint32_t *block) {
+    if (rx_pos == 0) {
+        if (c == FRAME_SYNC) {
+            rx_crc = 0;
+            rx_pos = 1;
+        }
+        return 0;
+    }
+    if (rx_pos < FRAME_HDR_LEN) {
+        rx_crc = _crc_xmodem_update(rx_crc, c);
+        if (rx_pos == 1) {
+            rx_type = c;
+        } else if (rx_pos >= 4) {
+            rx_block = (rx_block >> 8) | ((uint32_t)c << 24);
+        } else if (c != 0) {
+            rx_pos = 0;             /* control frames have no payload */
+            return 0;
+        }
+        rx_pos++;
+        return 0;
+    }
+    if (rx_pos == FRAME_HDR_LEN) {
+        rx_pos = (c == (uint8_t)rx_crc) ? rx_pos + 1 : 0;
+        return 0;
+    }
+    rx_pos = 0;
+    if (c != (uint8_t)(rx_crc >> 8)) {
+        return 0;
+    }
+    *block = rx_block;
+    return rx_type;
+}
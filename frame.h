@@ -0,0 +1,45 @@
+#ifndef _SDLOCKER_FRAME_
+#define _SDLOCKER_FRAME_
+
+
+/*
+ *  Binary frames sent over the UART for block transfers:
+ *
+ *    0xA5 type len(2) block(4) payload(len) crc(2)
+ *
+ *  Multi-byte fields are little-endian.  The CRC is CRC-16/XMODEM over
+ *  everything after the sync byte, up to the end of the payload.
+ */
+#define FRAME_SYNC      0xA5
+#define FRAME_HDR_LEN   8
+
+#define FRAME_DATA      'D'         /* payload is the 512-byte block */
+#define FRAME_PACKED    'Z'         /* crc(2) of the block, then the block packed by lz_pack() */
+#define FRAME_FILL      'F'         /* count(4) fill(1): count blocks all equal to fill */
+#define FRAME_COPY      'C'         /* from(4) count(4): count blocks equal to those at from */
+#define FRAME_TRACE     'T'         /* SPI trace records, see trace.h; block is their count */
+#define FRAME_SPI       'S'         /* SPI capture records, see trace.h; block is the first one's number */
+#define FRAME_END       'E'         /* status(1); block is the first one not sent */
+
+#define FRAME_OK        0           /* FRAME_END status values */
+#define FRAME_RDERR     1
+#define FRAME_ABORTED   2           /* cancelled, or the host stopped answering */
+#define FRAME_UNCHANGED 3           /* c: the blocks match the digest, none sent */
+
+/*
+ *  Control frames from the host during a windowed dump (s), header only
+ *  with len 0, in the same format.
+ */
+#define FRAME_ACK       'A'         /* the host has every block before block */
+#define FRAME_RESEND    'R'         /* send the frame starting at block again */
+#define FRAME_CANCEL    'X'         /* end the dump now */
+
+
+extern void frame_begin(uint8_t type, uint16_t len, uint32_t block);
+extern void frame_byte(uint8_t c);
+extern void frame_dword(uint32_t d);
+extern void frame_end(void);
+extern void frame_block(uint32_t block, const uint8_t *data);
+extern uint8_t frame_recv(uint8_t c, uint32_t *block);
+
+#endif /* _SDLOCKER_FRAME_ */
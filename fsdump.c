@@ -0,0 +1,347 @@
+#include <stdint.h>
+#include <string.h>
+#include "fsdump.h"
+
+
+#define FS_NONE     0
+#define FS_FAT16    1
+#define FS_FAT32    2
+#define FS_EXFAT    3
+
+#define FS_NO_BLOCK 0xffffffffUL
+
+
+/*
+ *  One volume.  Block numbers other than start are relative to start.
+ */
+static struct {
+    uint32_t start;
+    uint32_t size;
+    uint32_t fat;                   /* first FAT */
+    uint32_t fatlen;                /* blocks per FAT */
+    uint32_t data;                  /* cluster heap */
+    uint32_t clusters;
+    uint32_t bitmap;                /* exFAT allocation bitmap */
+    uint8_t nfats;
+    uint8_t mirrored;               /* FAT copies follow the first FAT */
+    uint8_t shift;                  /* log2 blocks per cluster */
+    uint8_t type;
+} vol;
+
+static uint8_t allocmap[32];        /* one bit per cluster of the current group */
+static uint32_t mapblock;           /* exFAT bitmap block still in buf, or FS_NO_BLOCK */
+
+
+static uint16_t fs_le16(const uint8_t *p) {
+    return p[0] | ((uint16_t)p[1] << 8);
+}
+
+
+static uint32_t fs_le32(const uint8_t *p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+static uint8_t fs_log2(uint8_t n) {
+    uint8_t s;
+
+    for (s = 0; (1 << s) < n; s++)
+        ;
+    return ((1 << s) == n) ? s : 0xff;
+}
+
+
+/*
+ *  Decode the boot sector in buf into vol.  Returns the volume type.
+ */
+static uint8_t fs_probe(const uint8_t *buf) {
+    uint32_t total;
+    uint16_t rootents;
+
+    if ((buf[510] != 0x55) || (buf[511] != 0xaa)) {
+        return FS_NONE;
+    }
+    if (memcmp(buf + 3, "EXFAT   ", 8) == 0) {
+        if ((buf[108] != 9) || (buf[109] > 25)) {
+            return FS_NONE;         /* only 512-byte sectors */
+        }
+        vol.fat = fs_le32(buf + 80);
+        vol.fatlen = fs_le32(buf + 84);
+        vol.data = fs_le32(buf + 88);
+        vol.clusters = fs_le32(buf + 92);
+        vol.nfats = buf[110];
+        vol.shift = buf[109];
+        vol.mirrored = 0;
+        vol.type = FS_EXFAT;
+    } else {
+        if ((fs_le16(buf + 11) != 512) || ((vol.shift = fs_log2(buf[13])) == 0xff) ||
+            (fs_le16(buf + 14) == 0) || (buf[16] == 0)) {
+            return FS_NONE;
+        }
+        total = fs_le16(buf + 19) ? fs_le16(buf + 19) : fs_le32(buf + 32);
+        vol.fatlen = fs_le16(buf + 22) ? fs_le16(buf + 22) : fs_le32(buf + 36);
+        rootents = fs_le16(buf + 17);
+        vol.fat = fs_le16(buf + 14);
+        vol.nfats = buf[16];
+        vol.data = vol.fat + vol.nfats * vol.fatlen + (rootents * 32UL + 511) / 512;
+        if ((vol.fatlen == 0) || (total <= vol.data) || (total > vol.size)) {
+            return FS_NONE;
+        }
+        vol.clusters = (total - vol.data) >> vol.shift;
+        if (vol.clusters < 4085) {
+            return FS_NONE;         /* FAT12 */
+        }
+        vol.type = vol.clusters < 65525 ? FS_FAT16 : FS_FAT32;
+        vol.mirrored = (vol.type == FS_FAT16) || !(buf[40] & 0x80);
+    }
+    if (vol.data + (vol.clusters << vol.shift) > vol.size) {
+        return FS_NONE;
+    }
+    return vol.type;
+}
+
+
+/*
+ *  Find the exFAT allocation bitmap among the first entries of the root
+ *  directory (formatters put it there).
+ */
+static uint8_t fs_find_bitmap(uint8_t *buf, uint32_t rootclus) {
+    uint16_t i;
+
+    if ((rootclus < 2) || (rootclus - 2 >= vol.clusters) ||
+        fs_read_block(vol.start + vol.data + ((rootclus - 2) << vol.shift), buf)) {
+        return FS_NONE;
+    }
+    for (i = 0; i < 512; i += 32) {
+        if (buf[i] == 0x81) {
+            rootclus = fs_le32(buf + i + 20);
+            if ((rootclus < 2) || (rootclus - 2 >= vol.clusters)) {
+                return FS_NONE;
+            }
+            vol.bitmap = vol.data + ((rootclus - 2) << vol.shift);
+            return FS_EXFAT;
+        }
+    }
+    return FS_NONE;
+}
+
+
+/*
+ *  Load allocmap for the group of clusters that starts at table entry e;
+ *  returns the group size.  A group is what one FAT block holds, or a
+ *  32-byte slice of an exFAT bitmap block.  The bitmap block stays in buf
+ *  for the 16 slices it holds, unless sending clusters overwrote it.
+ */
+static int16_t fs_map(uint32_t e, uint8_t *buf) {
+    uint32_t b;
+    uint16_t i;
+
+    memset(allocmap, 0, sizeof(allocmap));
+    if (vol.type == FS_EXFAT) {
+        b = vol.start + vol.bitmap + e / 4096;
+        if (b != mapblock) {
+            mapblock = FS_NO_BLOCK;
+            if (fs_read_block(b, buf)) {
+                return -1;
+            }
+            mapblock = b;
+        }
+        memcpy(allocmap, buf + (e % 4096) / 8, sizeof(allocmap));
+        return 256;
+    }
+    if (vol.type == FS_FAT16) {
+        if (fs_read_block(vol.start + vol.fat + e / 256, buf)) {
+            return -1;
+        }
+        for (i = 0; i < 256; i++) {
+            if (fs_le16(buf + i * 2)) {
+                allocmap[i >> 3] |= 1 << (i & 7);
+            }
+        }
+        return 256;
+    }
+    if (fs_read_block(vol.start + vol.fat + e / 128, buf)) {
+        return -1;
+    }
+    for (i = 0; i < 128; i++) {
+        if (fs_le32(buf + i * 4) & 0x0fffffff) {
+            allocmap[i >> 3] |= 1 << (i & 7);
+        }
+    }
+    return 128;
+}
+
+
+/*
+ *  Send a run of clusters in use.  fs_send_range() may overwrite buf, and
+ *  with it the bitmap block fs_map() keeps there.
+ */
+static int8_t fs_send_used(uint32_t first, uint32_t count) {
+    mapblock = FS_NO_BLOCK;
+    return fs_send_range(first, count);
+}
+
+
+/*
+ *  Send the clusters in use, walking the allocation table one group at a
+ *  time.  FAT entries 0 and 1 are not clusters; exFAT bit 0 is cluster 2.
+ */
+static int8_t fs_walk(uint8_t *buf) {
+    uint32_t e;
+    uint32_t end;
+    uint32_t run;
+    uint32_t runlen;
+    uint8_t runused;
+    uint8_t used;
+    uint8_t bias;
+    int16_t group;
+    uint16_t i;
+
+    bias = (vol.type == FS_EXFAT) ? 0 : 2;
+    end = vol.clusters + bias;
+    run = bias;
+    runlen = 0;
+    runused = 0;
+    mapblock = FS_NO_BLOCK;
+    for (e = 0; e < end; e += group) {
+        group = fs_map(e, buf);
+        if (group < 0) {
+            return -1;
+        }
+        for (i = 0; (i < group) && (e + i < end); i++) {
+            if (e + i < bias) {
+                continue;
+            }
+            used = (allocmap[i >> 3] >> (i & 7)) & 1;
+            if (runlen && (used == runused) && (used || (runlen < FS_FREE_FLUSH))) {
+                runlen++;
+                continue;
+            }
+            if (runlen && runused &&
+                fs_send_used(vol.start + vol.data + ((run - bias) << vol.shift), runlen << vol.shift)) {
+                return -1;
+            }
+            if (runlen && !runused) {
+                fs_send_zero(vol.start + vol.data + ((run - bias) << vol.shift), runlen << vol.shift);
+            }
+            run = e + i;
+            runlen = 1;
+            runused = used;
+        }
+    }
+    if (runlen && runused) {
+        return fs_send_used(vol.start + vol.data + ((run - bias) << vol.shift), runlen << vol.shift);
+    }
+    if (runlen) {
+        fs_send_zero(vol.start + vol.data + ((run - bias) << vol.shift), runlen << vol.shift);
+    }
+    return 0;
+}
+
+
+static int8_t fs_volume(uint32_t start, uint32_t size, uint8_t *buf) {
+    uint8_t type;
+    uint8_t n;
+
+    vol.start = start;
+    vol.size = size;
+    if (fs_read_block(start, buf)) {
+        return -1;
+    }
+    type = fs_probe(buf);
+    if (type == FS_EXFAT) {
+        type = fs_find_bitmap(buf, fs_le32(buf + 96));
+    }
+    if (type == FS_NONE) {
+        return fs_send_range(start, size);
+    }
+
+    if (vol.mirrored && (vol.nfats > 1)) {
+        if (fs_send_range(start, vol.fat + vol.fatlen)) {
+            return -1;
+        }
+        for (n = 1; n < vol.nfats; n++) {
+            fs_send_copy(start + vol.fat, start + vol.fat + n * vol.fatlen, vol.fatlen);
+        }
+        if (fs_send_range(start + vol.fat + vol.nfats * vol.fatlen,
+                          vol.data - vol.fat - vol.nfats * vol.fatlen)) {
+            return -1;
+        }
+    } else if (fs_send_range(start, vol.data)) {
+        return -1;
+    }
+    return fs_walk(buf);
+}
+
+
+/*
+ *  Dump a card of total blocks.  A boot sector at block 0 is taken as a
+ *  volume without a partition table; otherwise the MBR and everything up
+ *  to the first partition are sent, then each partition in block order,
+ *  with any gap between two partitions sent whole.  Blocks past the last
+ *  partition are not sent.  A table whose entries overlap is not trusted:
+ *  the whole card is sent.
+ */
+int8_t fs_dump(uint32_t total, uint8_t *buf) {
+    uint32_t pstart[4];
+    uint32_t psize[4];
+    uint32_t t;
+    uint8_t np;
+    uint8_t i;
+    uint8_t j;
+    const uint8_t *p;
+
+    if (fs_read_block(0, buf)) {
+        return -1;
+    }
+    vol.size = total;
+    if (((buf[0] == 0xeb) || (buf[0] == 0xe9)) && (fs_probe(buf) != FS_NONE)) {
+        return fs_volume(0, total, buf);
+    }
+    if ((buf[510] != 0x55) || (buf[511] != 0xaa)) {
+        return fs_send_range(0, total);
+    }
+
+    np = 0;
+    for (i = 0; i < 4; i++) {
+        p = buf + 446 + i * 16;
+        pstart[np] = fs_le32(p + 8);
+        psize[np] = fs_le32(p + 12);
+        if ((p[4] == 0) || (psize[np] == 0) || (pstart[np] >= total)) {
+            continue;
+        }
+        if (psize[np] > total - pstart[np]) {
+            psize[np] = total - pstart[np];
+        }
+        for (j = np; (j > 0) && (pstart[j - 1] > pstart[j]); j--) {     /* keep them in block order */
+            t = pstart[j];
+            pstart[j] = pstart[j - 1];
+            pstart[j - 1] = t;
+            t = psize[j];
+            psize[j] = psize[j - 1];
+            psize[j - 1] = t;
+        }
+        np++;
+    }
+    if (np == 0) {
+        return fs_send_range(0, total);
+    }
+    for (i = 1; i < np; i++) {
+        if (pstart[i] - pstart[i - 1] < psize[i - 1]) {
+            return fs_send_range(0, total);
+        }
+    }
+    if (fs_send_range(0, pstart[0])) {
+        return -1;
+    }
+    for (i = 0; i < np; i++) {
+        t = (i > 0) ? pstart[i - 1] + psize[i - 1] : pstart[0];        /* gap before this one */
+        if ((t < pstart[i]) && fs_send_range(t, pstart[i] - t)) {
+            return -1;
+        }
+        if (fs_volume(pstart[i], psize[i], buf)) {
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef _SDLOCKER_FSDUMP_
+#define _SDLOCKER_FSDUMP_
+
+
+/*
+ *  File-system aware dump: the MBR, then for each FAT16, FAT32 or exFAT
+ *  volume its metadata and the clusters in use.  Free clusters are
+ *  reported as zero runs, not read.  Anything not recognised (other file
+ *  systems, FAT12, no MBR) is sent whole.
+ *
+ *  The caller provides the block I/O below; buf is its 512-byte block
+ *  buffer, which fs_send_range() may overwrite.
+ */
+#define FS_FREE_FLUSH   16384       /* clusters; longest free run held back */
+
+
+extern int8_t fs_dump(uint32_t total, uint8_t *buf);
+
+/* provided by the caller; all return 0 on success */
+extern int8_t fs_read_block(uint32_t blocknum, uint8_t *buf);
+extern int8_t fs_send_range(uint32_t first, uint32_t count);
+extern void fs_send_zero(uint32_t first, uint32_t count);
+extern void fs_send_copy(uint32_t from, uint32_t to, uint32_t count);
+
+#endif /* _SDLOCKER_FSDUMP_ */
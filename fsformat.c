@@ -0,0 +1,394 @@
+#include <stdint.h>
+#include <string.h>
+#include "fsformat.h"
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#else
+#define PROGMEM
+#define memcpy_P memcpy
+#define pgm_read_word(p) (*(p))
+#endif
+
+
+#define FAT32_RESERVED  32          /* minimum reserved sectors */
+#define FAT32_MIN       65525       /* fewer clusters would make it FAT16 */
+#define EXFAT_BOOT      12          /* sectors per boot region */
+
+
+static const char fat32_oem[] PROGMEM = "SDLOCKERNO NAME    FAT32   ";
+static const char exfat_oem[] PROGMEM = "EXFAT   ";
+
+/*
+ *  Compressed up-case table: 0xffff n maps the next n characters to
+ *  themselves.  Only a..z are folded; a full Unicode table does not fit
+ *  beside the firmware, and names are written by the host OS anyway.
+ */
+static const uint16_t upcase[] PROGMEM = {
+    0xffff, 'a',
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
+    'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
+    0xffff, (uint16_t)(0x10000UL - 'z' - 1)
+};
+
+
+static struct {
+    uint32_t start;                 /* partition */
+    uint32_t size;
+    uint32_t fat;                   /* relative to start */
+    uint32_t fatlen;
+    uint32_t data;                  /* cluster 2, relative to start */
+    uint32_t clusters;
+    uint32_t serial;
+    uint32_t bitmap;                /* exFAT: bitmap length in clusters */
+    uint16_t spc;                   /* blocks per cluster */
+    uint8_t type;
+} fmt;
+
+
+static void fs_put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+
+static void fs_put32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+
+static uint8_t fs_shift(uint16_t n) {
+    uint8_t s;
+
+    for (s = 0; (1U << s) < n; s++)
+        ;
+    return s;
+}
+
+
+static int8_t fs_write_zeros(uint32_t count) {
+    while (count--) {
+        if (fs_write_next(NULL)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  FAT32 geometry: 32 KB clusters, halved until there are enough of them
+ *  to be FAT32, and reserved sectors padded so cluster 2 sits on an
+ *  alignment boundary.
+ */
+static int8_t fat32_layout(uint32_t align) {
+    uint32_t reserved;
+
+    for (fmt.spc = 64; ; fmt.spc >>= 1) {
+        fmt.fatlen = (((fmt.size - FAT32_RESERVED) / fmt.spc + 2) * 4 + 511) / 512;
+        reserved = FAT32_RESERVED + 2 * fmt.fatlen;
+        reserved += (align - (fmt.start + reserved) % align) % align;
+        fmt.fat = reserved - 2 * fmt.fatlen;
+        fmt.data = reserved;
+        fmt.clusters = (fmt.size - fmt.data) / fmt.spc;
+        if ((fmt.clusters >= FAT32_MIN + 16) || (fmt.spc == 1)) {
+            break;
+        }
+    }
+    return (fmt.clusters >= FAT32_MIN) && (fmt.fat < 0x10000UL) ? 0 : -1;
+}
+
+
+static void fat32_boot(uint8_t *buf) {
+    memset(buf, 0, 512);
+    buf[0] = 0xeb;
+    buf[1] = 0x58;
+    buf[2] = 0x90;
+    memcpy_P(buf + 3, fat32_oem, 8);
+    fs_put16(buf + 11, 512);
+    buf[13] = fmt.spc;
+    fs_put16(buf + 14, fmt.fat);
+    buf[16] = 2;                    /* FATs */
+    buf[21] = 0xf8;                 /* fixed disk */
+    fs_put16(buf + 24, 63);         /* sectors per track, heads: conventional */
+    fs_put16(buf + 26, 255);
+    fs_put32(buf + 28, fmt.start);
+    fs_put32(buf + 32, fmt.size);
+    fs_put32(buf + 36, fmt.fatlen);
+    fs_put32(buf + 44, 2);          /* root directory cluster */
+    fs_put16(buf + 48, 1);          /* FSInfo sector */
+    fs_put16(buf + 50, 6);          /* backup boot sector */
+    buf[64] = 0x80;
+    buf[66] = 0x29;
+    fs_put32(buf + 67, fmt.serial);
+    memcpy_P(buf + 71, fat32_oem + 8, 19);
+    buf[510] = 0x55;
+    buf[511] = 0xaa;
+}
+
+
+static void fat32_fsinfo(uint8_t *buf) {
+    memset(buf, 0, 512);
+    fs_put32(buf, 0x41615252);
+    fs_put32(buf + 484, 0x61417272);
+    fs_put32(buf + 488, fmt.clusters - 1);      /* the root directory is in use */
+    fs_put32(buf + 492, 3);
+    fs_put32(buf + 508, 0xaa550000);
+}
+
+
+static int8_t fat32_write(uint8_t *buf) {
+    uint8_t n;
+
+    /* boot sector, FSInfo, 4 spare, then the backups at 6 and 7 */
+    if (fs_write_begin(fmt.start, 8)) {
+        return -1;
+    }
+    fat32_boot(buf);
+    if (fs_write_next(buf)) {
+        return -1;
+    }
+    fat32_fsinfo(buf);
+    if (fs_write_next(buf) || fs_write_zeros(4)) {
+        return -1;
+    }
+    fat32_boot(buf);
+    if (fs_write_next(buf)) {
+        return -1;
+    }
+    fat32_fsinfo(buf);
+    if (fs_write_next(buf) || fs_write_end()) {
+        return -1;
+    }
+
+    if (fs_write_begin(fmt.start + fmt.fat, 2 * fmt.fatlen + fmt.spc)) {
+        return -1;
+    }
+    for (n = 0; n < 2; n++) {
+        memset(buf, 0, 512);
+        fs_put32(buf, 0x0ffffff8);
+        fs_put32(buf + 4, 0x0fffffff);
+        fs_put32(buf + 8, 0x0fffffff);          /* root directory, one cluster */
+        if (fs_write_next(buf) || fs_write_zeros(fmt.fatlen - 1)) {
+            return -1;
+        }
+    }
+    if (fs_write_zeros(fmt.spc)) {
+        return -1;
+    }
+    return fs_write_end();
+}
+
+
+/*
+ *  exFAT geometry: 128 KB clusters (256 KB past 1 TB), the FAT half an
+ *  alignment unit in, and the cluster heap on an alignment boundary.
+ *  The heap starts with the bitmap, then the up-case table and the root
+ *  directory, one cluster each.
+ */
+static int8_t exfat_layout(uint32_t align) {
+    fmt.spc = fmt.size >= 0x80000000UL ? 512 : 256;
+    fmt.fat = align / 2;
+    fmt.fatlen = ((fmt.size / fmt.spc + 2) * 4 + 511) / 512;
+    fmt.data = fmt.fat + fmt.fatlen;
+    fmt.data += (align - (fmt.start + fmt.data) % align) % align;
+    fmt.clusters = (fmt.size - fmt.data) / fmt.spc;
+    fmt.bitmap = ((fmt.clusters + 7) / 8 + fmt.spc * 512UL - 1) / (fmt.spc * 512UL);
+    return (fmt.size > fmt.data) && (fmt.clusters > fmt.bitmap + 2) ? 0 : -1;
+}
+
+
+static void exfat_boot(uint8_t *buf, uint8_t n) {
+    memset(buf, 0, 512);
+    if (n == 0) {
+        buf[0] = 0xeb;
+        buf[1] = 0x76;
+        buf[2] = 0x90;
+        memcpy_P(buf + 3, exfat_oem, 8);
+        fs_put32(buf + 64, fmt.start);
+        fs_put32(buf + 72, fmt.size);
+        fs_put32(buf + 80, fmt.fat);
+        fs_put32(buf + 84, fmt.fatlen);
+        fs_put32(buf + 88, fmt.data);
+        fs_put32(buf + 92, fmt.clusters);
+        fs_put32(buf + 96, 2 + fmt.bitmap + 1);     /* root directory */
+        fs_put32(buf + 100, fmt.serial);
+        fs_put16(buf + 104, 0x0100);                /* revision 1.00 */
+        buf[108] = 9;                               /* 512-byte sectors */
+        buf[109] = fs_shift(fmt.spc);
+        buf[110] = 1;                               /* FATs */
+        buf[111] = 0x80;
+    }
+    if (n <= 8) {                                   /* main and extended boot sectors */
+        buf[510] = 0x55;
+        buf[511] = 0xaa;
+    }
+}
+
+
+static uint32_t exfat_sum(uint32_t sum, const uint8_t *buf, uint8_t n) {
+    uint16_t i;
+
+    for (i = 0; i < 512; i++) {
+        if ((n == 0) && ((i == 106) || (i == 107) || (i == 112))) {
+            continue;               /* VolumeFlags, PercentInUse */
+        }
+        sum = ((sum & 1) ? 0x80000000UL : 0) + (sum >> 1) + buf[i];
+    }
+    return sum;
+}
+
+
+static int8_t exfat_write(uint8_t *buf) {
+    uint32_t sum;
+    uint32_t upsum;
+    uint16_t c;
+    uint8_t copy;
+    uint8_t n;
+    uint8_t i;
+
+    if (fs_write_begin(fmt.start, 2 * EXFAT_BOOT)) {
+        return -1;
+    }
+    for (copy = 0; copy < 2; copy++) {
+        sum = 0;
+        for (n = 0; n < EXFAT_BOOT - 1; n++) {
+            exfat_boot(buf, n);
+            sum = exfat_sum(sum, buf, n);
+            if (fs_write_next(buf)) {
+                return -1;
+            }
+        }
+        for (c = 0; c < 512; c += 4) {
+            fs_put32(buf + c, sum);
+        }
+        if (fs_write_next(buf)) {
+            return -1;
+        }
+    }
+    if (fs_write_end()) {
+        return -1;
+    }
+
+    if (fs_write_begin(fmt.start + fmt.fat, fmt.fatlen)) {
+        return -1;
+    }
+    memset(buf, 0, 512);
+    fs_put32(buf, 0xfffffff8);
+    fs_put32(buf + 4, 0xffffffff);
+    for (c = 0; c < fmt.bitmap; c++) {
+        fs_put32(buf + 8 + c * 4, c + 1 < fmt.bitmap ? c + 3 : 0xffffffff);
+    }
+    fs_put32(buf + 8 + c * 4, 0xffffffff);          /* up-case table */
+    fs_put32(buf + 12 + c * 4, 0xffffffff);         /* root directory */
+    if (fs_write_next(buf) || fs_write_zeros(fmt.fatlen - 1) || fs_write_end()) {
+        return -1;
+    }
+
+    if (fs_write_begin(fmt.start + fmt.data, (fmt.bitmap + 2) * fmt.spc)) {
+        return -1;
+    }
+    memset(buf, 0, 512);
+    for (c = 0; c < fmt.bitmap + 2; c++) {
+        buf[c >> 3] |= 1 << (c & 7);
+    }
+    if (fs_write_next(buf) || fs_write_zeros(fmt.bitmap * fmt.spc - 1)) {
+        return -1;
+    }
+
+    memset(buf, 0, 512);
+    upsum = 0;
+    for (i = 0; i < sizeof(upcase) / 2; i++) {
+        c = pgm_read_word(&upcase[i]);
+        fs_put16(buf + i * 2, c);
+    }
+    for (c = 0; c < sizeof(upcase); c++) {
+        upsum = ((upsum & 1) ? 0x80000000UL : 0) + (upsum >> 1) + buf[c];
+    }
+    if (fs_write_next(buf) || fs_write_zeros(fmt.spc - 1)) {
+        return -1;
+    }
+
+    memset(buf, 0, 512);
+    buf[0] = 0x81;                                  /* allocation bitmap */
+    fs_put32(buf + 20, 2);
+    fs_put32(buf + 24, (fmt.clusters + 7) / 8);
+    buf[32] = 0x82;                                 /* up-case table */
+    fs_put32(buf + 36, upsum);
+    fs_put32(buf + 52, 2 + fmt.bitmap);
+    fs_put32(buf + 56, sizeof(upcase));
+    if (fs_write_next(buf) || fs_write_zeros(fmt.spc - 1)) {
+        return -1;
+    }
+    return fs_write_end();
+}
+
+
+static int8_t fs_write_mbr(uint8_t *buf) {
+    uint8_t *p;
+
+    memset(buf, 0, 512);
+    p = buf + 446;
+    p[1] = 0xfe;                    /* CHS start and end: use LBA */
+    p[2] = 0xff;
+    p[3] = 0xff;
+    p[4] = (fmt.type == FMT_EXFAT) ? 0x07 : 0x0c;
+    p[5] = 0xfe;
+    p[6] = 0xff;
+    p[7] = 0xff;
+    fs_put32(p + 8, fmt.start);
+    fs_put32(p + 12, fmt.size);
+    buf[510] = 0x55;
+    buf[511] = 0xaa;
+    if (fs_write_begin(0, 1) || fs_write_next(buf)) {
+        return -1;
+    }
+    return fs_write_end();
+}
+
+
+/*
+ *  Format a card of total blocks whose erase unit (AU) is align blocks,
+ *  0 if unknown.  Returns FMT_FAT32 or FMT_EXFAT, or -1.
+ */
+int8_t fs_format(uint32_t total, uint32_t align, uint32_t serial, uint8_t *buf) {
+    int8_t r;
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.serial = serial;
+    fmt.type = total > FMT_FAT32_MAX ? FMT_EXFAT : FMT_FAT32;
+    if (align < FMT_ALIGN_MIN) {
+        align = FMT_ALIGN_MIN;
+    }
+    if (fmt.type == FMT_FAT32) {
+        if (align > 4 * FMT_ALIGN_MIN) {
+            align = 4 * FMT_ALIGN_MIN;  /* the padding must fit the reserved count */
+        }
+    } else if (align < 4 * FMT_ALIGN_MIN) {
+        align = 4 * FMT_ALIGN_MIN;      /* 16 MB, as for SDXC */
+    }
+    if (total <= 2 * align) {
+        return -1;
+    }
+    fmt.start = align;
+    fmt.size = total - align;
+
+    if (fmt.type == FMT_FAT32) {
+        r = fat32_layout(align);
+        if (r == 0) {
+            r = fat32_write(buf);
+        }
+    } else {
+        r = exfat_layout(align);
+        if (r == 0) {
+            r = exfat_write(buf);
+        }
+    }
+    if ((r != 0) || fs_write_mbr(buf)) {
+        return -1;
+    }
+    return fmt.type;
+}
@@ -0,0 +1,28 @@
+#ifndef _SDLOCKER_FSFORMAT_
+#define _SDLOCKER_FSFORMAT_
+
+
+/*
+ *  Quick format: an MBR with one partition aligned to the card's erase
+ *  unit, and a FAT32 (up to 32 GB) or exFAT file system in it.  Only
+ *  metadata blocks are written: boot sectors, FATs, the exFAT bitmap and
+ *  up-case table, and an empty root directory.  The MBR goes last, so an
+ *  interrupted format leaves no partition pointing at a half-built volume.
+ *
+ *  The caller provides multi-block writes; buf is its 512-byte block buffer.
+ */
+#define FMT_FAT32       1           /* fs_format() results */
+#define FMT_EXFAT       2
+
+#define FMT_FAT32_MAX   67108864UL  /* blocks; larger cards get exFAT */
+#define FMT_ALIGN_MIN   8192        /* blocks; 4 MB, the SDHC boundary unit */
+
+
+extern int8_t fs_format(uint32_t total, uint32_t align, uint32_t serial, uint8_t *buf);
+
+/* provided by the caller; all return 0 on success */
+extern int8_t fs_write_begin(uint32_t first, uint32_t count);
+extern int8_t fs_write_next(const uint8_t *buf);   /* NULL writes zeros */
+extern int8_t fs_write_end(void);
+
+#endif /* _SDLOCKER_FSFORMAT_ */
@@ -1,7 +1,25 @@
 #include <avr/io.h>
 
+/*
+ *  Fuses for the clock the firmware is built for (make CLOCK=8, 16 or 20);
+ *  these match FUSES in the Makefile.
+ */
+#if F_CPU == 16000000
+FUSES = {
+    .low = 0xFF /* low-power crystal 8-16 MHz, slow rising power */,
+    .high = HFUSE_DEFAULT,
+    .extended = (FUSE_BODLEVEL0 & FUSE_BODLEVEL1) /*0xFC, BOD at 4.3 V*/
+};
+#elif F_CPU == 20000000
+FUSES = {
+    .low = (FUSE_CKSEL3) /*0xF7, full-swing crystal, slow rising power*/,
+    .high = HFUSE_DEFAULT,
+    .extended = (FUSE_BODLEVEL0 & FUSE_BODLEVEL1) /*0xFC, BOD at 4.3 V*/
+};
+#else
 FUSES = {
     .low = (FUSE_CKSEL0 & FUSE_CKSEL2 & FUSE_CKSEL3 & FUSE_SUT0) /*0xE2*/ /*LFUSE_DEFAULT*/,
     .high = HFUSE_DEFAULT,
     .extended = EFUSE_DEFAULT
 };
+#endif
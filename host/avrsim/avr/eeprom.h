@@ -0,0 +1,22 @@
+#ifndef _AVRSIM_EEPROM_
+#define _AVRSIM_EEPROM_
+
+/*
+ *  EEMEM variables are ordinary ones, starting out as a freshly flashed
+ *  board's would.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+#define eeprom_read_byte(p)             (*(const uint8_t *)(p))
+#define eeprom_read_word(p)             (*(const uint16_t *)(p))
+#define eeprom_read_dword(p)            (*(const uint32_t *)(p))
+#define eeprom_update_byte(p, v)        (*(uint8_t *)(p) = (v))
+#define eeprom_update_word(p, v)        (*(uint16_t *)(p) = (v))
+#define eeprom_update_dword(p, v)       (*(uint32_t *)(p) = (v))
+#define eeprom_read_block(d, s, n)      memcpy((d), (s), (n))
+#define eeprom_update_block(s, d, n)    memcpy((d), (s), (n))
+
+#endif /* _AVRSIM_EEPROM_ */
@@ -0,0 +1,9 @@
+#ifndef _AVRSIM_INTERRUPT_
+#define _AVRSIM_INTERRUPT_
+
+#define cli()
+#define sei()
+#define ISR(vector)             static void __attribute__((unused)) isr_##vector(void)
+#define EMPTY_INTERRUPT(vector)
+
+#endif /* _AVRSIM_INTERRUPT_ */
@@ -0,0 +1,36 @@
+#ifndef _AVRSIM_IO_
+#define _AVRSIM_IO_
+
+/*
+ *  avrsim      just enough of avr-libc to build the firmware for Linux
+ *
+ *  Used by sdreplay only.  The I/O registers are plain bytes defined in
+ *  sdreplay.c; nothing happens when they are written.  SPI transfers go
+ *  through replay_xchg() instead of SPDR (see xchg() in sdlocker2.c).
+ */
+
+#include <stdint.h>
+
+#define _BV(b)          (1 << (b))
+#define RAMSTART        0x100       /* ATmega328P */
+#define RAMEND          0x8ff
+
+extern volatile uint8_t PORTB, DDRB, PINB;
+extern volatile uint8_t PORTC, DDRC, PINC;
+extern volatile uint8_t PORTD, DDRD, PIND;
+extern volatile uint8_t SPCR, SPSR, SPDR;
+extern volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+extern volatile uint8_t ACSR, SREG;
+
+#define SPR0            0           /* SPCR */
+#define SPR1            1
+#define MSTR            4
+#define SPE             6
+#define SPI2X           0           /* SPSR */
+#define SPIF            7
+#define PCIE0           0           /* PCICR */
+#define PCIE1           1
+#define PCIE2           2
+#define ACD             7           /* ACSR */
+
+#endif /* _AVRSIM_IO_ */
@@ -0,0 +1,27 @@
+#ifndef _AVRSIM_PGMSPACE_
+#define _AVRSIM_PGMSPACE_
+
+/*
+ *  Flash is ordinary memory on the host.  printf_P() goes to the board's
+ *  console in sdreplay, which takes AVR conversions: %S for a string in
+ *  flash, and int and long of 16 and 32 bits.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define PGM_P                   const char *
+#define pgm_read_byte(a)        (*(const uint8_t *)(a))
+#define pgm_read_word(a)        (*(const uint16_t *)(a))
+#define pgm_read_dword(a)       (*(const uint32_t *)(a))
+#define memcpy_P                memcpy
+#define strcmp_P                strcmp
+#define strncmp_P               strncmp
+#define strlen_P                strlen
+#define printf_P                avrsim_printf
+
+extern int avrsim_printf(const char *fmt, ...);
+
+#endif /* _AVRSIM_PGMSPACE_ */
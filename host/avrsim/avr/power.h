@@ -0,0 +1,11 @@
+#ifndef _AVRSIM_POWER_
+#define _AVRSIM_POWER_
+
+#define power_adc_disable()
+#define power_twi_disable()
+#define power_timer0_disable()
+#define power_timer2_disable()
+#define power_spi_disable()
+#define power_spi_enable()
+
+#endif /* _AVRSIM_POWER_ */
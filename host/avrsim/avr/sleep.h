@@ -0,0 +1,16 @@
+#ifndef _AVRSIM_SLEEP_
+#define _AVRSIM_SLEEP_
+
+/*
+ *  The firmware sleeps only when it is waiting for the console; sdreplay
+ *  starts the next flow from avrsim_sleep().
+ */
+#define SLEEP_MODE_IDLE         0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()             avrsim_sleep()
+
+extern void avrsim_sleep(void);
+
+#endif /* _AVRSIM_SLEEP_ */
@@ -0,0 +1,28 @@
+#ifndef _AVRSIM_STDIO_
+#define _AVRSIM_STDIO_
+
+/*
+ *  The firmware's standard streams are the board's console in sdreplay,
+ *  not the host's; its "stdout = &uart_output" only sets a dummy.
+ */
+
+#include_next <stdio.h>
+
+#undef stdin
+#undef stdout
+#undef stderr
+#undef getchar
+#undef putchar
+#define stdin                   avrsim_stdin
+#define stdout                  avrsim_stdout
+#define stderr                  avrsim_stderr
+#define getchar()               avrsim_getchar()
+#define putchar(c)              avrsim_putchar(c)
+
+extern FILE *avrsim_stdin;
+extern FILE *avrsim_stdout;
+extern FILE *avrsim_stderr;
+extern int avrsim_getchar(void);
+extern int avrsim_putchar(int c);
+
+#endif /* _AVRSIM_STDIO_ */
@@ -0,0 +1,16 @@
+#ifndef _AVRSIM_CRC16_
+#define _AVRSIM_CRC16_
+
+#include <stdint.h>
+
+static inline uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data) {
+    int i;
+
+    crc ^= (uint16_t)data << 8;
+    for (i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+#endif /* _AVRSIM_CRC16_ */
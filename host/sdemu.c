@@ -0,0 +1,1008 @@
+/*
+ *  sdemu      stand-in for an SDLocker board on a pseudo-terminal
+ *
+ *  usage: sdemu [-r bytes_per_sec] [-e n] image
+ *
+ *  Prints the slave tty name, then answers console commands on it the way
+ *  the firmware does, with image as the card.  Output is paced to the
+ *  board's UART rate (3840 bytes/s at 38400 baud, -r 0 for no limit), and
+ *  input is only read between commands, as on the board, except for the
+ *  control frames of a windowed dump and the data of an upload.  -e n damages every nth frame of a
+ *  windowed dump, to exercise the host's recovery.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+#include "sdlink.h"
+#include "../lz.h"
+#include "../crc32.h"
+#include "../fsdump.h"
+#include "../fsformat.h"
+
+
+#define FILL_RUN_MAX    4096        /* as in the firmware */
+#define STREAM_WINDOW   8           /* as in the firmware */
+#define STREAM_WINDOW_MAX 16
+#define STREAM_RETRY_MS 1000
+#define STREAM_GIVEUP_MS 10000
+
+
+struct card {
+    int fd;
+    uint32_t blocks;
+    int locked;
+    int tlock;
+    uint32_t autoaction;            /* no card slot, so only remembered */
+};
+
+
+static struct card card;
+static char *out;
+static size_t outlen;
+static size_t outpos;
+static size_t outcap;
+static char line[32];
+static size_t linelen;
+static long corrupt_every;
+static unsigned long stream_frames;
+
+
+/*
+ *  A windowed dump in progress; see Stream() in the firmware.
+ */
+struct stream {
+    int active;
+    uint32_t next;
+    uint32_t end;
+    uint32_t acked;
+    uint32_t ring[STREAM_WINDOW_MAX][3];    /* block, count (0 for data), fill */
+    unsigned head;
+    unsigned used;
+    unsigned window;
+    uint32_t runstart;
+    uint32_t runlen;
+    uint8_t runfill;
+    uint8_t status;
+    uint64_t tack;
+    uint64_t tretry;
+    uint8_t rx[FRAME_HDR_LEN + 2];  /* control frame being received */
+    size_t rxlen;
+};
+
+static struct stream stream;
+
+
+/*
+ *  An upload ("w") in progress; see Upload() in the firmware.  The pty
+ *  paces the host, so there is no flow control to do.
+ */
+struct upload {
+    int active;
+    int ok;                         /* card writable and range good */
+    uint32_t first;
+    uint32_t count;
+    uint32_t next;                  /* block the buffer goes to */
+    uint64_t left;                  /* data bytes still to come */
+    uint8_t buf[512];
+    size_t fill;
+    uint64_t t_start;
+    uint64_t t_last;
+};
+
+static struct upload upload;
+
+
+static void emit(const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(out + outlen, outcap - outlen, fmt, ap);
+        va_end(ap);
+        if ((size_t)n < outcap - outlen) {
+            break;
+        }
+        outcap = outcap * 2 + n;
+        out = realloc(out, outcap);
+        if (out == NULL) {
+            exit(1);
+        }
+    }
+    outlen += n;
+}
+
+
+static void emit_raw(const void *p, size_t len) {
+    if (outcap - outlen < len) {
+        outcap = outcap * 2 + len;
+        out = realloc(out, outcap);
+        if (out == NULL) {
+            exit(1);
+        }
+    }
+    memcpy(out + outlen, p, len);
+    outlen += len;
+}
+
+
+static void emit_frame(uint8_t type, uint32_t block, const uint8_t *payload, uint16_t len) {
+    uint8_t hdr[FRAME_HDR_LEN];
+    uint8_t crc[2];
+    uint16_t c;
+
+    hdr[0] = FRAME_SYNC;
+    hdr[1] = type;
+    hdr[2] = len;
+    hdr[3] = len >> 8;
+    hdr[4] = block;
+    hdr[5] = block >> 8;
+    hdr[6] = block >> 16;
+    hdr[7] = block >> 24;
+    c = sdlink_crc16(sdlink_crc16(0, hdr + 1, FRAME_HDR_LEN - 1), payload, len);
+    crc[0] = c;
+    crc[1] = c >> 8;
+    emit_raw(hdr, sizeof(hdr));
+    emit_raw(payload, len);
+    emit_raw(crc, sizeof(crc));
+}
+
+
+static void make_csd(uint8_t *csd) {
+    static const uint8_t proto[16] = {
+        0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00, 0x00,
+        0x00, 0x00, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x01
+    };
+    uint32_t csize;
+
+    memcpy(csd, proto, 16);
+    csize = card.blocks / 1024 - 1;
+    csd[7] = (csize >> 16) & 0x3f;
+    csd[8] = csize >> 8;
+    csd[9] = csize;
+    if (card.tlock) {
+        csd[14] |= 0x10;
+    }
+}
+
+
+static void cmd_info(void) {
+    static const uint8_t ocr[4] = { 0xc0, 0xff, 0x80, 0x00 };
+    static const uint8_t cid[16] = {
+        0x03, 'S', 'D', 'E', 'M', 'U', 'L', 0x80,
+        0x12, 0x34, 0x56, 0x78, 0x01, 0x4a, 0x00, 0x01
+    };
+    uint8_t csd[16];
+    int i;
+
+    make_csd(csd);
+    emit("\r\nCard type 2\r\nOCR = ");
+    for (i = 0; i < 4; i++) emit("%02X ", ocr[i]);
+    emit("\r\nCSD = ");
+    for (i = 0; i < 16; i++) emit("%02X ", csd[i]);
+    emit("\r\nCID = ");
+    for (i = 0; i < 16; i++) emit("%02X ", cid[i]);
+    emit("\r\nPassword status: %s", card.locked ? "locked" : "unlocked");
+}
+
+
+static void dump_line(uint32_t blk, unsigned off, const uint8_t *p) {
+    int i;
+
+    emit("\r\n%02X%08X: ", (unsigned)(blk >> 23) & 0xff, (uint32_t)((blk << 9) + off));
+    for (i = 0; i < 16; i++) emit("%02X ", p[i]);
+    emit(" |");
+    for (i = 0; i < 16; i++) emit("%c", isprint(p[i]) ? p[i] : '.');
+    emit("|");
+}
+
+
+static void cmd_read(uint32_t first, uint32_t count) {
+    uint8_t block[512];
+    uint8_t prev[16];
+    int have_prev = 0;
+    int folding = 0;
+    uint32_t n;
+    unsigned i;
+
+    emit("\r\nReading %u block(s) from block %u...", count, first);
+    for (n = 0; n < count; n++) {
+        if (card.locked || (first + n >= card.blocks) ||
+            (pread(card.fd, block, 512, (off_t)(first + n) * 512) != 512)) {
+            if (card.locked) emit("\r\nDate error: Card is locked!");
+            emit("\r\nRead of block %u failed.", first + n);
+            return;
+        }
+        for (i = 0; i < 512; i += 16) {
+            if (have_prev && (memcmp(prev, block + i, 16) == 0)) {
+                if (!folding) emit("\r\n*");
+                folding = 1;
+                continue;
+            }
+            folding = 0;
+            have_prev = 1;
+            memcpy(prev, block + i, 16);
+            dump_line(first + n, i, block + i);
+        }
+    }
+    emit("\r\n%02X%08X\r\n", (unsigned)((first + count) >> 23) & 0xff, (uint32_t)((first + count) << 9));
+}
+
+
+static uint8_t packbuf[520];
+static size_t packlen;
+
+
+static void pack_byte(uint8_t c) {
+    packbuf[packlen++] = c;
+}
+
+
+/*
+ *  Same choice as frame_block() in the firmware.
+ */
+static void emit_block(uint32_t blk, const uint8_t *block) {
+    uint16_t crc;
+
+    if (lz_pack(block, 512, NULL) + 2 >= 512) {
+        emit_frame(FRAME_DATA, blk, block, 512);
+        return;
+    }
+    crc = sdlink_crc16(0, block, 512);
+    packbuf[0] = crc;
+    packbuf[1] = crc >> 8;
+    packlen = 2;
+    lz_pack(block, 512, pack_byte);
+    emit_frame(FRAME_PACKED, blk, packbuf, packlen);
+}
+
+
+static void emit_fill(uint32_t start, uint32_t len, uint8_t fill) {
+    uint8_t p[5] = { len, len >> 8, len >> 16, len >> 24, fill };
+
+    if (len) {
+        emit_frame(FRAME_FILL, start, p, sizeof(p));
+    }
+}
+
+
+/*
+ *  Same frames as DumpRange() in the firmware; returns the blocks read.
+ */
+static uint32_t emit_range(uint32_t first, uint32_t count) {
+    uint8_t block[512];
+    uint32_t runstart = first;
+    uint32_t runlen = 0;
+    uint8_t runfill = 0;
+    uint32_t n;
+    unsigned i;
+
+    for (n = 0; n < count; n++) {
+        if (card.locked || (first + n >= card.blocks) ||
+            (pread(card.fd, block, 512, (off_t)(first + n) * 512) != 512)) {
+            break;
+        }
+        for (i = 1; (i < 512) && (block[i] == block[0]); i++)
+            ;
+        if (i == 512) {
+            if (runlen && (block[0] == runfill) && (runlen < FILL_RUN_MAX)) {
+                runlen++;
+                continue;
+            }
+            emit_fill(runstart, runlen, runfill);
+            runstart = first + n;
+            runlen = 1;
+            runfill = block[0];
+            continue;
+        }
+        emit_fill(runstart, runlen, runfill);
+        runlen = 0;
+        emit_block(first + n, block);
+    }
+    emit_fill(runstart, runlen, runfill);
+    return n;
+}
+
+
+static void emit_end(uint32_t block, uint8_t status) {
+    emit_frame(FRAME_END, block, &status, 1);
+}
+
+
+/*
+ *  Send (or resend) a frame of the windowed dump, damaging one now and
+ *  then with -e.
+ */
+static void stream_send(const uint32_t *f) {
+    uint8_t block[512];
+
+    if (f[1]) {
+        emit_fill(f[0], f[1], f[2]);
+    } else if (card.locked || (pread(card.fd, block, 512, (off_t)f[0] * 512) != 512)) {
+        return;                     /* the host asks again; the firmware would give up */
+    } else {
+        emit_block(f[0], block);
+    }
+    if (corrupt_every && (++stream_frames % corrupt_every == 0)) {
+        out[outlen - 3] ^= 0x55;
+    }
+}
+
+
+static void stream_push(uint32_t block, uint32_t count, uint8_t fill) {
+    uint32_t *f = stream.ring[(stream.head + stream.used) % STREAM_WINDOW_MAX];
+
+    f[0] = block;
+    f[1] = count;
+    f[2] = fill;
+    if (stream.used++ == 0) {
+        stream.tack = stream.tretry = sdlink_now_ms();
+    }
+    stream_send(f);
+}
+
+
+static void stream_resend(uint32_t block) {
+    unsigned i;
+
+    stream.tretry = sdlink_now_ms();
+    for (i = 0; i < stream.used; i++) {
+        if (stream.ring[(stream.head + i) % STREAM_WINDOW_MAX][0] == block) {
+            stream_send(stream.ring[(stream.head + i) % STREAM_WINDOW_MAX]);
+            return;
+        }
+    }
+}
+
+
+static void stream_finish(void) {
+    emit_end(stream.acked < stream.end ? stream.acked : stream.end, stream.status);
+    emit("\r\n> ");
+    stream.active = 0;
+}
+
+
+/*
+ *  One byte of host input during the dump.
+ */
+static void stream_byte(uint8_t c) {
+    uint32_t *f;
+    uint32_t block;
+
+    if ((stream.rxlen == 0) && (c != FRAME_SYNC)) {
+        return;
+    }
+    stream.rx[stream.rxlen++] = c;
+    if (stream.rxlen < sizeof(stream.rx)) {
+        return;
+    }
+    stream.rxlen = 0;
+    if ((stream.rx[2] != 0) || (stream.rx[3] != 0) ||
+        (sdlink_crc16(0, stream.rx + 1, FRAME_HDR_LEN - 1) != (stream.rx[8] | (stream.rx[9] << 8)))) {
+        return;
+    }
+    block = sdlink_le32(stream.rx + 4);
+    if (stream.rx[1] == FRAME_CANCEL) {
+        stream.status = FRAME_ABORTED;
+        stream_finish();
+    } else if (stream.rx[1] == FRAME_RESEND) {
+        stream_resend(block);
+    } else if ((stream.rx[1] == FRAME_ACK) && (block > stream.acked)) {
+        stream.acked = block;
+        stream.tack = stream.tretry = sdlink_now_ms();
+        while (stream.used) {
+            f = stream.ring[stream.head];
+            if (f[0] + (f[1] ? f[1] : 1) > block) {
+                break;
+            }
+            stream.head = (stream.head + 1) % STREAM_WINDOW_MAX;
+            stream.used--;
+        }
+    }
+}
+
+
+/*
+ *  Called with the output drained: read blocks until a frame goes out or
+ *  the window is full, as the firmware's loop does between acks.
+ */
+static void stream_step(void) {
+    uint8_t block[512];
+    uint64_t now = sdlink_now_ms();
+    size_t before = outlen;
+    unsigned i;
+
+    if (stream.acked >= stream.end) {
+        stream_finish();
+        return;
+    }
+    if (stream.used && (now - stream.tack > STREAM_GIVEUP_MS)) {
+        stream.status = FRAME_ABORTED;
+        stream_finish();
+        return;
+    }
+    if (stream.used && (now - stream.tretry > STREAM_RETRY_MS)) {
+        stream_resend(stream.ring[stream.head][0]);
+        return;
+    }
+    while ((outlen == before) && (stream.next < stream.end) && (stream.used + 2 <= stream.window)) {
+        if (card.locked || (stream.next >= card.blocks) ||
+            (pread(card.fd, block, 512, (off_t)stream.next * 512) != 512)) {
+            stream.status = FRAME_RDERR;
+            stream.end = stream.next;
+        } else {
+            for (i = 1; (i < 512) && (block[i] == block[0]); i++)
+                ;
+            if ((i == 512) && stream.runlen && (block[0] == stream.runfill) && (stream.runlen < FILL_RUN_MAX)) {
+                stream.runlen++;
+            } else {
+                if (stream.runlen) {
+                    stream_push(stream.runstart, stream.runlen, stream.runfill);
+                }
+                stream.runlen = 0;
+                if (i == 512) {
+                    stream.runstart = stream.next;
+                    stream.runlen = 1;
+                    stream.runfill = block[0];
+                } else {
+                    stream_push(stream.next, 0, 0);
+                }
+            }
+            stream.next++;
+        }
+        if ((stream.next == stream.end) && stream.runlen) {
+            stream_push(stream.runstart, stream.runlen, stream.runfill);
+            stream.runlen = 0;
+        }
+    }
+}
+
+
+static void cmd_stream(uint32_t first, uint32_t count, uint32_t window) {
+    emit("\r\n");
+    memset(&stream, 0, sizeof(stream));
+    stream.active = 1;
+    stream.next = first;
+    stream.end = first + count;
+    stream.acked = first;
+    stream.window = window < 2 ? 2 : window;
+    stream.status = FRAME_OK;
+}
+
+
+static void cmd_dump(uint32_t first, uint32_t count) {
+    uint32_t n;
+
+    emit("\r\n");
+    n = emit_range(first, count);
+    emit_end(first + n, n == count ? FRAME_OK : FRAME_RDERR);
+}
+
+
+/*
+ *  Same as DeltaDump() in the firmware.
+ */
+static void cmd_delta(uint32_t first, uint32_t count, uint32_t crc) {
+    uint8_t block[512];
+    uint32_t c = 0;
+    uint32_t n;
+
+    emit("\r\n");
+    for (n = 0; n < count; n++) {
+        if (card.locked || (first + n >= card.blocks) ||
+            (pread(card.fd, block, 512, (off_t)(first + n) * 512) != 512)) {
+            emit_end(first + n, FRAME_RDERR);
+            return;
+        }
+        c = crc32_update(c, block, 512);
+    }
+    if (c == crc) {
+        emit_end(first + count, FRAME_UNCHANGED);
+        return;
+    }
+    n = emit_range(first, count);
+    emit_end(first + n, n == count ? FRAME_OK : FRAME_RDERR);
+}
+
+
+/*
+ *  Block I/O for fs_dump(), as in the firmware.
+ */
+int8_t fs_read_block(uint32_t blocknum, uint8_t *buf) {
+    if (card.locked || (blocknum >= card.blocks) ||
+        (pread(card.fd, buf, 512, (off_t)blocknum * 512) != 512)) {
+        return -1;
+    }
+    return 0;
+}
+
+
+int8_t fs_send_range(uint32_t first, uint32_t count) {
+    return emit_range(first, count) == count ? 0 : -1;
+}
+
+
+void fs_send_zero(uint32_t first, uint32_t count) {
+    while (count) {
+        emit_fill(first, count < FILL_RUN_MAX ? count : FILL_RUN_MAX, 0);
+        first += FILL_RUN_MAX;
+        count = count < FILL_RUN_MAX ? 0 : count - FILL_RUN_MAX;
+    }
+}
+
+
+void fs_send_copy(uint32_t from, uint32_t to, uint32_t count) {
+    uint8_t p[8] = { from, from >> 8, from >> 16, from >> 24, count, count >> 8, count >> 16, count >> 24 };
+
+    emit_frame(FRAME_COPY, to, p, sizeof(p));
+}
+
+
+static void cmd_fsdump(void) {
+    uint8_t buf[512];
+    uint32_t total = card.blocks / 1024 * 1024;    /* capacity as the CSD gives it */
+
+    emit("\r\n");
+    emit_end(total, fs_dump(total, buf) == 0 ? FRAME_OK : FRAME_RDERR);
+}
+
+
+static uint32_t wr_next;
+static uint32_t wr_left;
+
+
+/*
+ *  Block writes for fs_format(), as in the firmware.
+ */
+int8_t fs_write_begin(uint32_t first, uint32_t count) {
+    if (card.locked || card.tlock || (first >= card.blocks) || (count > card.blocks - first)) {
+        return -1;
+    }
+    wr_next = first;
+    wr_left = count;
+    return 0;
+}
+
+
+int8_t fs_write_next(const uint8_t *buf) {
+    static const uint8_t zeros[512];
+    static uint16_t n;
+
+    if ((++n & 0x3ff) == 0) {
+        emit(".");
+    }
+    if ((wr_left == 0) || (pwrite(card.fd, buf ? buf : zeros, 512, (off_t)wr_next * 512) != 512)) {
+        return -1;
+    }
+    wr_next++;
+    wr_left--;
+    return 0;
+}
+
+
+int8_t fs_write_end(void) {
+    return 0;
+}
+
+
+static void cmd_format(void) {
+    uint8_t buf[512];
+    uint64_t start = sdlink_now_ms();
+    int8_t r;
+
+    emit("\r\nFormatting card...");
+    r = fs_format(card.blocks / 1024 * 1024, 8192, (uint32_t)start, buf);
+    if (r < 0) {
+        emit("failed.");
+        return;
+    }
+    emit("done, %s in %u ms.", r == FMT_EXFAT ? "exFAT" : "FAT32", (unsigned)(sdlink_now_ms() - start));
+}
+
+
+/*
+ *  erase <first> <last>: erased blocks read as zeros.
+ */
+static void cmd_erase_range(uint32_t first, uint32_t last) {
+    static const uint8_t zeros[512];
+    uint32_t n;
+
+    emit("\r\nErasing blocks %u to %u...", first, last);
+    if ((last < first) || (last >= card.blocks / 1024 * 1024)) {
+        emit("failed; bad block range.");
+        return;
+    }
+    for (n = first; n <= last; n++) {
+        if (card.locked || card.tlock || (pwrite(card.fd, zeros, 512, (off_t)n * 512) != 512)) {
+            emit("failed near block %u.", n);
+            return;
+        }
+    }
+    emit("done in 0 ms, longest busy 0 ms.");
+}
+
+
+/*
+ *  wipe <first> <last> [mode]: same per-block patterns as the firmware.
+ */
+static uint32_t pattern_state;
+
+
+static void pattern_block(uint8_t *buf, uint32_t block, uint32_t seed, uint32_t mode) {
+    uint32_t w;
+    int i;
+
+    pattern_state = seed ^ (block * 0x9e3779b9u);
+    if (pattern_state == 0) {
+        pattern_state = 1;
+    }
+    for (i = 0; i < 512; i += 4) {
+        w = mode == 0 ? 0 : 0xffffffffu;
+        if (mode == 2) {
+            pattern_state ^= pattern_state << 13;
+            pattern_state ^= pattern_state >> 17;
+            pattern_state ^= pattern_state << 5;
+            w = pattern_state;
+        }
+        memcpy(buf + i, &w, 4);
+    }
+}
+
+
+static void cmd_wipe(uint32_t first, uint32_t last, uint32_t mode) {
+    uint8_t want[512];
+    uint8_t got[512];
+    uint32_t seed = (uint32_t)sdlink_now_ms() | 1;
+    uint32_t bad = 0;
+    uint32_t n;
+
+    if (mode > 2) {
+        emit("\r\nUsage: wipe <first> <last> [0=zeros|1=ones|2=random]");
+        return;
+    }
+    emit("\r\nWiping blocks %u to %u...", first, last);
+    if ((last < first) || (last >= card.blocks / 1024 * 1024)) {
+        emit("failed; bad block range.");
+        return;
+    }
+    if (mode == 2) {
+        emit("pattern seed %08X", seed);
+    }
+    for (n = first; n <= last; n++) {
+        pattern_block(want, n, seed, mode);
+        if (card.locked || card.tlock || (pwrite(card.fd, want, 512, (off_t)n * 512) != 512)) {
+            emit("\r\nWrite failed near block %u; wipe stopped.", n);
+            return;
+        }
+    }
+    for (n = first; n <= last; n++) {
+        pattern_block(want, n, seed, mode);
+        if ((pread(card.fd, got, 512, (off_t)n * 512) != 512) || memcmp(got, want, 512)) {
+            if (bad < 16) {
+                emit("\r\nMismatch in block %u", n);
+            }
+            bad++;
+        }
+        if ((n - first) % 2048 == 2047) {
+            emit(".");
+        }
+    }
+    emit("\r\n%u blocks in 0 ms", last - first + 1);
+    if (bad) {
+        emit(", verify failed: %u bad block(s).", bad);
+    } else {
+        emit(", verified.");
+    }
+}
+
+
+static void cmd_auto(uint32_t action) {
+    static const char *names[] = {
+        "off", "pwd lock", "pwd unlock", "force erase", "temp lock", "temp unlock", "format"
+    };
+
+    if (action > 6) {
+        emit("\r\nUsage: auto [0=off|1=P|2=p|3=E|4=l|5=u|6=format]");
+        return;
+    }
+    card.autoaction = action;
+    emit("\r\nAuto mode: %s, 0 passed, 0 failed.", names[action]);
+}
+
+
+static void cmd_erase(void) {
+    emit("\r\nTrying to ERASE SD CARD...");
+    if (!card.locked) {
+        emit("the card is not locked");
+        return;
+    }
+    emit("please wait...");
+    if ((ftruncate(card.fd, 0) < 0) || (ftruncate(card.fd, (off_t)card.blocks * 512) < 0)) {
+        emit("failed!  Card is still locked.");
+        return;
+    }
+    card.locked = 0;
+    emit("done.");
+}
+
+
+static void cmd_upload(uint32_t first, uint32_t count) {
+    memset(&upload, 0, sizeof(upload));
+    upload.active = 1;
+    upload.ok = !card.locked && count && (first < card.blocks) && (count <= card.blocks - first);
+    upload.first = first;
+    upload.count = count;
+    upload.next = first;
+    upload.left = (uint64_t)count * 512;
+    upload.t_start = upload.t_last = sdlink_now_ms();
+}
+
+
+static void upload_finish(const char *why) {
+    uint64_t ms = sdlink_now_ms() - upload.t_start;
+
+    upload.active = 0;
+    if (!upload.ok) {
+        emit("\r\nUpload failed; no writable card or bad block range.");
+    } else if (why) {
+        emit("\r\nUpload failed; %s at block %u.", why, upload.next);
+    } else {
+        emit("\r\n%u blocks in %u ms (%u KB/s)", upload.count, (unsigned)ms,
+             (unsigned)(upload.count * 500ULL / (ms ? ms : 1)));
+    }
+    emit("\r\n> ");
+}
+
+
+static void upload_byte(uint8_t c) {
+    upload.buf[upload.fill++] = c;
+    upload.left--;
+    upload.t_last = sdlink_now_ms();
+    if (upload.fill == 512) {
+        if (upload.ok && (pwrite(card.fd, upload.buf, 512, (off_t)upload.next * 512) != 512)) {
+            upload_finish("write error");
+            return;
+        }
+        upload.next++;
+        upload.fill = 0;
+    }
+    if (upload.left == 0) {
+        upload_finish(NULL);
+    }
+}
+
+
+static void run_line(void) {
+    char *word;
+    char *arg;
+    uint32_t args[3] = { 0, 1, 0 };
+    int argc = 0;
+
+    line[linelen] = 0;
+    linelen = 0;
+    word = strtok(line, " ");
+    if (word == NULL) {
+        return;
+    }
+    while ((argc < 3) && ((arg = strtok(NULL, " ")) != NULL)) {
+        args[argc++] = strtoul(arg, NULL, 0);
+    }
+    if (strcmp(word, "r") == 0) {
+        cmd_read(args[0], args[1]);
+    } else if ((strcmp(word, "d") == 0) && (argc >= 2)) {
+        cmd_dump(args[0], args[1]);
+    } else if ((strcmp(word, "erase") == 0) && (argc >= 2)) {
+        cmd_erase_range(args[0], args[1]);
+    } else if (strcmp(word, "erase") == 0) {
+        emit("\r\nUsage: erase <first> <last>");
+    } else if ((strcmp(word, "wipe") == 0) && (argc >= 2)) {
+        cmd_wipe(args[0], args[1], argc >= 3 ? args[2] : 0);
+    } else if (strcmp(word, "wipe") == 0) {
+        emit("\r\nUsage: wipe <first> <last> [0=zeros|1=ones|2=random]");
+    } else if (strcmp(word, "auto") == 0) {
+        cmd_auto(argc ? args[0] : card.autoaction);
+    } else if (strcmp(word, "trace") == 0) {
+        emit("\r\nTrace not built in; rebuild with make TRACE=1.");
+    } else if (strcmp(word, "format") == 0) {
+        cmd_format();
+    } else if (strcmp(word, "fs") == 0) {
+        cmd_fsdump();
+    } else if (strcmp(word, "d") == 0) {
+        emit("\r\nUsage: d <block> <count>");
+    } else if ((strcmp(word, "s") == 0) && (argc >= 2)) {
+        cmd_stream(args[0], args[1], (argc < 3) || (args[2] > STREAM_WINDOW_MAX) ? STREAM_WINDOW : args[2]);
+    } else if ((strcmp(word, "c") == 0) && (argc >= 3)) {
+        cmd_delta(args[0], args[1], args[2]);
+    } else if (strcmp(word, "c") == 0) {
+        emit("\r\nUsage: c <block> <count> <crc32>");
+    } else if (strcmp(word, "s") == 0) {
+        emit("\r\nUsage: s <block> <count> [window]");
+    } else if ((strcmp(word, "w") == 0) && (argc >= 2)) {
+        cmd_upload(args[0], args[1]);
+    } else if (strcmp(word, "w") == 0) {
+        emit("\r\nUsage: w <block> <count>, then count * 512 bytes");
+    } else {
+        emit("\r\nUnknown command.");
+    }
+}
+
+
+/*
+ *  Same rules as ReadConsole() in the firmware.
+ */
+static void console_char(char c) {
+    static int ctlskip;
+
+    if (ctlskip) {
+        ctlskip--;
+        return;
+    }
+    if ((uint8_t)c == FRAME_SYNC) {
+        ctlskip = FRAME_HDR_LEN + 1;
+        return;
+    }
+    if (linelen == 0) {
+        switch (c) {
+        case '?':   cmd_info(); emit("\r\n> "); return;
+        case 'P':
+            if (!card.locked) {
+                emit("\r\nTrying to lock card...done.");
+                card.locked = 1;
+            }
+            emit("\r\n> ");
+            return;
+        case 'p':
+            if (card.locked) {
+                emit("\r\nTrying to unlock card...done.");
+                card.locked = 0;
+            }
+            emit("\r\n> ");
+            return;
+        case 'l':
+        case 'u':
+            emit("\r\n%s temporary lock on SD card...done.\r\n> ", c == 'l' ? "Setting" : "Clearing");
+            card.tlock = (c == 'l');
+            return;
+        case 'E':   cmd_erase(); emit("\r\n> "); return;
+        }
+    }
+    if ((c == '\r') || (c == '\n')) {
+        if (linelen == 0) {
+            if (c == '\r') emit("\r\n> ");
+            return;
+        }
+        run_line();
+        if (!stream.active && !upload.active) {
+            emit("\r\n> ");
+        }
+        return;
+    }
+    if (((c == '\b') || (c == 0x7f)) && linelen) {
+        linelen--;
+        emit("\b \b");
+    } else if (isprint((unsigned char)c) && (linelen < sizeof(line) - 1)) {
+        line[linelen++] = c;
+        emit("%c", c);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    struct termios tio;
+    struct pollfd pfd;
+    struct stat st;
+    uint64_t t_last;
+    double credit;
+    long rate = 3840;
+    int master;
+    int slave;
+    int c;
+    char ch;
+    ssize_t n;
+    size_t chunk;
+
+    while ((c = getopt(argc, argv, "r:e:")) != -1) {
+        if (c == 'r') rate = strtol(optarg, NULL, 0);
+        else if (c == 'e') corrupt_every = strtol(optarg, NULL, 0);
+        else return 2;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: sdemu [-r bytes_per_sec] [-e n] image\n");
+        return 2;
+    }
+    card.fd = open(argv[optind], O_RDWR);
+    if ((card.fd < 0) || (fstat(card.fd, &st) < 0)) {
+        perror(argv[optind]);
+        return 1;
+    }
+    card.blocks = st.st_size / 512;
+    if (card.blocks < 1024) {
+        fprintf(stderr, "%s: image must be at least 512 KB\n", argv[optind]);
+        return 1;
+    }
+
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if ((master < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0)) {
+        perror("pty");
+        return 1;
+    }
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);  /* held open so hangups don't EIO */
+    if ((slave < 0) || (tcgetattr(slave, &tio) < 0)) {
+        perror(ptsname(master));
+        return 1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    emit("\r\nSDLocker2.1 (sdemu)\r\n> ");
+    t_last = sdlink_now_ms();
+    credit = 0;
+    pfd.fd = master;
+    for (;;) {
+        pfd.events = (outpos < outlen) ? POLLOUT : POLLIN;
+        if (stream.active || upload.active) {
+            pfd.events |= POLLIN;
+        }
+        if (poll(&pfd, 1, 10) < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        if (stream.active && (pfd.revents & POLLIN)) {
+            while (stream.active && (read(master, &ch, 1) == 1)) {
+                stream_byte(ch);
+            }
+        }
+        if (upload.active) {
+            while (upload.active && (read(master, &ch, 1) == 1)) {
+                upload_byte(ch);
+            }
+            if (upload.active && (sdlink_now_ms() - upload.t_last > 3000)) {
+                upload_finish("no data for 3000 ms");
+            }
+        }
+        if (outpos < outlen) {
+            uint64_t now = sdlink_now_ms();
+
+            chunk = outlen - outpos;
+            if (rate > 0) {
+                credit += (now - t_last) * rate / 1000.0;
+                if (credit > rate / 10.0) credit = rate / 10.0;
+                if (chunk > (size_t)credit) chunk = (size_t)credit;
+            }
+            t_last = now;
+            if ((chunk > 0) && (pfd.revents & POLLOUT)) {
+                n = write(master, out + outpos, chunk);
+                if (n > 0) {
+                    outpos += n;
+                    credit -= n;
+                }
+            }
+            if (outpos == outlen) {
+                outpos = outlen = 0;
+            }
+            continue;
+        }
+        t_last = sdlink_now_ms();
+        if (stream.active) {
+            stream_step();
+            continue;
+        }
+        if (pfd.revents & POLLIN) {
+            while ((outlen == 0) && !upload.active && (read(master, &ch, 1) == 1)) {
+                console_char(ch);
+            }
+        }
+    }
+}
@@ -0,0 +1,547 @@
+/*
+ *  sdfleet      run card jobs on many SDLocker boards from one thread
+ *
+ *  usage: sdfleet [-b baud] [-w window] [-j jobfile] tty...
+ *
+ *  Every board's tty is opened and watched with epoll.  Jobs are read one
+ *  per line from jobfile, or from stdin if none is given, and each goes to
+ *  the first idle board:
+ *
+ *      [@board] info | lock | unlock | tlock | tunlock | erase
+ *      [@board] image [-f] <file> [first] [count]
+ *
+ *  "@2" pins a job to the third board on the command line.  In an image
+ *  file name %b is replaced by the board number and %n by the job number.
+ *  When the job list has ended and every board is idle, a summary of jobs,
+ *  throughput and command latency per board is printed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "sdlink.h"
+#include "sdimage.h"
+
+
+#define MAX_BOARDS      32
+
+
+enum stage {
+    STAGE_QUEUED,
+    STAGE_SIZING,                   /* image: reading the CSD for capacity */
+    STAGE_RUNNING,
+    STAGE_DONE
+};
+
+
+struct job {
+    struct job *next;
+    int num;
+    int pin;                        /* board index, or -1 for any */
+    char op[16];
+    char file[256];
+    uint32_t first;
+    uint32_t count;                 /* image: 0 means to the end of the card */
+    int fresh;
+    enum stage stage;
+    int failed;
+    uint64_t t_queued;
+    uint64_t t_start;
+};
+
+
+struct board {
+    int idx;
+    int up;                         /* link usable */
+    int watching_out;               /* EPOLLOUT currently requested */
+    struct sdlink link;
+    struct job *job;
+    struct sdimage im;
+    unsigned jobs_ok;
+    unsigned jobs_failed;
+    uint64_t blocks;                /* blocks imaged */
+    uint64_t busy_ms;
+};
+
+
+static struct board boards[MAX_BOARDS];
+static int nboards;
+static struct job *queue_head;
+static struct job *queue_tail;
+static int jobs_eof;
+static int epfd;
+static uint64_t t_begin;
+static volatile sig_atomic_t stopping;
+
+
+static void on_signal(int sig) {
+    stopping = 1;
+}
+
+
+static double elapsed(void) {
+    return (sdlink_now_ms() - t_begin) / 1000.0;
+}
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: sdfleet [-b baud] [-w window] [-j jobfile] tty...\n");
+    exit(2);
+}
+
+
+/*
+ *  Parse one job line and append it to the queue.
+ */
+static void add_job(char *line) {
+    static int num;
+    struct job *job;
+    char *word;
+    char *args[4];
+    int argc = 0;
+
+    line[strcspn(line, "\r\n#")] = 0;
+    job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        exit(1);
+    }
+    job->pin = -1;
+    word = strtok(line, " \t");
+    if (word && (word[0] == '@')) {
+        job->pin = atoi(word + 1);
+        word = strtok(NULL, " \t");
+    }
+    if (word == NULL) {
+        free(job);
+        return;
+    }
+    while ((argc < 4) && ((args[argc] = strtok(NULL, " \t")) != NULL)) {
+        argc++;
+    }
+    snprintf(job->op, sizeof(job->op), "%s", word);
+    if (strcmp(word, "image") == 0) {
+        int a = 0;
+
+        if ((argc > 0) && (strcmp(args[0], "-f") == 0)) {
+            job->fresh = 1;
+            a++;
+        }
+        if (a >= argc) {
+            fprintf(stderr, "image job needs a file name\n");
+            free(job);
+            return;
+        }
+        snprintf(job->file, sizeof(job->file), "%s", args[a]);
+        job->first = a + 1 < argc ? strtoul(args[a + 1], NULL, 0) : 0;
+        job->count = a + 2 < argc ? strtoul(args[a + 2], NULL, 0) : 0;
+    } else if (strcmp(word, "info") && strcmp(word, "lock") && strcmp(word, "unlock") &&
+               strcmp(word, "tlock") && strcmp(word, "tunlock") && strcmp(word, "erase")) {
+        fprintf(stderr, "unknown job \"%s\"\n", word);
+        free(job);
+        return;
+    }
+    if ((job->pin >= nboards) || (job->pin < -1)) {
+        fprintf(stderr, "no board %d\n", job->pin);
+        free(job);
+        return;
+    }
+    job->num = ++num;
+    job->t_queued = sdlink_now_ms();
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+}
+
+
+static void finish_job(struct board *b, int failed, const char *detail) {
+    struct job *job = b->job;
+    uint64_t took;
+
+    took = sdlink_now_ms() - job->t_start;
+    b->busy_ms += took;
+    if (failed) {
+        b->jobs_failed++;
+    } else {
+        b->jobs_ok++;
+    }
+    printf("[%8.1f] board %d job %d %s: %s%s%s, %.1f s (queued %.1f s)\n",
+        elapsed(), b->idx, job->num, job->op, failed ? "FAILED" : "ok",
+        detail ? ", " : "", detail ? detail : "",
+        took / 1000.0, (job->t_start - job->t_queued) / 1000.0);
+    fflush(stdout);
+    job->stage = STAGE_DONE;
+    free(job);
+    b->job = NULL;
+}
+
+
+static void board_down(struct board *b, const char *why) {
+    fprintf(stderr, "[%8.1f] board %d (%s): %s, taken out of service\n", elapsed(), b->idx, b->link.path, why);
+    b->up = 0;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, b->link.fd, NULL);
+    if (b->job) {
+        if (b->job->stage == STAGE_RUNNING && !strcmp(b->job->op, "image")) {
+            sdimage_close(&b->im);
+        }
+        finish_job(b, 1, why);
+    }
+}
+
+
+static void simple_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct board *b = arg;
+
+    if (b->job == NULL) {
+        return;
+    }
+    finish_job(b, (reply == NULL) || strstr(reply, "failed") || strstr(reply, "Cannot initialize"),
+        reply == NULL ? "no reply" : NULL);
+}
+
+
+static void start_image(struct board *b) {
+    struct job *job = b->job;
+    char path[300];
+    char *p;
+    size_t n = 0;
+
+    for (p = job->file; *p && (n < sizeof(path) - 12); p++) {
+        if ((p[0] == '%') && (p[1] == 'b')) {
+            n += sprintf(path + n, "%d", b->idx);
+            p++;
+        } else if ((p[0] == '%') && (p[1] == 'n')) {
+            n += sprintf(path + n, "%d", job->num);
+            p++;
+        } else {
+            path[n++] = *p;
+        }
+    }
+    path[n] = 0;
+    b->im.verbose = 0;
+    b->im.window = SDIMAGE_WINDOW;
+    if (sdimage_open(&b->im, path, job->first, job->count, job->fresh) < 0) {
+        finish_job(b, 1, strerror(errno));
+        return;
+    }
+    job->stage = STAGE_RUNNING;
+}
+
+
+static void sizing_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct board *b = arg;
+    uint8_t csd[16];
+    uint32_t blocks;
+
+    if (b->job == NULL) {
+        return;
+    }
+    if ((reply == NULL) || (sdlink_parse_hex(reply, "CSD = ", csd, sizeof(csd)) < 0)) {
+        finish_job(b, 1, "cannot read CSD");
+        return;
+    }
+    blocks = sdlink_csd_blocks(csd);
+    if (blocks <= b->job->first) {
+        finish_job(b, 1, "start is past end of card");
+        return;
+    }
+    b->job->count = blocks - b->job->first;
+    start_image(b);
+}
+
+
+static void start_job(struct board *b, struct job *job) {
+    static const char *const ops[][2] = {
+        { "info", "?" }, { "lock", "P" }, { "unlock", "p" },
+        { "tlock", "l" }, { "tunlock", "u" }, { "erase", "E" }
+    };
+
+    b->job = job;
+    job->t_start = sdlink_now_ms();
+    job->stage = STAGE_RUNNING;
+    if (strcmp(job->op, "image") == 0) {
+        if (job->count == 0) {
+            job->stage = STAGE_SIZING;
+            sdlink_submit(&b->link, "?", sizing_cb, b);
+        } else {
+            start_image(b);
+        }
+        return;
+    }
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(job->op, ops[i][0]) == 0) {
+            sdlink_submit(&b->link, ops[i][1], simple_cb, b);
+            return;
+        }
+    }
+}
+
+
+/*
+ *  Hand queued jobs to idle boards, honouring pins.
+ */
+static void dispatch(void) {
+    struct job *prev;
+    struct job *job;
+
+    for (int i = 0; i < nboards; i++) {
+        struct board *b = &boards[i];
+
+        if (!b->up || b->job || stopping) {
+            continue;
+        }
+        for (prev = NULL, job = queue_head; job; prev = job, job = job->next) {
+            if ((job->pin == -1) || (job->pin == b->idx)) {
+                if (prev) {
+                    prev->next = job->next;
+                } else {
+                    queue_head = job->next;
+                }
+                if (queue_tail == job) {
+                    queue_tail = prev;
+                }
+                job->next = NULL;
+                start_job(b, job);
+                break;
+            }
+        }
+    }
+}
+
+
+/*
+ *  Advance running image jobs, push out queued commands and keep each
+ *  board's epoll interest in step with whether it has something to send.
+ */
+static void service(void) {
+    struct epoll_event ev;
+
+    for (int i = 0; i < nboards; i++) {
+        struct board *b = &boards[i];
+
+        if (!b->up) {
+            continue;
+        }
+        if (b->job && (b->job->stage == STAGE_RUNNING) && !strcmp(b->job->op, "image")) {
+            sdimage_fill(&b->link, &b->im);
+            if (sdimage_finished(&b->im) && (sdlink_pending(&b->link) == 0)) {
+                char detail[64];
+                int failed = b->im.error;
+
+                b->blocks += b->im.done - b->im.resumed;
+                snprintf(detail, sizeof(detail), "%u blocks", b->im.done - b->im.resumed);
+                sdimage_close(&b->im);
+                finish_job(b, failed, detail);
+            }
+        }
+        if (sdlink_write(&b->link) < 0) {
+            board_down(b, strerror(errno));
+            continue;
+        }
+        if (sdlink_want_write(&b->link) != b->watching_out) {
+            b->watching_out = !b->watching_out;
+            ev.events = EPOLLIN | (b->watching_out ? EPOLLOUT : 0);
+            ev.data.ptr = b;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, b->link.fd, &ev);
+        }
+    }
+}
+
+
+static void read_jobs(int fd) {
+    static char buf[4096];
+    static size_t len;
+    char *nl;
+    ssize_t n;
+
+    n = read(fd, buf + len, sizeof(buf) - len - 1);
+    if (n <= 0) {
+        if ((n < 0) && (errno == EAGAIN)) {
+            return;
+        }
+        if (len) {
+            buf[len] = 0;
+            add_job(buf);
+        }
+        jobs_eof = 1;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+        return;
+    }
+    len += n;
+    buf[len] = 0;
+    while ((nl = strchr(buf, '\n')) != NULL) {
+        *nl = 0;
+        add_job(buf);
+        len -= nl + 1 - buf;
+        memmove(buf, nl + 1, len + 1);
+    }
+    if (len == sizeof(buf) - 1) {
+        len = 0;                        /* absurdly long line; drop it */
+    }
+}
+
+
+static int all_idle(void) {
+    for (int i = 0; i < nboards; i++) {
+        if (boards[i].up && boards[i].job) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+static int any_up(void) {
+    for (int i = 0; i < nboards; i++) {
+        if (boards[i].up) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void summary(void) {
+    double secs = elapsed();
+    unsigned ok = 0;
+    unsigned failed = 0;
+    uint64_t blocks = 0;
+
+    printf("\nboard  tty                  jobs  fail    blocks  busy s   util  lat ms avg/max\n");
+    for (int i = 0; i < nboards; i++) {
+        struct board *b = &boards[i];
+
+        printf("%5d  %-20s %4u  %4u  %8llu  %6.1f  %4.0f%%  %6.0f / %llu%s\n",
+            b->idx, b->link.path, b->jobs_ok + b->jobs_failed, b->jobs_failed,
+            (unsigned long long)b->blocks, b->busy_ms / 1000.0,
+            secs > 0 ? b->busy_ms / 10.0 / secs : 0.0,
+            b->link.replies ? (double)b->link.lat_sum_ms / b->link.replies : 0.0,
+            (unsigned long long)b->link.lat_max_ms, b->up ? "" : "  (down)");
+        ok += b->jobs_ok;
+        failed += b->jobs_failed;
+        blocks += b->blocks;
+    }
+    printf("total: %u jobs (%u failed) in %.1f s, %.1f jobs/hour, %llu blocks imaged at %.1f KB/s\n",
+        ok + failed, failed, secs, secs > 0 ? (ok + failed) * 3600.0 / secs : 0.0,
+        (unsigned long long)blocks, secs > 0 ? blocks / 2.0 / secs : 0.0);
+}
+
+
+int main(int argc, char **argv) {
+    struct epoll_event ev;
+    struct epoll_event evs[MAX_BOARDS + 1];
+    const char *jobfile = NULL;
+    long baud = 38400;
+    unsigned window = 4;
+    int jobfd;
+    int c;
+    int n;
+
+    while ((c = getopt(argc, argv, "b:w:j:")) != -1) {
+        switch (c) {
+        case 'b':   baud = strtol(optarg, NULL, 0); break;
+        case 'w':   window = strtoul(optarg, NULL, 0); break;
+        case 'j':   jobfile = optarg; break;
+        default:    usage();
+        }
+    }
+    if ((optind >= argc) || (argc - optind > MAX_BOARDS) || (window < 1) || (window > SDLINK_QLEN)) {
+        usage();
+    }
+    if (sdlink_baud(baud) == B0) {
+        fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return 2;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll");
+        return 1;
+    }
+    t_begin = sdlink_now_ms();
+    for (nboards = 0; optind < argc; optind++, nboards++) {
+        struct board *b = &boards[nboards];
+
+        b->idx = nboards;
+        if (sdlink_open(&b->link, argv[optind], sdlink_baud(baud)) < 0) {
+            fprintf(stderr, "board %d (%s): %s\n", nboards, argv[optind], strerror(errno));
+            snprintf(b->link.path, sizeof(b->link.path), "%s", argv[optind]);
+            continue;
+        }
+        b->link.window = window;
+        b->up = 1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = b;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, b->link.fd, &ev);
+    }
+    if (!any_up()) {
+        return 1;
+    }
+
+    jobfd = jobfile ? open(jobfile, O_RDONLY) : STDIN_FILENO;
+    if (jobfd < 0) {
+        perror(jobfile);
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, jobfd, &ev) < 0) {
+        while (!jobs_eof) {             /* regular file: epoll won't take it */
+            read_jobs(jobfd);
+        }
+    } else {
+        fcntl(jobfd, F_SETFL, fcntl(jobfd, F_GETFL) | O_NONBLOCK);
+    }
+
+    while (!(stopping && all_idle())) {
+        dispatch();
+        service();
+        if ((jobs_eof && (queue_head == NULL) && all_idle()) || !any_up()) {
+            break;
+        }
+        n = epoll_wait(epfd, evs, MAX_BOARDS + 1, 100);
+        if ((n < 0) && (errno != EINTR)) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct board *b = evs[i].data.ptr;
+
+            if (b == NULL) {
+                read_jobs(jobfd);
+            } else if (b->up && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                       (sdlink_read(&b->link) < 0)) {
+                board_down(b, strerror(errno));
+            }
+        }
+        for (int i = 0; i < nboards; i++) {
+            if (boards[i].up && (sdlink_check_timeout(&boards[i].link, sdlink_now_ms()) < 0)) {
+                board_down(&boards[i], "no reply");
+            }
+        }
+    }
+    if (queue_head) {
+        fprintf(stderr, "jobs left unrun:");
+        for (struct job *j = queue_head; j; j = j->next) {
+            fprintf(stderr, " %d", j->num);
+        }
+        fputc('\n', stderr);
+    }
+    summary();
+    for (int i = 0; i < nboards; i++) {
+        if (boards[i].up) {
+            sdlink_close(&boards[i].link);
+        }
+    }
+    return 0;
+}
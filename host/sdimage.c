@@ -0,0 +1,429 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sdimage.h"
+#include "../crc32.h"
+
+
+/*
+ *  Open (or resume) path for blocks first .. first+count-1.  A patch
+ *  starts at first and leaves the file as it is.
+ */
+int sdimage_open(struct sdimage *im, const char *path, uint32_t first, uint32_t count, int fresh) {
+    struct stat st;
+    const uint32_t *digests;
+    uint32_t ndigests;
+    unsigned window;
+    int verbose;
+    int patch;
+    int fs;
+
+    verbose = im->verbose;
+    fs = im->fs;
+    window = im->window;
+    patch = im->patch;
+    digests = im->digests;
+    ndigests = im->ndigests;
+    memset(im, 0, sizeof(*im));
+    im->verbose = verbose;
+    im->fs = fs;
+    im->window = (fs || patch) ? 0 : window;
+    im->patch = patch;
+    im->digests = digests;
+    im->ndigests = ndigests;
+    im->asked = UINT32_MAX;
+    im->first = first;
+    im->end = first + count;
+    im->fd = open(path, O_RDWR | O_CREAT | (fresh ? O_TRUNC : 0), 0644);
+    if ((im->fd < 0) || (fstat(im->fd, &st) < 0)) {
+        return -1;
+    }
+    im->done = patch ? 0 : st.st_size / 512;
+    if (im->done > count) {
+        im->done = count;
+    }
+    if (!patch && (ftruncate(im->fd, (off_t)im->done * 512) < 0)) {
+        close(im->fd);
+        return -1;
+    }
+    im->resumed = im->done;
+    im->next = first + im->done;
+    im->t_start = sdlink_now_ms();
+    return 0;
+}
+
+
+/*
+ *  Trim any blocks of an unfinished chunk, so a resume starts at its head.
+ *  An unfinished patch is left at full length; running it again is cheap.
+ */
+void sdimage_close(struct sdimage *im) {
+    if ((im->fd >= 0) && !im->patch) {
+        if (ftruncate(im->fd, (off_t)im->done * 512) < 0) {
+            perror("truncate");
+        }
+        close(im->fd);
+    }
+    im->fd = -1;
+}
+
+
+int sdimage_finished(const struct sdimage *im) {
+    return im->error || (im->first + im->done == im->end);
+}
+
+
+void sdimage_progress(struct sdimage *im, int last) {
+    double secs;
+    double kbs;
+    uint32_t copied;
+    uint32_t reached;
+
+    if (!im->verbose || (!last && (sdlink_now_ms() - im->t_shown < 250))) {
+        return;
+    }
+    im->t_shown = sdlink_now_ms();
+    secs = (sdlink_now_ms() - im->t_start) / 1000.0;
+    reached = im->pos > im->done ? im->pos : im->done;
+    copied = reached - im->resumed;
+    kbs = secs > 0 ? copied / 2.0 / secs : 0;
+    fprintf(stderr, "\r%u/%u blocks  %.1f KB/s  ETA %.0f s  %u data (%u packed, %.0f%%), %u fill",
+        reached, im->end - im->first, kbs,
+        kbs > 0 ? (im->end - im->first - reached) / 2.0 / kbs : 0.0,
+        im->data_blocks, im->packed_blocks,
+        im->data_blocks ? 100.0 * im->wire_bytes / (im->data_blocks * 512.0) : 100.0,
+        im->fill_blocks);
+    if (im->window) {
+        fprintf(stderr, ", %u resent", im->resends);
+    }
+    if (im->patch) {
+        fprintf(stderr, ", %u chunks unchanged", im->same_chunks);
+    }
+    fputs("   ", stderr);
+    if (last) {
+        fputc('\n', stderr);
+    }
+}
+
+
+static uint32_t sdimage_chunk(const struct sdimage *im, uint32_t blk) {
+    uint32_t chunk = im->patch ? SDIMAGE_DELTA_CHUNK : SDIMAGE_CHUNK;
+
+    if (im->fs || im->window) {
+        return im->end - blk;
+    }
+    return im->end - blk < chunk ? im->end - blk : chunk;
+}
+
+
+static void sdimage_reached(struct sdimage *im, uint32_t block) {
+    if (block - im->first > im->pos) {
+        im->pos = block - im->first;
+    }
+}
+
+
+/*
+ *  FRAME_COPY: count blocks at to are the same as those at from, which
+ *  have already been written.
+ */
+static void sdimage_copy(struct sdimage *im, uint32_t from, uint32_t to, uint32_t count,
+                         uint32_t blk, uint32_t n) {
+    uint8_t buf[512];
+
+    if ((from < blk) || (to < blk) || (count > blk + n - from) || (count > blk + n - to)) {
+        return;
+    }
+    sdimage_reached(im, to + count);
+    for (; count; count--, from++, to++) {
+        memset(buf, 0, sizeof(buf));       /* a hole past the end reads short */
+        if ((pread(im->fd, buf, 512, (off_t)(from - im->first) * 512) < 0) ||
+            (pwrite(im->fd, buf, 512, (off_t)(to - im->first) * 512) != 512)) {
+            perror("copy");
+            im->error = 1;
+            return;
+        }
+    }
+}
+
+
+static void sdimage_frame(struct sdlink *link, void *arg, uint8_t type, uint32_t block,
+                          const uint8_t *payload, size_t len) {
+    struct sdimage *im = arg;
+    uint8_t fill[512];
+    uint32_t blk;
+    uint32_t n;
+    uint32_t count;
+
+    blk = im->first + im->done;
+    n = sdimage_chunk(im, blk);
+    if (im->error) {
+        return;
+    }
+    if (type == FRAME_END) {
+        im->chunk_ok = (len == 1) && ((payload[0] == FRAME_OK) || (payload[0] == FRAME_UNCHANGED)) &&
+                       (block == blk + n);
+        if (im->chunk_ok && (payload[0] == FRAME_UNCHANGED)) {
+            im->same_chunks++;
+            sdimage_reached(im, block);
+        }
+        return;
+    }
+    if ((type == FRAME_DATA) || (type == FRAME_PACKED)) {
+        if ((block < blk) || (block >= blk + n)) {
+            return;
+        }
+        if (type == FRAME_PACKED) {
+            if (sdlink_unpack(payload, len, fill) < 0) {
+                fprintf(stderr, "\n%s: block %u does not unpack\n", link->path, block);
+                im->error = 1;
+                return;
+            }
+            im->packed_blocks++;
+            payload = fill;
+        } else if (len != 512) {
+            return;
+        }
+        if (pwrite(im->fd, payload, 512, (off_t)(block - im->first) * 512) != 512) {
+            perror("write");
+            im->error = 1;
+        }
+        im->data_blocks++;
+        im->wire_bytes += len;
+        sdimage_reached(im, block + 1);
+        return;
+    }
+    if ((type == FRAME_COPY) && (len == 8)) {
+        sdimage_copy(im, sdlink_le32(payload), block, sdlink_le32(payload + 4), blk, n);
+        return;
+    }
+    if ((type != FRAME_FILL) || (len != 5)) {
+        return;
+    }
+    count = sdlink_le32(payload);
+    if ((block < blk) || (count > blk + n - block)) {
+        return;
+    }
+    im->fill_blocks += count;
+    sdimage_reached(im, block + count);
+    if ((payload[4] == 0) && !im->patch) {
+        return;                     /* a hole; the file is extended at FRAME_END */
+    }
+    if ((payload[4] == 0) &&
+        (fallocate(im->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                   (off_t)(block - im->first) * 512, (off_t)count * 512) == 0)) {
+        return;
+    }
+    memset(fill, payload[4], sizeof(fill));
+    for (; count; count--, block++) {
+        if (pwrite(im->fd, fill, 512, (off_t)(block - im->first) * 512) != 512) {
+            perror("write");
+            im->error = 1;
+            return;
+        }
+    }
+}
+
+
+static void sdimage_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct sdimage *im = arg;
+    uint32_t blk;
+    uint32_t n;
+
+    blk = im->first + im->done;
+    n = sdimage_chunk(im, blk);
+    if (im->error) {
+        return;
+    }
+    if ((reply == NULL) || !im->chunk_ok) {
+        fprintf(stderr, "\n%s: read of blocks %u..%u failed\n", link->path, blk, blk + n - 1);
+        im->error = 1;
+        return;
+    }
+    im->chunk_ok = 0;
+    im->done += n;
+    if ((!im->patch || (im->first + im->done == im->end)) &&
+        (ftruncate(im->fd, (off_t)im->done * 512) < 0)) {
+        perror("truncate");
+        im->error = 1;
+        return;
+    }
+    sdimage_progress(im, 0);
+}
+
+
+/*
+ *  Frames of an "s" dump.  The head of the image moves past every frame
+ *  that lands on it and past the held frames it then reaches; one that
+ *  lands beyond it is held, and the gap asked for once.  Every frame,
+ *  repeats included, is answered with a FRAME_ACK for the head.
+ */
+static void sdimage_stream_frame(struct sdlink *link, void *arg, uint8_t type, uint32_t block,
+                                 const uint8_t *payload, size_t len) {
+    struct sdimage *im = arg;
+    uint32_t head;
+    uint32_t count;
+    unsigned i;
+
+    if (type == FRAME_END) {
+        im->end_status = (len == 1) ? payload[0] : FRAME_RDERR;
+        return;
+    }
+    if ((type == FRAME_DATA) || (type == FRAME_PACKED)) {
+        count = 1;
+    } else if ((type == FRAME_FILL) && (len == 5)) {
+        count = sdlink_le32(payload);
+    } else {
+        return;
+    }
+    head = im->first + im->done;
+    for (i = 0; i < im->nheld; i++) {
+        if (im->held[i][0] == block) {
+            count = 0;                  /* already have it */
+        }
+    }
+    if ((count > 0) && (block >= head) && (count <= im->end - block)) {
+        sdimage_frame(link, arg, type, block, payload, len);
+        if (im->error) {
+            return;
+        }
+        if (block > head) {
+            if (im->nheld < SDIMAGE_WINDOW_MAX) {
+                im->held[im->nheld][0] = block;
+                im->held[im->nheld][1] = block + count;
+                im->nheld++;
+            }
+        } else {
+            head += count;
+            for (i = 0; i < im->nheld; ) {
+                if (im->held[i][0] == head) {
+                    head = im->held[i][1];
+                    im->held[i][0] = im->held[--im->nheld][0];
+                    im->held[i][1] = im->held[im->nheld][1];
+                    i = 0;
+                } else {
+                    i++;
+                }
+            }
+            im->done = head - im->first;
+        }
+    }
+    if ((im->nheld > 0) && (im->asked != head)) {
+        sdlink_send_ctl(link, FRAME_RESEND, head);
+        im->asked = head;
+        im->resends++;
+    }
+    sdlink_send_ctl(link, FRAME_ACK, head);
+    sdimage_progress(im, 0);
+}
+
+
+static void sdimage_stream_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct sdimage *im = arg;
+
+    if (im->error || (im->first + im->done == im->end)) {
+        return;
+    }
+    im->nheld = 0;
+    if ((reply != NULL) && (im->end_status == FRAME_ABORTED) && (im->restarts < SDIMAGE_RESTARTS)) {
+        im->restarts++;
+        im->next = im->first + im->done;    /* sdimage_fill() picks it up from here */
+        im->asked = UINT32_MAX;
+        if (im->verbose) {
+            fprintf(stderr, "\n%s: dump stopped, restarting at block %u\n", link->path, im->next);
+        }
+        return;
+    }
+    fprintf(stderr, "\n%s: read of blocks %u..%u failed\n", link->path, im->first + im->done, im->end - 1);
+    im->error = 1;
+}
+
+
+/*
+ *  Top up the link with dump requests; usable as the sdlink_run() idle
+ *  hook.  Returns nonzero once the copy has failed.
+ */
+int sdimage_fill(struct sdlink *link, void *arg) {
+    struct sdimage *im = arg;
+    char cmd[SDLINK_CMD_MAX];
+    uint32_t n;
+    uint32_t k;
+
+    while (!im->error && (im->next < im->end) && (sdlink_pending(link) < link->window)) {
+        n = sdimage_chunk(im, im->next);
+        if (im->window) {
+            im->end_status = -1;
+            snprintf(cmd, sizeof(cmd), "s %u %u %u", im->next, n, im->window);
+            if (sdlink_submit_frames(link, cmd, sdimage_stream_frame, sdimage_stream_cb, im) < 0) {
+                break;
+            }
+            im->next += n;
+            continue;
+        }
+        k = (im->next - im->first) / SDIMAGE_DELTA_CHUNK;
+        if (im->fs) {
+            snprintf(cmd, sizeof(cmd), "fs");
+        } else if (im->patch && (k < im->ndigests) && (n == SDIMAGE_DELTA_CHUNK)) {
+            snprintf(cmd, sizeof(cmd), "c %u %u 0x%08x", im->next, n, im->digests[k]);
+        } else {
+            snprintf(cmd, sizeof(cmd), "d %u %u", im->next, n);
+        }
+        if (sdlink_submit_frames(link, cmd, sdimage_frame, sdimage_cb, im) < 0) {
+            break;
+        }
+        im->next += n;
+    }
+    return im->error;
+}
+
+
+/*
+ *  CRC-32 of every SDIMAGE_DELTA_CHUNK chunk of an image file, into a
+ *  malloc()ed array; a short last chunk is hashed as if padded with
+ *  zeros, as the card's image would be.  Returns the number of chunks.
+ */
+long sdimage_digests(const char *path, uint32_t **digests) {
+    static uint8_t buf[SDIMAGE_DELTA_CHUNK * 512];
+    uint32_t *d = NULL;
+    uint32_t *p;
+    uint32_t crc;
+    long n = 0;
+    ssize_t got;
+    int fd;
+    int i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    for (;;) {
+        memset(buf, 0, sizeof(buf));
+        got = pread(fd, buf, sizeof(buf), (off_t)n * sizeof(buf));
+        if (got <= 0) {
+            break;
+        }
+        if ((n & 1023) == 0) {
+            p = realloc(d, (n + 1024) * sizeof(*d));
+            if (p == NULL) {
+                got = -1;
+                break;
+            }
+            d = p;
+        }
+        crc = 0;
+        for (i = 0; i < SDIMAGE_DELTA_CHUNK; i++) {
+            crc = crc32_update(crc, buf + i * 512, 512);
+        }
+        d[n++] = crc;
+    }
+    close(fd);
+    if (got < 0) {
+        free(d);
+        return -1;
+    }
+    *digests = d;
+    return n;
+}
@@ -0,0 +1,79 @@
+#ifndef _SDLOCKER_SDIMAGE_
+#define _SDLOCKER_SDIMAGE_
+
+/*
+ *  sdimage      copy a block range from a board into an image file
+ *
+ *  Keeps the link's window full of sparse dump ("d") requests and writes
+ *  the frames as they arrive.  Runs of zero blocks are left as holes in
+ *  the file.  The file length only moves by whole chunks, once a chunk's
+ *  FRAME_END is in, so its length says where to resume after an
+ *  interruption.
+ *
+ *  With window set, one windowed dump ("s") covers the whole range instead.
+ *  Every frame is acknowledged; a frame that arrives past a gap is kept
+ *  and the frame for the gap asked for again, so a line glitch costs one
+ *  frame.  The file length follows the blocks received without a gap.  A
+ *  dump the board gave up on is restarted from there a few times.
+ *
+ *  With patch set, an existing image is brought up to date in place: each
+ *  SDIMAGE_DELTA_CHUNK chunk goes out as a "c" request carrying its digest
+ *  from digests[], and the board only sends the chunks that changed.
+ *  Chunks past the end of digests[] are fetched with "d".
+ *
+ *  With fs set the whole card comes from one "fs" request instead: only
+ *  file system metadata and clusters in use are sent, and the rest of the
+ *  file is left as zeros.  Such an image cannot be resumed.
+ */
+
+#include <stdint.h>
+#include "sdlink.h"
+
+
+#define SDIMAGE_CHUNK   256         /* blocks per dump request */
+#define SDIMAGE_WINDOW  8           /* default frames in flight for "s" */
+#define SDIMAGE_WINDOW_MAX 16       /* the board's limit */
+#define SDIMAGE_RESTARTS 3          /* "s" dumps restarted after FRAME_ABORTED */
+#define SDIMAGE_DELTA_CHUNK 128     /* blocks per digest, 64 KB */
+
+
+struct sdimage {
+    int fd;
+    uint32_t first;                 /* block at file offset 0 */
+    uint32_t next;                  /* next block to request */
+    uint32_t done;                  /* blocks written to the file */
+    uint32_t end;                   /* one past the last block */
+    uint32_t resumed;               /* blocks already in the file at start */
+    uint32_t data_blocks;           /* sent as FRAME_DATA or FRAME_PACKED */
+    uint32_t packed_blocks;         /* of those, sent packed */
+    uint64_t wire_bytes;            /* frame payload bytes for data blocks */
+    uint32_t fill_blocks;           /* sent as FRAME_FILL runs */
+    uint32_t pos;                   /* furthest block reached by a frame, from first */
+    int fs;                         /* image with one "fs" request */
+    unsigned window;                /* frames in flight with "s"; 0 for "d" chunks */
+    uint32_t held[SDIMAGE_WINDOW_MAX][2];   /* frames past a gap: first, one past last block */
+    unsigned nheld;
+    uint32_t asked;                 /* gap last asked for with FRAME_RESEND */
+    uint32_t resends;               /* frames asked for again */
+    unsigned restarts;
+    int end_status;                 /* of the "s" FRAME_END, -1 if none came */
+    int patch;                      /* update an existing image from digests */
+    const uint32_t *digests;        /* CRC-32 per chunk of the existing image */
+    uint32_t ndigests;
+    uint32_t same_chunks;           /* chunks the board found unchanged */
+    int chunk_ok;                   /* FRAME_END for the head chunk was good */
+    int error;
+    int verbose;                    /* progress line on stderr */
+    uint64_t t_start;
+    uint64_t t_shown;               /* last progress line */
+};
+
+
+extern int sdimage_open(struct sdimage *im, const char *path, uint32_t first, uint32_t count, int fresh);
+extern int sdimage_fill(struct sdlink *link, void *arg);
+extern int sdimage_finished(const struct sdimage *im);
+extern void sdimage_progress(struct sdimage *im, int last);
+extern void sdimage_close(struct sdimage *im);
+extern long sdimage_digests(const char *path, uint32_t **digests);
+
+#endif /* _SDLOCKER_SDIMAGE_ */
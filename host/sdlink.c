@@ -0,0 +1,652 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "sdlink.h"
+
+
+#define PROMPT      "\n> "
+#define PROMPT_LEN  3
+#define SINGLE_KEYS "?ulpPE"        /* act at once; a CR after them would add a prompt */
+
+
+uint64_t sdlink_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+speed_t sdlink_baud(long rate) {
+    switch (rate) {
+    case 9600:      return B9600;
+    case 19200:     return B19200;
+    case 38400:     return B38400;
+    case 57600:     return B57600;
+    case 115200:    return B115200;
+    case 230400:    return B230400;
+    default:        return B0;
+    }
+}
+
+
+/*
+ *  Wait for the board to be at its prompt with nothing else queued: send
+ *  CR, then read until a prompt has arrived and the line has gone quiet.
+ */
+static int sdlink_sync(struct sdlink *link) {
+    struct pollfd pfd;
+    uint64_t deadline;
+    uint64_t quiet;
+    char buf[256];
+    char tail[PROMPT_LEN + 1];
+    int seen;
+    ssize_t n;
+
+    if (write(link->fd, "\r", 1) != 1) {
+        return -1;
+    }
+    deadline = sdlink_now_ms() + 3000;
+    quiet = 0;
+    seen = 0;
+    memset(tail, 0, sizeof(tail));
+    pfd.fd = link->fd;
+    pfd.events = POLLIN;
+    while (sdlink_now_ms() < deadline) {
+        if (poll(&pfd, 1, 50) > 0) {
+            n = read(link->fd, buf, sizeof(buf));
+            if (n <= 0) {
+                if ((n < 0) && (errno == EAGAIN)) {
+                    continue;
+                }
+                return -1;
+            }
+            for (ssize_t i = 0; i < n; i++) {
+                memmove(tail, tail + 1, PROMPT_LEN - 1);
+                tail[PROMPT_LEN - 1] = buf[i];
+                if (memcmp(tail, PROMPT, PROMPT_LEN) == 0) {
+                    seen = 1;
+                }
+            }
+            quiet = sdlink_now_ms() + 150;
+        } else if (seen && (sdlink_now_ms() >= quiet)) {
+            return 0;
+        }
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+
+int sdlink_open(struct sdlink *link, const char *path, speed_t baud) {
+    struct termios tio;
+
+    memset(link, 0, sizeof(*link));
+    snprintf(link->path, sizeof(link->path), "%s", path);
+    link->window = 4;
+    link->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (link->fd < 0) {
+        return -1;
+    }
+    if (tcgetattr(link->fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tio.c_cflag |= CLOCAL | CREAD;
+        tio.c_cflag &= ~CRTSCTS;
+        if (baud != B0) {
+            cfsetispeed(&tio, baud);
+            cfsetospeed(&tio, baud);
+        }
+        tcsetattr(link->fd, TCSANOW, &tio);
+        tcflush(link->fd, TCIOFLUSH);
+    }
+    link->rxcap = 4096;
+    link->rx = malloc(link->rxcap);
+    if ((link->rx == NULL) || (sdlink_sync(link) < 0)) {
+        sdlink_close(link);
+        return -1;
+    }
+    link->t_last_rx = sdlink_now_ms();
+    return 0;
+}
+
+
+void sdlink_close(struct sdlink *link) {
+    if (link->fd >= 0) {
+        close(link->fd);
+    }
+    link->fd = -1;
+    free(link->rx);
+    link->rx = NULL;
+}
+
+
+int sdlink_submit(struct sdlink *link, const char *cmd, sdlink_cb cb, void *arg) {
+    struct sdlink_req *req;
+    size_t len;
+
+    len = strlen(cmd);
+    if (((link->tail - link->head) >= SDLINK_QLEN) || (len + 2 > SDLINK_CMD_MAX)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    req = &link->q[link->tail % SDLINK_QLEN];
+    memcpy(req->cmd, cmd, len);
+    if ((len != 1) || (strchr(SINGLE_KEYS, cmd[0]) == NULL)) {
+        req->cmd[len++] = '\r';
+    }
+    req->cmd[len] = 0;
+    req->cmdlen = len;
+    req->cb = cb;
+    req->fcb = NULL;
+    req->in_frames = 0;
+    req->data = NULL;
+    req->datalen = 0;
+    req->dataoff = 0;
+    req->cmd_sent = 0;
+    req->arg = arg;
+    link->tail++;
+    return 0;
+}
+
+
+int sdlink_submit_frames(struct sdlink *link, const char *cmd, sdlink_frame_cb fcb,
+                         sdlink_cb cb, void *arg) {
+    struct sdlink_req *req;
+
+    if (sdlink_submit(link, cmd, cb, arg) < 0) {
+        return -1;
+    }
+    req = &link->q[(link->tail - 1) % SDLINK_QLEN];
+    req->fcb = fcb;
+    req->in_frames = 1;
+    return 0;
+}
+
+
+/*
+ *  A command followed by len bytes of data, which must stay valid until
+ *  the reply has come in.
+ */
+int sdlink_submit_data(struct sdlink *link, const char *cmd, const uint8_t *data,
+                       size_t len, sdlink_cb cb, void *arg) {
+    struct sdlink_req *req;
+
+    if (sdlink_submit(link, cmd, cb, arg) < 0) {
+        return -1;
+    }
+    req = &link->q[(link->tail - 1) % SDLINK_QLEN];
+    req->data = data;
+    req->datalen = len;
+    return 0;
+}
+
+
+/*
+ *  Let the board pace what we send: RTS/CTS for a board built with
+ *  make FLOW=rts, else XON/XOFF.  Binary replies may contain the XON
+ *  and XOFF bytes, so only turn this on for uploads.
+ */
+int sdlink_set_flow(struct sdlink *link, int rts) {
+    struct termios tio;
+
+    if (tcgetattr(link->fd, &tio) < 0) {
+        return -1;
+    }
+    if (rts) {
+        tio.c_cflag |= CRTSCTS;
+    } else {
+        tio.c_iflag |= IXON;
+        tio.c_cc[VSTART] = 0x11;
+        tio.c_cc[VSTOP] = 0x13;
+    }
+    return tcsetattr(link->fd, TCSANOW, &tio);
+}
+
+
+unsigned sdlink_pending(const struct sdlink *link) {
+    return link->tail - link->head;
+}
+
+
+int sdlink_want_write(const struct sdlink *link) {
+    const struct sdlink_req *req;
+
+    if ((link->sent == link->tail) || ((link->sent - link->head) >= link->window)) {
+        return 0;
+    }
+    req = &link->q[link->sent % SDLINK_QLEN];
+    if (req->data) {
+        return link->sent == link->head;    /* nothing else in flight with the data */
+    }
+    return (link->sent == link->head) || (link->inflight + req->cmdlen <= SDLINK_RX_WINDOW);
+}
+
+
+/*
+ *  Send queued commands while the window allows.  The board reads its
+ *  queue only between commands, so bytes in flight are capped below the
+ *  size of its receive buffer.  The data of an upload follows its command
+ *  as fast as the tty takes it; the board says nothing while it comes in,
+ *  so sending it counts as activity for the timeout.
+ */
+int sdlink_write(struct sdlink *link) {
+    struct sdlink_req *req;
+    ssize_t n;
+
+    while (sdlink_want_write(link)) {
+        req = &link->q[link->sent % SDLINK_QLEN];
+        if (!req->cmd_sent) {
+            n = write(link->fd, req->cmd, req->cmdlen);
+            if (n < 0) {
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            if ((size_t)n != req->cmdlen) {
+                errno = EIO;            /* short write of a tiny command; give up */
+                return -1;
+            }
+            link->bytes_out += n;
+            link->inflight += req->cmdlen;
+            req->cmd_sent = 1;
+            req->t_sent = sdlink_now_ms();
+            if (link->sent == link->head) {
+                link->t_last_rx = req->t_sent;
+            }
+        }
+        while (req->dataoff < req->datalen) {
+            n = write(link->fd, req->data + req->dataoff, req->datalen - req->dataoff);
+            if (n < 0) {
+                return (errno == EAGAIN) ? 0 : -1;
+            }
+            req->dataoff += n;
+            link->bytes_out += n;
+            link->t_last_rx = sdlink_now_ms();
+        }
+        link->sent++;
+    }
+    return 0;
+}
+
+
+static void sdlink_complete(struct sdlink *link, const char *reply, size_t len) {
+    struct sdlink_req req;
+
+    if (link->head == link->sent) {
+        return;                         /* unsolicited output, e.g. a switch press */
+    }
+    req = link->q[link->head % SDLINK_QLEN];
+    link->head++;
+    link->inflight -= req.cmdlen;
+    if (reply) {
+        uint64_t lat = sdlink_now_ms() - req.t_sent;
+
+        link->replies++;
+        link->lat_sum_ms += lat;
+        if (lat > link->lat_max_ms) {
+            link->lat_max_ms = lat;
+        }
+    }
+    if (req.cb) {
+        req.cb(link, req.arg, reply, len);
+    }
+}
+
+
+uint16_t sdlink_crc16(uint16_t crc, const uint8_t *p, size_t len) {
+    while (len--) {
+        crc ^= (uint16_t)*p++ << 8;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+
+uint32_t sdlink_le32(const uint8_t *p) {
+    return p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/*
+ *  Expand a FRAME_PACKED payload (see lz.h in the firmware) into a 512-byte
+ *  block and check it against the CRC the board took before packing.
+ */
+int sdlink_unpack(const uint8_t *payload, size_t len, uint8_t *block) {
+    const uint8_t *p = payload + 2;
+    const uint8_t *end = payload + len;
+    size_t n = 0;
+    size_t run;
+    size_t off;
+
+    if (len < 2) {
+        return -1;
+    }
+    while (p < end) {
+        if (*p & 0x80) {
+            if (end - p < 2) {
+                return -1;
+            }
+            run = ((p[0] >> 1) & 0x3f) + 3;
+            off = (((p[0] & 1) << 8) | p[1]) + 1;
+            p += 2;
+            if ((off > n) || (run > 512 - n)) {
+                return -1;
+            }
+            for (; run; run--, n++) {
+                block[n] = block[n - off];      /* byte at a time: runs overlap */
+            }
+        } else {
+            run = *p++ + 1;
+            if ((run > (size_t)(end - p)) || (run > 512 - n)) {
+                return -1;
+            }
+            memcpy(block + n, p, run);
+            p += run;
+            n += run;
+        }
+    }
+    if ((n != 512) || (sdlink_crc16(0, block, 512) != (payload[0] | (payload[1] << 8)))) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static void sdlink_consume(struct sdlink *link, size_t n) {
+    link->rxlen -= n;
+    memmove(link->rx, link->rx + n, link->rxlen);
+    link->rx[link->rxlen] = 0;
+}
+
+
+/*
+ *  Hand complete frames at the front of rx to the head request.  Text
+ *  before a sync byte (echo, messages) is skipped, a frame with a bad CRC
+ *  costs one byte of resync.  Returns 0 when more input is needed.
+ */
+static int sdlink_frames(struct sdlink *link, struct sdlink_req *req) {
+    const uint8_t *rx;
+    uint8_t *sync;
+    size_t len;
+    uint16_t crc;
+
+    for (;;) {
+        sync = memchr(link->rx, FRAME_SYNC, link->rxlen);
+        if (sync == NULL) {
+            if (memmem(link->rx, link->rxlen, PROMPT, PROMPT_LEN)) {
+                req->in_frames = 0;     /* a text-only reply: no frames coming */
+                return 1;
+            }
+            return 0;
+        }
+        if (memmem(link->rx, sync - (uint8_t *)link->rx, PROMPT, PROMPT_LEN)) {
+            req->in_frames = 0;
+            return 1;
+        }
+        sdlink_consume(link, sync - (uint8_t *)link->rx);
+        rx = (const uint8_t *)link->rx;
+        if (link->rxlen < FRAME_HDR_LEN) {
+            return 0;
+        }
+        len = rx[2] | (rx[3] << 8);
+        if (len > FRAME_MAX_PAYLOAD) {
+            sdlink_consume(link, 1);
+            continue;
+        }
+        if (link->rxlen < FRAME_HDR_LEN + len + 2) {
+            return 0;
+        }
+        crc = rx[FRAME_HDR_LEN + len] | (rx[FRAME_HDR_LEN + len + 1] << 8);
+        if (sdlink_crc16(0, rx + 1, FRAME_HDR_LEN - 1 + len) != crc) {
+            link->frame_errors++;
+            sdlink_consume(link, 1);
+            continue;
+        }
+        req->fcb(link, req->arg, rx[1], sdlink_le32(rx + 4), rx + FRAME_HDR_LEN, len);
+        if (rx[1] == FRAME_END) {
+            req->in_frames = 0;
+        }
+        sdlink_consume(link, FRAME_HDR_LEN + len + 2);
+        if (!req->in_frames) {
+            return 1;
+        }
+    }
+}
+
+
+int sdlink_read(struct sdlink *link) {
+    char *p;
+    size_t len;
+    ssize_t n;
+
+    for (;;) {
+        if (link->rxcap - link->rxlen < 1024) {
+            p = realloc(link->rx, link->rxcap * 2);
+            if (p == NULL) {
+                return -1;
+            }
+            link->rx = p;
+            link->rxcap *= 2;
+        }
+        n = read(link->fd, link->rx + link->rxlen, link->rxcap - link->rxlen - 1);
+        if (n < 0) {
+            return ((errno == EAGAIN) || (errno == EINTR)) ? 0 : -1;
+        }
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        link->bytes_in += n;
+        link->t_last_rx = sdlink_now_ms();
+        link->rxlen += n;
+        link->rx[link->rxlen] = 0;
+
+        for (;;) {
+            struct sdlink_req *req = &link->q[link->head % SDLINK_QLEN];
+
+            if ((link->head != link->sent) && req->in_frames && !sdlink_frames(link, req)) {
+                break;
+            }
+            p = memmem(link->rx, link->rxlen, PROMPT, PROMPT_LEN);
+            if (p == NULL) {
+                break;
+            }
+            len = p - link->rx;
+            if ((len > 0) && (link->rx[len - 1] == '\r')) {
+                len--;
+            }
+            link->rx[len] = 0;
+            sdlink_complete(link, link->rx, len);
+            sdlink_consume(link, (p - link->rx) + PROMPT_LEN);
+        }
+    }
+}
+
+
+/*
+ *  Send a header-only control frame at once, between queued commands.  It
+ *  is not queued or retried: the board sends its oldest frame again if a
+ *  control frame goes missing, and that brings a fresh one.
+ */
+int sdlink_send_ctl(struct sdlink *link, uint8_t type, uint32_t block) {
+    uint8_t f[FRAME_HDR_LEN + 2];
+    uint16_t crc;
+    ssize_t n;
+
+    f[0] = FRAME_SYNC;
+    f[1] = type;
+    f[2] = 0;
+    f[3] = 0;
+    f[4] = block;
+    f[5] = block >> 8;
+    f[6] = block >> 16;
+    f[7] = block >> 24;
+    crc = sdlink_crc16(0, f + 1, FRAME_HDR_LEN - 1);
+    f[8] = crc;
+    f[9] = crc >> 8;
+    n = write(link->fd, f, sizeof(f));
+    if (n > 0) {
+        link->bytes_out += n;
+    }
+    return (n == sizeof(f)) ? 0 : -1;
+}
+
+
+/*
+ *  Fail every outstanding request if the board has been silent too long.
+ */
+int sdlink_check_timeout(struct sdlink *link, uint64_t now) {
+    if ((link->head == link->sent) || (now - link->t_last_rx < SDLINK_TIMEOUT_MS)) {
+        return 0;
+    }
+    while (link->head != link->tail) {
+        link->sent = link->tail;        /* drop unsent ones too */
+        sdlink_complete(link, NULL, 0);
+    }
+    link->inflight = 0;
+    link->rxlen = 0;
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+
+/*
+ *  Run the link until no requests are left.  idle, if given, is called
+ *  on every pass so the caller can keep the queue topped up; it returns
+ *  nonzero to stop early.
+ */
+int sdlink_run(struct sdlink *link, int (*idle)(struct sdlink *, void *), void *arg) {
+    struct pollfd pfd;
+
+    for (;;) {
+        if (idle && idle(link, arg)) {
+            return -1;
+        }
+        if (sdlink_pending(link) == 0) {
+            return 0;
+        }
+        if (sdlink_write(link) < 0) {
+            return -1;
+        }
+        pfd.fd = link->fd;
+        pfd.events = POLLIN | (sdlink_want_write(link) ? POLLOUT : 0);
+        if ((poll(&pfd, 1, 100) < 0) && (errno != EINTR)) {
+            return -1;
+        }
+        if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && (sdlink_read(link) < 0)) {
+            return -1;
+        }
+        if (sdlink_check_timeout(link, sdlink_now_ms()) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+/*
+ *  Card capacity in 512-byte blocks from a 16-byte CSD; mirrors
+ *  CardBlocks() in the firmware.
+ */
+uint32_t sdlink_csd_blocks(const uint8_t *csd) {
+    uint32_t csize;
+    unsigned shift;
+
+    if ((csd[0] >> 6) == 1) {
+        csize = ((uint32_t)(csd[7] & 0x3f) << 16) | ((uint32_t)csd[8] << 8) | csd[9];
+        return (csize + 1) << 10;
+    }
+    csize = ((uint32_t)(csd[6] & 0x03) << 10) | ((uint32_t)csd[7] << 2) | (csd[8] >> 6);
+    shift = (((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2 + (csd[5] & 0x0f) - 9;
+    return (csize + 1) << shift;
+}
+
+
+/*
+ *  Parse n hex bytes following tag (e.g. "CSD = ") in an info reply.
+ */
+int sdlink_parse_hex(const char *reply, const char *tag, uint8_t *out, size_t n) {
+    const char *p;
+    char *end;
+
+    p = strstr(reply, tag);
+    if (p == NULL) {
+        return -1;
+    }
+    p += strlen(tag);
+    for (size_t i = 0; i < n; i++) {
+        out[i] = (uint8_t)strtoul(p, &end, 16);
+        if (end == p) {
+            return -1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+
+/*
+ *  Rebuild count blocks from the hexdump printed by "r first count".
+ *  Lines are "AAAAAAAAAA: xx xx .. |ascii|", a "*" stands for repeats of
+ *  the line before, and a bare address ends the dump.
+ */
+int sdlink_parse_dump(const char *reply, uint32_t first, uint32_t count, uint8_t *out) {
+    uint64_t base;
+    uint64_t end;
+    uint64_t pos;
+    uint64_t addr;
+    uint8_t last[16];
+    int fold;
+    const char *p;
+    char *q;
+
+    base = (uint64_t)first << 9;
+    end = base + ((uint64_t)count << 9);
+    pos = base;
+    fold = 0;
+    for (p = reply; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL) {
+        while ((*p == '\r') || (*p == ' ')) {
+            p++;
+        }
+        if (*p == '*') {
+            fold = 1;
+            continue;
+        }
+        if (strspn(p, "0123456789ABCDEF") != 10) {
+            continue;
+        }
+        addr = strtoull(p, &q, 16);
+        if ((addr < pos) || (addr > end)) {
+            return -1;
+        }
+        if (fold) {
+            for (; pos < addr; pos += 16) {
+                memcpy(out + (pos - base), last, 16);
+            }
+            fold = 0;
+        }
+        if (*q != ':') {
+            return (addr == end) && (pos == end) ? 0 : -1;
+        }
+        if ((addr != pos) || (addr + 16 > end)) {
+            return -1;
+        }
+        q++;
+        for (int i = 0; i < 16; i++) {
+            char *e;
+
+            last[i] = (uint8_t)strtoul(q, &e, 16);
+            if (e == q) {
+                return -1;
+            }
+            q = e;
+        }
+        memcpy(out + (pos - base), last, 16);
+        pos += 16;
+    }
+    return -1;
+}
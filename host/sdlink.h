@@ -0,0 +1,144 @@
+#ifndef _SDLOCKER_SDLINK_
+#define _SDLOCKER_SDLINK_
+
+/*
+ *  sdlink      host side of the SDLocker console, for Linux
+ *
+ *  A link owns one tty.  Commands are queued with sdlink_submit() and sent
+ *  ahead of the replies, as many as the board's receive queue can hold, so
+ *  the serial line does not sit idle between commands.  Each reply is the
+ *  text up to the board's "\n> " prompt and is handed to the request's
+ *  callback in submission order.
+ *
+ *  Block transfers reply in binary frames (see frame.h in the firmware);
+ *  a request submitted with sdlink_submit_frames() gets each good frame
+ *  through its frame callback until FRAME_END, then the text reply as usual.
+ *  A windowed dump ("s") is steered from the frame callback with control
+ *  frames sent by sdlink_send_ctl().
+ *
+ *  An upload ("w") is submitted with sdlink_submit_data(): the data goes
+ *  out right after the command line, once every earlier request has been
+ *  answered, and the board paces it with flow control, which must be
+ *  turned on first with sdlink_set_flow().
+ *
+ *  The link never blocks: the caller polls link->fd for POLLIN, and for
+ *  POLLOUT while sdlink_want_write() is true, then calls sdlink_read() and
+ *  sdlink_write().  sdlink_run() does that loop for single-link tools.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+
+#define SDLINK_QLEN         16      /* queued and outstanding requests */
+#define SDLINK_CMD_MAX      40      /* longest command line, with CR */
+#define SDLINK_RX_WINDOW    48      /* command bytes in flight; board queue is 64 */
+#define SDLINK_TIMEOUT_MS   30000   /* silence before a request is failed */
+
+#define FRAME_SYNC          0xA5    /* must match frame.h in the firmware */
+#define FRAME_HDR_LEN       8
+#define FRAME_MAX_PAYLOAD   1024
+#define FRAME_DATA          'D'
+#define FRAME_PACKED        'Z'
+#define FRAME_FILL          'F'
+#define FRAME_COPY          'C'
+#define FRAME_TRACE         'T'     /* SPI trace records, TRACE_REC_LEN bytes each */
+#define FRAME_SPI           'S'     /* SPI capture records, CAPTURE_REC_LEN bytes each */
+#define FRAME_END           'E'
+#define FRAME_OK            0
+#define FRAME_RDERR         1
+#define FRAME_ABORTED       2
+#define FRAME_UNCHANGED     3       /* "c": the chunk matched its digest */
+#define FRAME_ACK           'A'     /* host to board during "s": have every block before block */
+#define FRAME_RESEND        'R'     /* send the frame at block again */
+#define FRAME_CANCEL        'X'     /* end the dump */
+#define TRACE_REC_LEN       13      /* t_us(4) arg(4) cmd r1 token busy(2), see trace.h */
+#define CAPTURE_REC_LEN     5       /* flags mosi miso dt(2), see trace.h */
+#define CAPTURE_PAUSE       0x80    /* flags: no byte, dt is a pause */
+#define CAPTURE_DT_MS       0x8000  /* dt is in ms, not us */
+
+
+struct sdlink;
+
+/*
+ *  Reply callback.  reply is NUL-terminated, len excludes the prompt;
+ *  reply is NULL if the request failed (timeout or link error).
+ */
+typedef void (*sdlink_cb)(struct sdlink *link, void *arg, const char *reply, size_t len);
+
+/*
+ *  Frame callback, for every frame whose CRC checks out.
+ */
+typedef void (*sdlink_frame_cb)(struct sdlink *link, void *arg, uint8_t type, uint32_t block,
+                                const uint8_t *payload, size_t len);
+
+
+struct sdlink_req {
+    char cmd[SDLINK_CMD_MAX];
+    size_t cmdlen;
+    sdlink_cb cb;
+    sdlink_frame_cb fcb;            /* NULL for text-only replies */
+    int in_frames;                  /* still expecting frames */
+    const uint8_t *data;            /* sent after the command, for "w" */
+    size_t datalen;
+    size_t dataoff;                 /* data bytes written so far */
+    int cmd_sent;
+    void *arg;
+    uint64_t t_sent;                /* ms, when the command went out */
+};
+
+
+struct sdlink {
+    int fd;
+    char path[64];
+
+    struct sdlink_req q[SDLINK_QLEN];
+    unsigned head;                  /* oldest request awaiting a reply */
+    unsigned sent;                  /* first request not yet written */
+    unsigned tail;                  /* next free slot */
+    size_t inflight;                /* command bytes written, not yet answered */
+    unsigned window;                /* most commands in flight */
+
+    char *rx;                       /* reply being collected */
+    size_t rxlen;
+    size_t rxcap;
+    uint64_t t_last_rx;             /* ms, last byte received or data byte sent */
+
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t replies;               /* completed requests, for latency stats */
+    uint64_t lat_sum_ms;            /* command sent to reply complete */
+    uint64_t lat_max_ms;
+    uint64_t frame_errors;          /* frames dropped for a bad CRC */
+};
+
+
+extern uint64_t sdlink_now_ms(void);
+
+extern int sdlink_open(struct sdlink *link, const char *path, speed_t baud);
+extern void sdlink_close(struct sdlink *link);
+
+extern int sdlink_submit(struct sdlink *link, const char *cmd, sdlink_cb cb, void *arg);
+extern int sdlink_submit_frames(struct sdlink *link, const char *cmd, sdlink_frame_cb fcb,
+                                sdlink_cb cb, void *arg);
+extern int sdlink_submit_data(struct sdlink *link, const char *cmd, const uint8_t *data,
+                              size_t len, sdlink_cb cb, void *arg);
+extern int sdlink_set_flow(struct sdlink *link, int rts);
+extern unsigned sdlink_pending(const struct sdlink *link);
+extern int sdlink_want_write(const struct sdlink *link);
+extern int sdlink_write(struct sdlink *link);
+extern int sdlink_read(struct sdlink *link);
+extern int sdlink_check_timeout(struct sdlink *link, uint64_t now);
+extern int sdlink_send_ctl(struct sdlink *link, uint8_t type, uint32_t block);
+extern int sdlink_run(struct sdlink *link, int (*idle)(struct sdlink *, void *), void *arg);
+
+extern speed_t sdlink_baud(long rate);
+extern uint16_t sdlink_crc16(uint16_t crc, const uint8_t *p, size_t len);
+extern uint32_t sdlink_le32(const uint8_t *p);
+extern int sdlink_unpack(const uint8_t *payload, size_t len, uint8_t *block);
+extern uint32_t sdlink_csd_blocks(const uint8_t *csd);
+extern int sdlink_parse_hex(const char *reply, const char *tag, uint8_t *out, size_t n);
+extern int sdlink_parse_dump(const char *reply, uint32_t first, uint32_t count, uint8_t *out);
+
+#endif /* _SDLOCKER_SDLINK_ */
@@ -0,0 +1,670 @@
+/*
+ *  sdlockctl      drive an SDLocker board from a Linux shell
+ *
+ *  usage: sdlockctl [-d tty] [-b baud] [-w window] [-W frames] [-R] command [args]
+ *
+ *  The tty defaults to $SDLOCKER_TTY, then /dev/ttyUSB0.  Any tty will
+ *  do, including the slave side of a pseudo-terminal run by sdemu.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sdlink.h"
+#include "sdimage.h"
+
+
+#define WRITE_CHUNK 2048            /* blocks per "w" command */
+
+
+static int verbose = 1;
+static unsigned frames = SDIMAGE_WINDOW;
+static int rtscts;
+
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: sdlockctl [-d tty] [-b baud] [-w window] [-W frames] [-R] [-q] command [args]\n"
+        "  info                        card registers, capacity and lock state\n"
+        "  lock | unlock               set or clear the password lock\n"
+        "  tlock | tunlock             set or clear the temporary write lock\n"
+        "  erase                       forced erase of a locked card (clears password)\n"
+        "  erase <first> <last>        erase a block range of an unlocked card\n"
+        "  wipe <first> <last> [0|1|2]  overwrite with zeros, ones or a random\n"
+        "                              pattern and verify it on the card\n"
+        "  auto [0-6]                  show or set the unattended action: off, lock,\n"
+        "                              unlock, erase, tlock, tunlock, format\n"
+        "  format                      partition and quick-format (FAT32, exFAT > 32 GB)\n"
+        "  read <block> [count]        hexdump blocks\n"
+        "  image [-f] <file> [first] [count]\n"
+        "                              copy blocks to file; resumes a partial file\n"
+        "                              unless -f is given; -W sets the frames in\n"
+        "                              flight (default 8, 0 for chunked requests)\n"
+        "  update <file> [manifest]    bring an image up to date in place; only 64 KB\n"
+        "                              chunks whose CRC-32 differs from the manifest\n"
+        "                              (default: from the file) cross the line\n"
+        "  manifest <file>             print the CRC-32 of each 64 KB chunk of an image\n"
+        "  write <file> [first]        write an image to the card from block first;\n"
+        "                              the board paces it with XON/XOFF, or with\n"
+        "                              RTS/CTS if -R is given (make FLOW=rts)\n"
+        "  fsimage <file>              image only file system metadata and used\n"
+        "                              clusters; free space reads as zeros\n"
+        "  bench                       run the card benchmark\n"
+        "  trace [clear]               list the board's recent SPI transactions\n"
+        "                              (firmware built with make TRACE=1)\n"
+        "  capture <file> <command>    run a console command (?, p, r 0 8, ...) with\n"
+        "                              every SPI byte captured, and append it to file\n"
+        "                              for sdreplay (firmware built with make TRACE=1)\n");
+    exit(2);
+}
+
+
+/*
+ *  Single-shot commands: print the reply, fail on a NULL (timed-out) reply.
+ */
+struct simple {
+    int status;
+    const char *fail;               /* reply text that means failure */
+};
+
+
+static void simple_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct simple *s = arg;
+
+    if (reply == NULL) {
+        s->status = -1;
+        return;
+    }
+    fwrite(reply, 1, len, stdout);
+    fputc('\n', stdout);
+    if ((s->fail && strstr(reply, s->fail)) || strstr(reply, "Cannot initialize")) {
+        s->status = 1;
+    }
+}
+
+
+static int run_simple(struct sdlink *link, const char *cmd, const char *fail) {
+    struct simple s = { 0, fail };
+
+    if ((sdlink_submit(link, cmd, simple_cb, &s) < 0) || (sdlink_run(link, NULL, NULL) < 0)) {
+        perror(link->path);
+        return 1;
+    }
+    return s.status ? 1 : 0;
+}
+
+
+/*
+ *  trace: list the FRAME_TRACE records, oldest first.
+ */
+static void trace_frame(struct sdlink *link, void *arg, uint8_t type, uint32_t block,
+                        const uint8_t *p, size_t len) {
+    static const char *types[] = { "", "din", "dout", "stop" };
+    uint32_t t0;
+    char name[8];
+
+    if ((type != FRAME_TRACE) || (len != block * TRACE_REC_LEN)) {
+        return;
+    }
+    printf("%10s  %-5s %8s  r1 tok %8s\n", "+us", "cmd", "arg", "busy us");
+    t0 = len ? sdlink_le32(p) : 0;
+    for (; len >= TRACE_REC_LEN; len -= TRACE_REC_LEN, p += TRACE_REC_LEN) {
+        if (p[8] < 4) {
+            snprintf(name, sizeof(name), "%s", types[p[8]]);
+        } else {
+            snprintf(name, sizeof(name), "CMD%u", p[8] & 0x3f);
+        }
+        printf("%10u  %-5s %08X  %02X  %02X %8u\n", sdlink_le32(p) - t0, name,
+               sdlink_le32(p + 4), p[9], p[10], (p[11] | (p[12] << 8)) << 4);
+    }
+}
+
+
+static int do_trace(struct sdlink *link, int argc, char **argv) {
+    struct simple s = { 0, "not built" };
+
+    if ((argc > 1) && (strcmp(argv[1], "clear") == 0)) {
+        return run_simple(link, "trace 2", NULL);
+    }
+    if ((sdlink_submit_frames(link, "trace 1", trace_frame, simple_cb, &s) < 0) ||
+        (sdlink_run(link, NULL, NULL) < 0)) {
+        perror(link->path);
+        return 1;
+    }
+    return s.status ? 1 : 0;
+}
+
+
+/*
+ *  capture: arm the board's SPI capture (trace 3), run one console command
+ *  and append its bus transcript to a file as a flow for sdreplay.  The
+ *  flow is kept in memory until it is complete, so a lost frame does not
+ *  leave half a flow in the file.  Commands that reply in frames of their
+ *  own cannot be captured.
+ */
+struct capture {
+    int status;
+    int ended;                      /* FRAME_END seen */
+    FILE *f;                        /* the flow being built */
+    char *buf;
+    size_t len;
+    uint32_t next;                  /* record number expected next */
+    uint64_t bytes;
+};
+
+
+static void capture_frame(struct sdlink *link, void *arg, uint8_t type, uint32_t block,
+                          const uint8_t *p, size_t len) {
+    struct capture *cap = arg;
+    unsigned dt;
+
+    if (type == FRAME_END) {
+        cap->ended = 1;
+        if (block != cap->next) {
+            cap->status = 1;
+        }
+        return;
+    }
+    if ((type != FRAME_SPI) || (len % CAPTURE_REC_LEN)) {
+        return;
+    }
+    if (block != cap->next) {
+        cap->status = 1;            /* a frame was lost */
+    }
+    cap->next = block + len / CAPTURE_REC_LEN;
+    for (; len >= CAPTURE_REC_LEN; len -= CAPTURE_REC_LEN, p += CAPTURE_REC_LEN) {
+        dt = p[3] | (p[4] << 8);
+        if (dt & CAPTURE_DT_MS) {
+            dt = (dt & ~CAPTURE_DT_MS) * 1000;
+        }
+        if (p[0] & CAPTURE_PAUSE) {
+            fprintf(cap->f, "pause %u\n", dt);
+        } else {
+            fprintf(cap->f, "%u %u %02x %02x\n", dt, p[0], p[1], p[2]);
+            cap->bytes++;
+        }
+    }
+}
+
+
+/*
+ *  The reply to trace 3 must say the capture is armed: older firmware or
+ *  firmware without the trace would run the command uncaptured.
+ */
+static void capture_arm_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct capture *cap = arg;
+
+    if (reply == NULL) {
+        cap->status = -1;
+    } else if (strstr(reply, "Capturing") == NULL) {
+        fwrite(reply, 1, len, stdout);
+        fputc('\n', stdout);
+        cap->status = 1;
+    }
+}
+
+
+static void capture_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct capture *cap = arg;
+
+    if (reply == NULL) {
+        cap->status = -1;
+        return;
+    }
+    if (len) {
+        fwrite(reply, 1, len, stdout);
+        fputc('\n', stdout);
+    }
+}
+
+
+static int do_capture(struct sdlink *link, int argc, char **argv) {
+    static const char *framed[] = { "d", "s", "c", "fs", "w", "trace", NULL };
+    struct capture cap = { 0 };
+    char cmd[SDLINK_CMD_MAX];
+    size_t n = 0;
+    FILE *f;
+    int i;
+
+    if (argc < 2) {
+        usage();
+    }
+    for (i = 0; framed[i]; i++) {
+        if (strcmp(argv[1], framed[i]) == 0) {
+            fprintf(stderr, "%s replies in frames and cannot be captured\n", argv[1]);
+            return 2;
+        }
+    }
+    for (i = 1; i < argc; i++) {
+        n += snprintf(cmd + n, sizeof(cmd) - n, "%s%s", i > 1 ? " " : "", argv[i]);
+        if (n >= sizeof(cmd) - 2) {
+            fprintf(stderr, "command too long\n");
+            return 2;
+        }
+    }
+    if ((sdlink_submit(link, "trace 3", capture_arm_cb, &cap) < 0) ||
+        (sdlink_run(link, NULL, NULL) < 0)) {
+        perror(link->path);
+        return 1;
+    }
+    if (cap.status) {
+        return 1;
+    }
+    cap.f = open_memstream(&cap.buf, &cap.len);
+    if (cap.f == NULL) {
+        perror("capture");
+        return 1;
+    }
+    fprintf(cap.f, "flow %s\n", cmd);
+    if ((sdlink_submit_frames(link, cmd, capture_frame, capture_cb, &cap) < 0) ||
+        (sdlink_run(link, NULL, NULL) < 0)) {
+        perror(link->path);
+        cap.status = 1;
+    }
+    fprintf(cap.f, "end\n");
+    fclose(cap.f);
+    if ((cap.status == 0) && !cap.ended) {
+        cap.status = 1;
+    }
+    if (cap.status) {
+        fprintf(stderr, "capture incomplete, %s not changed\n", argv[0]);
+    } else {
+        f = fopen(argv[0], "a");
+        if (f && (ftell(f) == 0)) {
+            fprintf(f, "# SPI transcript for sdreplay: flow <command>, then <dt_us> <cs> <mosi> <miso>\n");
+        }
+        if ((f == NULL) || (fwrite(cap.buf, 1, cap.len, f) != cap.len) || (fclose(f) != 0)) {
+            perror(argv[0]);
+            cap.status = 1;
+        } else {
+            printf("%llu bus bytes captured to %s\n", (unsigned long long)cap.bytes, argv[0]);
+        }
+    }
+    free(cap.buf);
+    return cap.status ? 1 : 0;
+}
+
+
+/*
+ *  info: optionally print the reply, and decode the capacity from the CSD.
+ */
+struct info {
+    uint32_t blocks;
+    int show;
+};
+
+
+static void info_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct info *info = arg;
+    uint8_t csd[16];
+
+    if (reply == NULL) {
+        return;
+    }
+    if (info->show) {
+        fwrite(reply, 1, len, stdout);
+        fputc('\n', stdout);
+    }
+    if (sdlink_parse_hex(reply, "CSD = ", csd, sizeof(csd)) == 0) {
+        info->blocks = sdlink_csd_blocks(csd);
+    }
+}
+
+
+static uint32_t card_blocks(struct sdlink *link, int show) {
+    struct info info = { 0, show };
+
+    if ((sdlink_submit(link, "?", info_cb, &info) < 0) || (sdlink_run(link, NULL, NULL) < 0)) {
+        perror(link->path);
+    }
+    return info.blocks;
+}
+
+
+static int do_image(struct sdlink *link, int argc, char **argv, int fs) {
+    static struct sdimage im;
+    int fresh = fs;
+    uint32_t first;
+    uint32_t count;
+
+    if (fs && (argc != 1)) {
+        usage();
+    }
+    if ((argc > 0) && (strcmp(argv[0], "-f") == 0)) {
+        fresh = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 1) {
+        usage();
+    }
+    first = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    if (argc > 2) {
+        count = strtoul(argv[2], NULL, 0);
+    } else {
+        count = card_blocks(link, 0);
+        if (count <= first) {
+            fprintf(stderr, "cannot size card\n");
+            return 1;
+        }
+        count -= first;
+    }
+
+    im.verbose = verbose;
+    im.fs = fs;
+    im.window = frames;
+    if (sdimage_open(&im, argv[0], first, count, fresh) < 0) {
+        perror(argv[0]);
+        return 1;
+    }
+    if (verbose && im.done) {
+        fprintf(stderr, "resuming at block %u\n", im.next);
+    }
+    if (sdlink_run(link, sdimage_fill, &im) < 0 && !im.error) {
+        perror(link->path);
+        im.error = 1;
+    }
+    sdimage_progress(&im, 1);
+    sdimage_close(&im);
+    return im.error ? 1 : 0;
+}
+
+
+/*
+ *  A manifest is one hex CRC-32 per line, as "manifest" prints it.
+ */
+static long read_manifest(const char *path, uint32_t **digests) {
+    char line[32];
+    uint32_t *d = NULL;
+    uint32_t *p;
+    long n = 0;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if ((n & 1023) == 0) {
+            p = realloc(d, (n + 1024) * sizeof(*d));
+            if (p == NULL) {
+                break;
+            }
+            d = p;
+        }
+        d[n++] = strtoul(line, NULL, 16);
+    }
+    fclose(f);
+    *digests = d;
+    return n;
+}
+
+
+static int do_manifest(int argc, char **argv) {
+    uint32_t *d;
+    long n;
+    long i;
+
+    if (argc != 1) {
+        usage();
+    }
+    n = sdimage_digests(argv[0], &d);
+    if (n < 0) {
+        perror(argv[0]);
+        return 1;
+    }
+    for (i = 0; i < n; i++) {
+        printf("%08x\n", d[i]);
+    }
+    free(d);
+    return 0;
+}
+
+
+static int do_update(struct sdlink *link, int argc, char **argv) {
+    static struct sdimage im;
+    uint32_t *d;
+    uint32_t count;
+    long n;
+
+    if ((argc < 1) || (argc > 2)) {
+        usage();
+    }
+    n = (argc > 1) ? read_manifest(argv[1], &d) : sdimage_digests(argv[0], &d);
+    if (n < 0) {
+        perror(argv[argc - 1]);
+        return 1;
+    }
+    count = card_blocks(link, 0);
+    if (count == 0) {
+        fprintf(stderr, "cannot size card\n");
+        free(d);
+        return 1;
+    }
+
+    im.verbose = verbose;
+    im.patch = 1;
+    im.digests = d;
+    im.ndigests = n;
+    if (sdimage_open(&im, argv[0], 0, count, 0) < 0) {
+        perror(argv[0]);
+        free(d);
+        return 1;
+    }
+    if (sdlink_run(link, sdimage_fill, &im) < 0 && !im.error) {
+        perror(link->path);
+        im.error = 1;
+    }
+    sdimage_progress(&im, 1);
+    sdimage_close(&im);
+    free(d);
+    return im.error ? 1 : 0;
+}
+
+
+/*
+ *  write: upload a file with "w" commands of up to WRITE_CHUNK blocks.  A
+ *  last partial block is padded with zeros.
+ */
+struct upload {
+    int status;
+    uint32_t done;                  /* blocks written */
+    uint32_t total;
+    uint64_t t_start;
+};
+
+
+static void upload_cb(struct sdlink *link, void *arg, const char *reply, size_t len) {
+    struct upload *u = arg;
+    unsigned long n;
+    const char *p;
+    double secs;
+
+    if (reply == NULL) {
+        u->status = -1;
+        return;
+    }
+    p = strstr(reply, " blocks in ");
+    if ((p == NULL) || strstr(reply, "overran")) {
+        fputc('\n', stderr);
+        fwrite(reply, 1, len, stdout);
+        fputc('\n', stdout);
+        u->status = 1;
+        return;
+    }
+    while ((p > reply) && (p[-1] >= '0') && (p[-1] <= '9')) {
+        p--;
+    }
+    n = strtoul(p, NULL, 10);
+    u->done += n;
+    if (verbose) {
+        secs = (sdlink_now_ms() - u->t_start) / 1000.0;
+        fprintf(stderr, "\r%u/%u blocks  %.1f KB/s   ", u->done, u->total,
+                secs > 0 ? u->done / 2.0 / secs : 0.0);
+    }
+}
+
+
+static int do_write(struct sdlink *link, int argc, char **argv) {
+    struct upload u = { 0 };
+    struct stat st;
+    uint8_t tail[512];
+    const uint8_t *map;
+    const uint8_t *data;
+    char cmd[SDLINK_CMD_MAX];
+    uint32_t first;
+    uint32_t n;
+    int fd;
+
+    if (argc < 1) {
+        usage();
+    }
+    first = argc > 1 ? strtoul(argv[1], NULL, 0) : 0;
+    fd = open(argv[0], O_RDONLY);
+    if ((fd < 0) || (fstat(fd, &st) < 0)) {
+        perror(argv[0]);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(argv[0]);
+        return 1;
+    }
+    if (sdlink_set_flow(link, rtscts) < 0) {
+        perror(link->path);
+        munmap((void *)map, st.st_size);
+        return 1;
+    }
+    u.total = (st.st_size + 511) / 512;
+    u.t_start = sdlink_now_ms();
+    while ((u.status == 0) && (u.done < u.total)) {
+        data = map + (uint64_t)u.done * 512;
+        n = u.total - u.done;
+        if (n > WRITE_CHUNK) {
+            n = WRITE_CHUNK;
+        }
+        if ((uint64_t)(u.done + n) * 512 > (uint64_t)st.st_size) {
+            if (n > 1) {
+                n--;                    /* whole blocks first, then the tail alone */
+            } else {
+                memset(tail, 0, sizeof(tail));
+                memcpy(tail, data, st.st_size - (uint64_t)u.done * 512);
+                data = tail;
+            }
+        }
+        snprintf(cmd, sizeof(cmd), "w %u %u", first + u.done, n);
+        if ((sdlink_submit_data(link, cmd, data, n * 512, upload_cb, &u) < 0) ||
+            (sdlink_run(link, NULL, NULL) < 0)) {
+            perror(link->path);
+            u.status = 1;
+        }
+    }
+    if (verbose) {
+        fputc('\n', stderr);
+    }
+    munmap((void *)map, st.st_size);
+    return u.status ? 1 : 0;
+}
+
+
+int main(int argc, char **argv) {
+    struct sdlink link;
+    const char *tty;
+    long baud = 38400;
+    unsigned window = 4;
+    char cmd[SDLINK_CMD_MAX];
+    int c;
+
+    tty = getenv("SDLOCKER_TTY");
+    if (tty == NULL) {
+        tty = "/dev/ttyUSB0";
+    }
+    while ((c = getopt(argc, argv, "+d:b:w:W:Rq")) != -1) {
+        switch (c) {
+        case 'd':   tty = optarg; break;
+        case 'b':   baud = strtol(optarg, NULL, 0); break;
+        case 'w':   window = strtoul(optarg, NULL, 0); break;
+        case 'W':   frames = strtoul(optarg, NULL, 0); break;
+        case 'R':   rtscts = 1; break;
+        case 'q':   verbose = 0; break;
+        default:    usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if ((argc < 1) || (window < 1) || (window > SDLINK_QLEN) || (frames == 1) ||
+        (frames > SDIMAGE_WINDOW_MAX)) {
+        usage();
+    }
+    if (strcmp(argv[0], "manifest") == 0) {
+        return do_manifest(argc - 1, argv + 1);
+    }
+    if (sdlink_baud(baud) == B0) {
+        fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return 2;
+    }
+    if (sdlink_open(&link, tty, sdlink_baud(baud)) < 0) {
+        perror(tty);
+        return 1;
+    }
+    link.window = window;
+
+    if (strcmp(argv[0], "info") == 0) {
+        uint32_t blocks = card_blocks(&link, 1);
+
+        printf("Capacity: %u blocks (%.1f MB)\n", blocks, blocks / 2048.0);
+        c = blocks ? 0 : 1;
+    } else if (strcmp(argv[0], "lock") == 0) {
+        c = run_simple(&link, "P", "failed");
+    } else if (strcmp(argv[0], "unlock") == 0) {
+        c = run_simple(&link, "p", "failed");
+    } else if (strcmp(argv[0], "tlock") == 0) {
+        c = run_simple(&link, "l", "failed");
+    } else if (strcmp(argv[0], "tunlock") == 0) {
+        c = run_simple(&link, "u", "failed");
+    } else if ((strcmp(argv[0], "erase") == 0) && (argc >= 3)) {
+        snprintf(cmd, sizeof(cmd), "erase %s %s", argv[1], argv[2]);
+        c = run_simple(&link, cmd, "failed");
+    } else if (strcmp(argv[0], "erase") == 0) {
+        c = run_simple(&link, "E", "failed");
+    } else if ((strcmp(argv[0], "wipe") == 0) && (argc >= 3)) {
+        snprintf(cmd, sizeof(cmd), "wipe %s %s %s", argv[1], argv[2], argc >= 4 ? argv[3] : "0");
+        c = run_simple(&link, cmd, "failed");
+    } else if (strcmp(argv[0], "auto") == 0) {
+        snprintf(cmd, sizeof(cmd), "auto %s", argc >= 2 ? argv[1] : "");
+        c = run_simple(&link, cmd, "Usage");
+    } else if (strcmp(argv[0], "format") == 0) {
+        c = run_simple(&link, "format", "failed");
+    } else if (strcmp(argv[0], "bench") == 0) {
+        c = run_simple(&link, "bench", "failed");
+    } else if ((strcmp(argv[0], "read") == 0) && (argc >= 2)) {
+        snprintf(cmd, sizeof(cmd), "r %s %s", argv[1], argc > 2 ? argv[2] : "1");
+        c = run_simple(&link, cmd, "failed");
+    } else if (strcmp(argv[0], "trace") == 0) {
+        c = do_trace(&link, argc, argv);
+    } else if (strcmp(argv[0], "capture") == 0) {
+        c = do_capture(&link, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "image") == 0) {
+        c = do_image(&link, argc - 1, argv + 1, 0);
+    } else if (strcmp(argv[0], "update") == 0) {
+        c = do_update(&link, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "write") == 0) {
+        c = do_write(&link, argc - 1, argv + 1);
+    } else if (strcmp(argv[0], "fsimage") == 0) {
+        c = do_image(&link, argc - 1, argv + 1, 1);
+    } else {
+        usage();
+    }
+    sdlink_close(&link);
+    return c;
+}
@@ -0,0 +1,807 @@
+/*
+ *  sdnbd      serve the card in an SDLocker board as a read-only NBD export
+ *
+ *  usage: sdnbd [-d tty] [-b baud] [-w window] [-c cache_kb] [-a readahead_kb] socket
+ *
+ *  Listens on a Unix socket for one NBD client at a time, for instance
+ *  nbd-client -unix socket /dev/nbd0 -readonly, or nbd+unix:///?socket=...
+ *  for qemu and libnbd tools.  Reads are answered from an LRU block cache.
+ *  Misses become "d" dump requests, one CMD18 range per run of missing
+ *  blocks, with the blocks wanted by every waiting read merged into as few
+ *  ranges as possible.  A read that carries on where the last one ended
+ *  grows a readahead window, doubling up to the -a limit, so a sequential
+ *  scan keeps the serial line busy.  The export is read-only.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "sdlink.h"
+
+
+#define NBD_MAGIC           0x4e42444d41474943ULL   /* "NBDMAGIC" */
+#define NBD_IHAVEOPT        0x49484156454f5054ULL   /* "IHAVEOPT" */
+#define NBD_REP_MAGIC       0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC   0x25609513
+#define NBD_REPLY_MAGIC     0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 1   /* handshake flags */
+#define NBD_FLAG_NO_ZEROES  2
+#define NBD_FLAG_HAS_FLAGS  1       /* transmission flags */
+#define NBD_FLAG_READ_ONLY  2
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+#define NBD_REP_ACK         1
+#define NBD_REP_INFO        3
+#define NBD_REP_ERR_UNSUP   0x80000001
+#define NBD_INFO_EXPORT     0
+
+#define NBD_CMD_READ        0
+#define NBD_CMD_WRITE       1
+#define NBD_CMD_DISC        2
+#define NBD_CMD_FLUSH       3
+#define NBD_EPERM           1
+#define NBD_EIO             5
+#define NBD_EINVAL          22
+
+#define SDNBD_FETCH_MAX     256     /* blocks per dump request */
+#define SDNBD_READ_MAX      (32 << 20)  /* bytes per NBD read */
+#define SDNBD_RA_START      16      /* blocks, first readahead of a sequential run */
+
+
+/*
+ *  LRU block cache: a hash of block numbers over a pool of entries kept on
+ *  a most-recently-used list.
+ */
+struct centry {
+    uint32_t block;
+    int prev;                       /* MRU list, -1 ends it */
+    int next;
+    int hnext;                      /* hash chain */
+    uint8_t data[512];
+};
+
+static struct centry *cache;
+static int *cache_hash;
+static unsigned cache_size;
+static unsigned cache_used;
+static unsigned cache_hmask;
+static int cache_mru = -1;
+static int cache_lru = -1;
+
+
+/*
+ *  An NBD read waiting for blocks from the board.
+ */
+struct nbdread {
+    struct nbdread *next;
+    uint64_t handle;
+    uint32_t first;                 /* block */
+    uint32_t count;                 /* blocks */
+    uint32_t skip;                  /* bytes into the first block */
+    uint32_t len;                   /* bytes asked for */
+    uint32_t missing;               /* blocks not yet in buf */
+    uint8_t *have;                  /* per block */
+    uint8_t *buf;
+    uint64_t t_start;
+};
+
+
+/*
+ *  A dump request on the link.
+ */
+struct fetch {
+    struct fetch *next;
+    uint32_t first;
+    uint32_t count;
+    int ok;                         /* FRAME_END covered the whole range */
+};
+
+
+static struct sdlink board;
+static struct nbdread *reads;
+static struct fetch *fetches;
+static int client = -1;
+static uint32_t card_blocks;
+
+static uint32_t ra_next;            /* block after the last read */
+static uint32_t ra_size;            /* current readahead, blocks */
+static uint32_t ra_max;
+static uint32_t ra_from;            /* readahead still to fetch */
+static uint32_t ra_to;
+
+static struct {
+    uint64_t reads;
+    uint64_t bytes;
+    uint64_t hits;                  /* blocks found in the cache */
+    uint64_t misses;
+    uint64_t fetches;
+    uint64_t fetched;               /* blocks asked of the board */
+    uint64_t lat_sum_ms;
+    uint64_t lat_max_ms;
+} stats;
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: sdnbd [-d tty] [-b baud] [-w window] [-c cache_kb] [-a readahead_kb] socket\n");
+    exit(2);
+}
+
+
+static unsigned cache_slot(uint32_t block) {
+    return (block * 2654435761u) & cache_hmask;
+}
+
+
+static void cache_unlink(int i) {
+    if (cache[i].prev >= 0) cache[cache[i].prev].next = cache[i].next;
+    else cache_mru = cache[i].next;
+    if (cache[i].next >= 0) cache[cache[i].next].prev = cache[i].prev;
+    else cache_lru = cache[i].prev;
+}
+
+
+static void cache_front(int i) {
+    cache[i].prev = -1;
+    cache[i].next = cache_mru;
+    if (cache_mru >= 0) cache[cache_mru].prev = i;
+    cache_mru = i;
+    if (cache_lru < 0) cache_lru = i;
+}
+
+
+static int cache_find(uint32_t block) {
+    int i;
+
+    for (i = cache_hash[cache_slot(block)]; i >= 0; i = cache[i].hnext) {
+        if (cache[i].block == block) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+static const uint8_t *cache_get(uint32_t block) {
+    int i = cache_find(block);
+
+    if (i < 0) {
+        return NULL;
+    }
+    cache_unlink(i);
+    cache_front(i);
+    return cache[i].data;
+}
+
+
+static void cache_put(uint32_t block, const uint8_t *data) {
+    int *pp;
+    int i;
+
+    i = cache_find(block);
+    if (i >= 0) {
+        cache_unlink(i);
+    } else {
+        if (cache_used < cache_size) {
+            i = cache_used++;
+        } else {
+            i = cache_lru;          /* evict the least recently used */
+            cache_unlink(i);
+            for (pp = &cache_hash[cache_slot(cache[i].block)]; *pp != i; pp = &cache[*pp].hnext)
+                ;
+            *pp = cache[i].hnext;
+        }
+        cache[i].block = block;
+        cache[i].hnext = cache_hash[cache_slot(block)];
+        cache_hash[cache_slot(block)] = i;
+    }
+    memcpy(cache[i].data, data, 512);
+    cache_front(i);
+}
+
+
+static int cache_init(unsigned kb) {
+    unsigned i;
+
+    cache_size = kb * 2;
+    for (cache_hmask = 1; cache_hmask < cache_size; cache_hmask <<= 1)
+        ;
+    cache = calloc(cache_size, sizeof(*cache));
+    cache_hash = malloc(cache_hmask * sizeof(*cache_hash));
+    if ((cache == NULL) || (cache_hash == NULL)) {
+        return -1;
+    }
+    for (i = 0; i < cache_hmask; i++) {
+        cache_hash[i] = -1;
+    }
+    cache_hmask--;
+    return 0;
+}
+
+
+static int read_full(int fd, void *p, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -1;
+        p = (uint8_t *)p + n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static int write_full(int fd, const void *p, size_t len) {
+    ssize_t n;
+
+    while (len) {
+        n = send(fd, p, len, MSG_NOSIGNAL);
+        if ((n < 0) && (errno == EINTR)) continue;
+        if (n <= 0) return -1;
+        p = (const uint8_t *)p + n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+static void put32(uint8_t *p, uint32_t v) {
+    v = htobe32(v);
+    memcpy(p, &v, 4);
+}
+
+
+static void put64(uint8_t *p, uint64_t v) {
+    v = htobe64(v);
+    memcpy(p, &v, 8);
+}
+
+
+static uint32_t get32(const uint8_t *p) {
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return be32toh(v);
+}
+
+
+static uint64_t get64(const uint8_t *p) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    return be64toh(v);
+}
+
+
+/*
+ *  Simple reply, followed by the data of a good read.
+ */
+static void nbd_reply(uint64_t handle, uint32_t error, const uint8_t *data, uint32_t len) {
+    uint8_t r[16];
+
+    put32(r, NBD_REPLY_MAGIC);
+    put32(r + 4, error);
+    put64(r + 8, handle);
+    if ((write_full(client, r, sizeof(r)) < 0) || (data && (write_full(client, data, len) < 0))) {
+        close(client);
+        client = -1;
+    }
+}
+
+
+static void read_done(struct nbdread *rd, uint32_t error) {
+    struct nbdread **pp;
+    uint64_t ms;
+
+    for (pp = &reads; *pp != rd; pp = &(*pp)->next)
+        ;
+    *pp = rd->next;
+    if (client >= 0) {
+        nbd_reply(rd->handle, error, error ? NULL : rd->buf + rd->skip, rd->len);
+    }
+    ms = sdlink_now_ms() - rd->t_start;
+    stats.lat_sum_ms += ms;
+    if (ms > stats.lat_max_ms) stats.lat_max_ms = ms;
+    free(rd->have);
+    free(rd->buf);
+    free(rd);
+}
+
+
+/*
+ *  A block has arrived: cache it and hand it to every read waiting for it.
+ */
+static void deliver(uint32_t block, const uint8_t *data) {
+    struct nbdread *rd;
+    struct nbdread *next;
+    uint32_t i;
+
+    cache_put(block, data);
+    for (rd = reads; rd != NULL; rd = next) {
+        next = rd->next;
+        if ((block < rd->first) || (block - rd->first >= rd->count)) {
+            continue;
+        }
+        i = block - rd->first;
+        if (!rd->have[i]) {
+            memcpy(rd->buf + i * 512, data, 512);
+            rd->have[i] = 1;
+            if (--rd->missing == 0) {
+                read_done(rd, 0);
+            }
+        }
+    }
+}
+
+
+static void fetch_frame(struct sdlink *l, void *arg, uint8_t type, uint32_t block,
+                        const uint8_t *payload, size_t len) {
+    struct fetch *f = arg;
+    uint8_t data[512];
+    uint32_t count;
+
+    if (type == FRAME_END) {
+        f->ok = (len == 1) && (payload[0] == FRAME_OK) && (block == f->first + f->count);
+        return;
+    }
+    if ((block < f->first) || (block - f->first >= f->count)) {
+        return;
+    }
+    if (type == FRAME_DATA) {
+        if (len == 512) {
+            deliver(block, payload);
+        }
+    } else if (type == FRAME_PACKED) {
+        if (sdlink_unpack(payload, len, data) == 0) {
+            deliver(block, data);
+        }
+    } else if ((type == FRAME_FILL) && (len == 5)) {
+        count = sdlink_le32(payload);
+        if (count > f->first + f->count - block) {
+            count = f->first + f->count - block;
+        }
+        memset(data, payload[4], sizeof(data));
+        for (; count; count--, block++) {
+            deliver(block, data);
+        }
+    }
+}
+
+
+/*
+ *  A dump request is over; reads still missing blocks of a failed one
+ *  get EIO.
+ */
+static void fetch_cb(struct sdlink *l, void *arg, const char *reply, size_t len) {
+    struct fetch *f = arg;
+    struct fetch **pp;
+    struct nbdread *rd;
+    struct nbdread *next;
+    uint32_t b;
+
+    for (pp = &fetches; *pp != f; pp = &(*pp)->next)
+        ;
+    *pp = f->next;
+    if ((reply == NULL) || !f->ok) {
+        for (rd = reads; rd != NULL; rd = next) {
+            next = rd->next;
+            for (b = f->first; b < f->first + f->count; b++) {
+                if ((b >= rd->first) && (b - rd->first < rd->count) && !rd->have[b - rd->first]) {
+                    read_done(rd, NBD_EIO);
+                    break;
+                }
+            }
+        }
+    }
+    free(f);
+}
+
+
+static int in_flight(uint32_t block) {
+    struct fetch *f;
+
+    for (f = fetches; f != NULL; f = f->next) {
+        if ((block >= f->first) && (block - f->first < f->count)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static int wanted(uint32_t block) {
+    return (block < card_blocks) && !in_flight(block) && (cache_find(block) < 0);
+}
+
+
+/*
+ *  Queue dump requests for the blocks that waiting reads lack, then for
+ *  readahead.  Reads are queued oldest first and adjacent runs are merged,
+ *  so blocks wanted by several reads go out as one CMD18 range.
+ */
+static void plan_fetches(void) {
+    char cmd[SDLINK_CMD_MAX];
+    struct nbdread *rd;
+    struct fetch *f;
+    uint32_t start;
+    uint32_t end;
+    uint32_t b;
+    int more;
+
+    while (sdlink_pending(&board) < board.window) {
+        start = end = 0;
+        more = 0;
+        for (rd = reads; (rd != NULL) && !more; rd = rd->next) {
+            for (b = rd->first; b < rd->first + rd->count; b++) {
+                if (!rd->have[b - rd->first] && wanted(b)) {
+                    start = b;
+                    more = 1;
+                    break;
+                }
+            }
+        }
+        if (!more) {
+            while ((ra_from < ra_to) && !wanted(ra_from)) {
+                ra_from++;
+            }
+            if (ra_from >= ra_to) {
+                return;
+            }
+            start = ra_from;
+        }
+        for (end = start + 1; (end - start < SDNBD_FETCH_MAX) && wanted(end); end++) {
+            for (rd = reads; rd != NULL; rd = rd->next) {
+                if ((end >= rd->first) && (end - rd->first < rd->count)) {
+                    break;
+                }
+            }
+            if ((rd == NULL) && ((end < ra_from) || (end >= ra_to))) {
+                break;              /* nobody wants it */
+            }
+        }
+
+        f = calloc(1, sizeof(*f));
+        if (f == NULL) {
+            return;
+        }
+        f->first = start;
+        f->count = end - start;
+        snprintf(cmd, sizeof(cmd), "d %u %u", f->first, f->count);
+        if (sdlink_submit_frames(&board, cmd, fetch_frame, fetch_cb, f) < 0) {
+            free(f);
+            return;
+        }
+        f->next = fetches;
+        fetches = f;
+        stats.fetches++;
+        stats.fetched += f->count;
+    }
+}
+
+
+static void start_read(uint64_t handle, uint64_t offset, uint32_t len) {
+    struct nbdread *rd;
+    struct nbdread **pp;
+    const uint8_t *data;
+    uint32_t i;
+
+    stats.reads++;
+    stats.bytes += len;
+    if ((len == 0) || (len > SDNBD_READ_MAX) || (offset + len > (uint64_t)card_blocks * 512)) {
+        nbd_reply(handle, NBD_EINVAL, NULL, 0);
+        return;
+    }
+    rd = calloc(1, sizeof(*rd));
+    if (rd == NULL) {
+        nbd_reply(handle, NBD_EIO, NULL, 0);
+        return;
+    }
+    rd->handle = handle;
+    rd->first = offset / 512;
+    rd->skip = offset % 512;
+    rd->len = len;
+    rd->count = (rd->skip + len + 511) / 512;
+    rd->have = calloc(rd->count, 1);
+    rd->buf = malloc((size_t)rd->count * 512);
+    rd->t_start = sdlink_now_ms();
+    if ((rd->have == NULL) || (rd->buf == NULL)) {
+        free(rd->have);
+        free(rd->buf);
+        free(rd);
+        nbd_reply(handle, NBD_EIO, NULL, 0);
+        return;
+    }
+    for (pp = &reads; *pp != NULL; pp = &(*pp)->next)
+        ;
+    *pp = rd;
+
+    /* sequential reads grow the readahead, anything else resets it */
+    if ((rd->first == ra_next) || (rd->first + 1 == ra_next)) {
+        ra_size = ra_size ? ra_size * 2 : SDNBD_RA_START;
+        if (ra_size > ra_max) ra_size = ra_max;
+    } else {
+        ra_size = 0;
+    }
+    ra_next = rd->first + rd->count;
+    ra_from = ra_next;
+    ra_to = ra_next + ra_size;
+
+    rd->missing = rd->count;
+    for (i = 0; i < rd->count; i++) {
+        data = cache_get(rd->first + i);
+        if (data != NULL) {
+            memcpy(rd->buf + i * 512, data, 512);
+            rd->have[i] = 1;
+            rd->missing--;
+            stats.hits++;
+        } else {
+            stats.misses++;
+        }
+    }
+    if (rd->missing == 0) {
+        read_done(rd, 0);
+    }
+}
+
+
+/*
+ *  One transmission-phase request.  Returns -1 when the client is done.
+ */
+static int client_request(void) {
+    uint8_t h[28];
+    uint8_t junk[4096];
+    uint16_t type;
+    uint64_t handle;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t n;
+
+    if ((read_full(client, h, sizeof(h)) < 0) || (get32(h) != NBD_REQUEST_MAGIC)) {
+        return -1;
+    }
+    type = (h[6] << 8) | h[7];
+    handle = get64(h + 8);
+    offset = get64(h + 16);
+    len = get32(h + 24);
+    switch (type) {
+    case NBD_CMD_READ:
+        start_read(handle, offset, len);
+        break;
+    case NBD_CMD_WRITE:
+        for (; len; len -= n) {
+            n = len < sizeof(junk) ? len : sizeof(junk);
+            if (read_full(client, junk, n) < 0) {
+                return -1;
+            }
+        }
+        nbd_reply(handle, NBD_EPERM, NULL, 0);
+        break;
+    case NBD_CMD_DISC:
+        return -1;
+    case NBD_CMD_FLUSH:
+        nbd_reply(handle, 0, NULL, 0);
+        break;
+    default:
+        nbd_reply(handle, NBD_EINVAL, NULL, 0);
+        break;
+    }
+    return client >= 0 ? 0 : -1;
+}
+
+
+static int option_reply(uint32_t opt, uint32_t type, const uint8_t *data, uint32_t len) {
+    uint8_t r[20];
+
+    put64(r, NBD_REP_MAGIC);
+    put32(r + 8, opt);
+    put32(r + 12, type);
+    put32(r + 16, len);
+    if (write_full(client, r, sizeof(r)) < 0) {
+        return -1;
+    }
+    return len ? write_full(client, data, len) : 0;
+}
+
+
+/*
+ *  Fixed newstyle handshake.  Any export name is accepted; there is only
+ *  the card.  Returns 0 once in the transmission phase.
+ */
+static int handshake(void) {
+    uint8_t h[18];
+    uint8_t o[16];
+    uint8_t info[12];
+    uint8_t zeroes[124];
+    uint32_t cflags;
+    uint32_t opt;
+    uint32_t len;
+    uint32_t n;
+    char skip[256];
+    uint16_t tflags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY;
+
+    put64(h, NBD_MAGIC);
+    put64(h + 8, NBD_IHAVEOPT);
+    h[16] = 0;
+    h[17] = NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES;
+    if ((write_full(client, h, sizeof(h)) < 0) || (read_full(client, o, 4) < 0)) {
+        return -1;
+    }
+    cflags = get32(o);
+    for (;;) {
+        if ((read_full(client, o, 16) < 0) || (get64(o) != NBD_IHAVEOPT)) {
+            return -1;
+        }
+        opt = get32(o + 8);
+        len = get32(o + 12);
+        for (; len; len -= n) {
+            n = len < sizeof(skip) ? len : sizeof(skip);
+            if (read_full(client, skip, n) < 0) {
+                return -1;
+            }
+        }
+        put64(info + 2, (uint64_t)card_blocks * 512);
+        info[10] = tflags >> 8;
+        info[11] = tflags;
+        if (opt == NBD_OPT_EXPORT_NAME) {
+            memset(zeroes, 0, sizeof(zeroes));
+            if ((write_full(client, info + 2, 10) < 0) ||
+                (!(cflags & NBD_FLAG_NO_ZEROES) && (write_full(client, zeroes, sizeof(zeroes)) < 0))) {
+                return -1;
+            }
+            return 0;
+        }
+        if ((opt == NBD_OPT_GO) || (opt == NBD_OPT_INFO)) {
+            info[0] = 0;
+            info[1] = NBD_INFO_EXPORT;
+            if ((option_reply(opt, NBD_REP_INFO, info, sizeof(info)) < 0) ||
+                (option_reply(opt, NBD_REP_ACK, NULL, 0) < 0)) {
+                return -1;
+            }
+            if (opt == NBD_OPT_GO) {
+                return 0;
+            }
+        } else if (opt == NBD_OPT_ABORT) {
+            option_reply(opt, NBD_REP_ACK, NULL, 0);
+            return -1;
+        } else if (option_reply(opt, NBD_REP_ERR_UNSUP, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+}
+
+
+static void show_stats(void) {
+    fprintf(stderr, "%llu reads (%.1f MB), %llu blocks from cache, %llu missed; "
+        "%llu dumps of %llu blocks; latency %.0f ms avg, %llu ms max\n",
+        (unsigned long long)stats.reads, stats.bytes / 1048576.0,
+        (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+        (unsigned long long)stats.fetches, (unsigned long long)stats.fetched,
+        stats.reads ? (double)stats.lat_sum_ms / stats.reads : 0.0,
+        (unsigned long long)stats.lat_max_ms);
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+static void info_cb(struct sdlink *l, void *arg, const char *reply, size_t len) {
+    uint8_t csd[16];
+
+    if ((reply != NULL) && (sdlink_parse_hex(reply, "CSD = ", csd, sizeof(csd)) == 0)) {
+        card_blocks = sdlink_csd_blocks(csd);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    struct sockaddr_un sa;
+    struct pollfd pfd[2];
+    struct nbdread *rd;
+    const char *tty;
+    long baud = 38400;
+    unsigned window = 4;
+    unsigned cache_kb = 4096;
+    unsigned ra_kb = 64;
+    int listener;
+    int c;
+
+    tty = getenv("SDLOCKER_TTY");
+    if (tty == NULL) {
+        tty = "/dev/ttyUSB0";
+    }
+    while ((c = getopt(argc, argv, "d:b:w:c:a:")) != -1) {
+        switch (c) {
+        case 'd':   tty = optarg; break;
+        case 'b':   baud = strtol(optarg, NULL, 0); break;
+        case 'w':   window = strtoul(optarg, NULL, 0); break;
+        case 'c':   cache_kb = strtoul(optarg, NULL, 0); break;
+        case 'a':   ra_kb = strtoul(optarg, NULL, 0); break;
+        default:    usage();
+        }
+    }
+    if ((optind != argc - 1) || (window < 1) || (window > SDLINK_QLEN) || (cache_kb < 64) ||
+        (strlen(argv[optind]) >= sizeof(sa.sun_path))) {
+        usage();
+    }
+    ra_max = ra_kb * 2;
+    if ((sdlink_baud(baud) == B0) || (cache_init(cache_kb) < 0)) {
+        fprintf(stderr, "unsupported baud rate %ld or cache size\n", baud);
+        return 2;
+    }
+    if (sdlink_open(&board, tty, sdlink_baud(baud)) < 0) {
+        perror(tty);
+        return 1;
+    }
+    board.window = window;
+    if ((sdlink_submit(&board, "?", info_cb, NULL) < 0) || (sdlink_run(&board, NULL, NULL) < 0) ||
+        (card_blocks == 0)) {
+        fprintf(stderr, "%s: cannot size card\n", tty);
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, argv[optind]);
+    unlink(sa.sun_path);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if ((listener < 0) || (bind(listener, (struct sockaddr *)&sa, sizeof(sa)) < 0) ||
+        (listen(listener, 1) < 0)) {
+        perror(sa.sun_path);
+        return 1;
+    }
+    fprintf(stderr, "serving %u blocks (%.1f MB) on %s\n", card_blocks, card_blocks / 2048.0, sa.sun_path);
+
+    for (;;) {
+        if (client < 0) {
+            while ((rd = reads) != NULL) {
+                read_done(rd, NBD_EIO);
+            }
+            if (stats.reads) {
+                show_stats();
+            }
+        }
+
+        plan_fetches();
+        if (sdlink_write(&board) < 0) {
+            perror(board.path);
+            return 1;
+        }
+        pfd[0].fd = board.fd;
+        pfd[0].events = POLLIN | (sdlink_want_write(&board) ? POLLOUT : 0);
+        pfd[1].fd = client >= 0 ? client : listener;
+        pfd[1].events = POLLIN;
+        if ((poll(pfd, 2, 100) < 0) && (errno != EINTR)) {
+            return 1;
+        }
+        if ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) && (sdlink_read(&board) < 0)) {
+            perror(board.path);
+            return 1;
+        }
+        sdlink_check_timeout(&board, sdlink_now_ms());
+        if (!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        if (client >= 0) {
+            if (client_request() < 0) {
+                close(client);
+                client = -1;
+            }
+            continue;
+        }
+        client = accept(listener, NULL, NULL);
+        if ((client >= 0) && (handshake() < 0)) {
+            close(client);
+            client = -1;
+        }
+        ra_next = ra_size = ra_from = ra_to = 0;
+    }
+}
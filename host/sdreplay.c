@@ -0,0 +1,552 @@
+/*
+ *  sdreplay      replay captured SPI transcripts against the firmware's driver
+ *
+ *  usage: sdreplay [-v] transcript...
+ *
+ *  The firmware itself (sdlocker2.c and frame.c) is built for Linux with
+ *  the stand-in AVR headers in avrsim/ and SPI_REPLAY set, so xchg() comes
+ *  here.  Each flow of a transcript is one console command captured on a
+ *  board with sdlockctl capture; it is typed into the firmware's console
+ *  and the recorded card answers it, byte by byte.  For every flow the
+ *  bytes the driver sends are checked against the recording and the bus
+ *  bytes and simulated time are reported, so a change to the driver can
+ *  be checked for both behaviour and speed without a board.
+ *
+ *  A transcript is text:
+ *
+ *    flow <command>                  the console command, as typed
+ *    <dt_us> <cs> <mosi> <miso>      one byte: us since the previous one,
+ *                                    chip selects (1 main, 2 second socket,
+ *                                    see trace.h) and the bytes in hex
+ *    pause <us>                      the board was sending capture frames
+ *    end                             the flow is complete
+ *
+ *  with # starting a comment.  The recorded card is played loosely where
+ *  polling is concerned: if the driver stops polling a busy card or a
+ *  data token sooner than on the board, the rest of those polls are
+ *  dropped, and if it polls longer it gets the last answer again.  Any
+ *  other byte that differs is a divergence; the recording is then played
+ *  on in step, and the flow fails.  Time is simulated: a recorded byte
+ *  takes the time it took on the board, an extra poll takes one byte at
+ *  the current SPI clock, and reading the clock with no bus byte since
+ *  the last read moves it on 1 us, so waits on the clock alone end.
+ *
+ *  -v prints the firmware's console output for each flow.  The exit
+ *  status is 1 if any flow diverged, stopped early or ran past its end.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "avrsim/avr/io.h"
+#include "../uart.h"
+#include "../timer.h"
+#include "../trace.h"
+#include "../mem.h"
+
+
+#define SINGLE_KEYS     "?ulpPE"    /* console commands that take no CR */
+#define INPUT_MAX       64
+
+
+struct rec {
+    uint32_t dt;                    /* us since the previous record */
+    uint8_t cs;                     /* CAPTURE_CS_xxx */
+    uint8_t mosi;
+    uint8_t miso;
+    uint8_t pause;                  /* a pause record, dt only */
+};
+
+
+struct flow {
+    char cmd[INPUT_MAX];
+    struct rec *recs;
+    size_t n;
+    size_t cap;
+    uint64_t bytes;                 /* recorded bus bytes */
+    uint64_t rec_us;                /* their time on the board */
+    uint64_t pause_us;              /* time the capture stopped the board */
+};
+
+
+/*
+ *  Where the replay of the current flow stands.
+ */
+struct replay {
+    size_t pos;                     /* next record to play */
+    const struct rec *last;         /* last record played */
+    uint64_t bytes;                 /* bus bytes the driver clocked */
+    uint64_t diverged;
+    uint64_t added;                 /* polls beyond the recording */
+    uint64_t dropped;               /* recorded polls the driver did not make */
+    uint64_t past_end;
+    size_t first_div;               /* bus byte of the first divergence */
+    uint8_t div_mosi;
+    uint8_t div_cs;
+    const struct rec *div_rec;
+    uint64_t t_start;               /* clock_ns when the command was typed */
+};
+
+
+/*
+ *  The board's registers; only their values matter.
+ */
+volatile uint8_t PORTB, DDRB, PINB;
+volatile uint8_t PORTC, DDRC, PINC;
+volatile uint8_t PORTD, DDRD, PIND;
+volatile uint8_t SPCR, SPSR, SPDR;
+volatile uint8_t PCICR, PCMSK0, PCMSK1, PCMSK2;
+volatile uint8_t ACSR, SREG;
+
+FILE uart_output;
+FILE uart_input;
+FILE *avrsim_stdin;
+FILE *avrsim_stdout;
+FILE *avrsim_stderr;
+
+
+static struct flow *flows;
+static size_t nflows;
+static long cur = -1;               /* flow being played, -1 before the first */
+static struct replay st;
+static uint64_t clock_ns;
+static int spun;                    /* clock reads since the last bus byte */
+static char input[INPUT_MAX];
+static size_t inpos;
+static size_t inlen;
+static char tail[4];                /* last console output, to spot the prompt */
+static int verbose;
+static int failed;
+static uint64_t total_bytes;
+static uint64_t total_ns;
+
+
+extern int firmware_main(void);
+
+
+/*
+ *  Read one transcript; flows without an "end" line are left out.
+ */
+static int load(const char *path) {
+    struct flow *f = NULL;
+    struct rec r;
+    char line[128];
+    unsigned dt, cs, mosi, miso;
+    unsigned lineno = 0;
+    FILE *fp;
+    void *p;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        line[strcspn(line, "\r\n")] = 0;
+        memset(&r, 0, sizeof(r));
+        if ((line[0] == '#') || (line[0] == 0)) {
+            continue;
+        } else if (strncmp(line, "flow ", 5) == 0) {
+            if (f) {
+                fprintf(stderr, "%s:%u: flow \"%s\" has no end, skipped\n", path, lineno, f->cmd);
+                free(f->recs);
+            }
+            p = realloc(flows, (nflows + 1) * sizeof(*flows));
+            if (p == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            flows = p;
+            f = &flows[nflows];
+            memset(f, 0, sizeof(*f));
+            snprintf(f->cmd, sizeof(f->cmd), "%.*s", (int)sizeof(f->cmd) - 1, line + 5);
+            continue;
+        } else if (f == NULL) {
+            fprintf(stderr, "%s:%u: record outside a flow\n", path, lineno);
+            continue;
+        } else if (strcmp(line, "end") == 0) {
+            nflows++;
+            f = NULL;
+            continue;
+        } else if (sscanf(line, "pause %u", &dt) == 1) {
+            r.dt = dt;
+            r.pause = 1;
+            f->pause_us += dt;
+        } else if (sscanf(line, "%u %u %x %x", &dt, &cs, &mosi, &miso) == 4) {
+            r.dt = dt;
+            r.cs = cs;
+            r.mosi = mosi;
+            r.miso = miso;
+            f->bytes++;
+            f->rec_us += dt;
+        } else {
+            fprintf(stderr, "%s:%u: bad line \"%s\"\n", path, lineno, line);
+            continue;
+        }
+        if (f->n == f->cap) {
+            f->cap = f->cap ? f->cap * 2 : 1024;
+            p = realloc(f->recs, f->cap * sizeof(*f->recs));
+            if (p == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            f->recs = p;
+        }
+        f->recs[f->n++] = r;
+    }
+    if (f) {
+        fprintf(stderr, "%s: flow \"%s\" has no end, skipped\n", path, f->cmd);
+        free(f->recs);
+    }
+    fclose(fp);
+    return 0;
+}
+
+
+/*
+ *  One byte at the SPI clock the firmware has set up.
+ */
+static uint64_t byte_ns(void) {
+    static const unsigned div[] = { 4, 16, 64, 128 };
+    uint64_t d;
+
+    d = div[SPCR & ((1 << SPR1) | (1 << SPR0))];
+    if (SPSR & (1 << SPI2X)) {
+        d /= 2;
+    }
+    return 8 * d * 1000000000ULL / F_CPU;
+}
+
+
+static void skip_pauses(const struct flow *f) {
+    while ((st.pos < f->n) && f->recs[st.pos].pause) {
+        st.pos++;
+    }
+}
+
+
+/*
+ *  A recorded poll that only repeats the answer just played.
+ */
+static int repeat_poll(const struct rec *r) {
+    return st.last && (r->mosi == 0xff) && (st.last->mosi == 0xff) &&
+           (r->cs == st.last->cs) && (r->miso == st.last->miso);
+}
+
+
+static uint8_t play(const struct rec *r) {
+    clock_ns += r->dt * 1000ULL;
+    st.last = r;
+    st.pos++;
+    return r->miso;
+}
+
+
+uint8_t replay_xchg(uint8_t mosi, uint8_t cs) {
+    const struct flow *f;
+    const struct rec *r;
+
+    spun = 0;
+    if ((cur < 0) || ((size_t)cur >= nflows)) {
+        clock_ns += byte_ns();
+        return 0xff;                /* no flow running: no card */
+    }
+    f = &flows[cur];
+    st.bytes++;
+    skip_pauses(f);
+    r = (st.pos < f->n) ? &f->recs[st.pos] : NULL;
+    if (r && (r->mosi == mosi) && (r->cs == cs)) {
+        return play(r);
+    }
+    while ((st.pos < f->n) && repeat_poll(&f->recs[st.pos])) {
+        st.pos++;                   /* the driver stopped polling sooner */
+        st.dropped++;
+        skip_pauses(f);
+    }
+    r = (st.pos < f->n) ? &f->recs[st.pos] : NULL;
+    if (r && (r->mosi == mosi) && (r->cs == cs)) {
+        return play(r);
+    }
+    if ((mosi == 0xff) && st.last && (st.last->mosi == 0xff) && (st.last->cs == cs)) {
+        st.added++;                 /* the driver polls longer */
+        clock_ns += byte_ns();
+        return st.last->miso;
+    }
+    if (r == NULL) {
+        st.past_end++;
+        clock_ns += byte_ns();
+        return 0xff;
+    }
+    if (st.diverged++ == 0) {
+        st.first_div = st.bytes - 1;
+        st.div_mosi = mosi;
+        st.div_cs = cs;
+        st.div_rec = r;
+    }
+    return play(r);
+}
+
+
+static void flow_start(void) {
+    const char *cmd = flows[cur].cmd;
+
+    memset(&st, 0, sizeof(st));
+    st.t_start = clock_ns;
+    inlen = snprintf(input, sizeof(input) - 1, "%s", cmd);
+    if ((inlen != 1) || (strchr(SINGLE_KEYS, cmd[0]) == NULL)) {
+        input[inlen++] = '\r';
+    }
+    inpos = 0;
+    memset(tail, 0, sizeof(tail));
+    if (verbose) {
+        printf("--- %s", cmd);
+    }
+}
+
+
+static void flow_end(void) {
+    const struct flow *f = &flows[cur];
+    size_t left = 0;
+    size_t i;
+    uint64_t ns;
+
+    for (i = st.pos; i < f->n; i++) {
+        left += !f->recs[i].pause;
+    }
+    ns = clock_ns - st.t_start;
+    total_bytes += st.bytes;
+    total_ns += ns;
+    if (verbose) {
+        printf("\n");
+    }
+    printf("%-20s %8llu bytes %10.3f ms   recorded %8llu bytes %10.3f ms  %s\n", f->cmd,
+           (unsigned long long)st.bytes, ns / 1e6, (unsigned long long)f->bytes, f->rec_us / 1e3,
+           (st.diverged || st.past_end || left) ? "FAILED" : "ok");
+    if (st.diverged) {
+        printf("  diverged at bus byte %zu: sent %02X cs %u, recorded %02X cs %u; %llu bytes differ\n",
+               st.first_div, st.div_mosi, st.div_cs, st.div_rec->mosi, st.div_rec->cs,
+               (unsigned long long)st.diverged);
+    }
+    if (st.added || st.dropped) {
+        printf("  polls: %llu more, %llu fewer than recorded\n",
+               (unsigned long long)st.added, (unsigned long long)st.dropped);
+    }
+    if (left) {
+        printf("  stopped %zu recorded bytes early\n", left);
+    }
+    if (st.past_end) {
+        printf("  ran %llu bytes past the recording\n", (unsigned long long)st.past_end);
+    }
+    if (st.diverged || st.past_end || left) {
+        failed = 1;
+    }
+}
+
+
+/*
+ *  The firmware waits for the console here.  Once it has prompted after
+ *  the last command, the next flow's command is typed.
+ */
+void avrsim_sleep(void) {
+    if ((inpos < inlen) || (strcmp(tail, "\n> ") != 0)) {
+        clock_ns += 1000000;        /* a timed wait: the tick wakes it */
+        return;
+    }
+    if (cur >= 0) {
+        flow_end();
+    }
+    if ((size_t)++cur == nflows) {
+        printf("%zu flow(s), %llu bus bytes, %.3f ms simulated%s\n", nflows,
+               (unsigned long long)total_bytes, total_ns / 1e6, failed ? ", FAILED" : "");
+        exit(failed);
+    }
+    flow_start();
+}
+
+
+/*
+ *  The console.
+ */
+int avrsim_putchar(int c) {
+    memmove(tail, tail + 1, 2);
+    tail[2] = c;
+    if (verbose && (cur >= 0)) {
+        putchar(c);
+    }
+    return c;
+}
+
+
+int avrsim_getchar(void) {
+    return (inpos < inlen) ? input[inpos++] : -1;
+}
+
+
+int avrsim_printf(const char *fmt, ...) {
+    char spec[16];
+    char buf[256];
+    const char *p;
+    size_t n;
+    int len = 0;
+    va_list ap;
+
+    va_start(ap, fmt);
+    for (p = fmt; *p; p++) {
+        if (*p != '%') {
+            avrsim_putchar(*p);
+            len++;
+            continue;
+        }
+        n = 0;                      /* copy the conversion, without l, as an int one */
+        spec[n++] = *p++;
+        while (*p && strchr("-+ #0123456789.", *p) && (n < sizeof(spec) - 3)) {
+            spec[n++] = *p++;
+        }
+        while (*p == 'l') {
+            p++;                    /* AVR long is the host's int */
+        }
+        if (*p == 0) {
+            break;
+        }
+        spec[n++] = (*p == 'S') ? 's' : *p;
+        spec[n] = 0;
+        if ((*p == 's') || (*p == 'S')) {
+            snprintf(buf, sizeof(buf), spec, va_arg(ap, const char *));
+        } else if (*p == '%') {
+            snprintf(buf, sizeof(buf), "%%");
+        } else {
+            snprintf(buf, sizeof(buf), spec, va_arg(ap, int));
+        }
+        for (n = 0; buf[n]; n++) {
+            avrsim_putchar(buf[n]);
+        }
+        len += n;
+    }
+    va_end(ap);
+    return len;
+}
+
+
+void uart_init(void) {
+}
+
+
+void uart_putchar(char c, FILE *stream) {
+    avrsim_putchar(c);
+}
+
+
+void uart_putbyte(uint8_t c) {
+    avrsim_putchar(c);
+}
+
+
+char uart_getchar(FILE *stream) {
+    return avrsim_getchar();
+}
+
+
+uint8_t uart_pending_data() {
+    return inpos < inlen;
+}
+
+
+/*
+ *  Uploads are not replayed; a "w" flow finds no data.
+ */
+void uart_sink_start(uint8_t *buf, uint16_t size, uint32_t total) {
+}
+
+
+uint16_t uart_sink_avail(void) {
+    return 0;
+}
+
+
+void uart_sink_take(uint16_t n) {
+}
+
+
+uint16_t uart_sink_end(void) {
+    return 0;
+}
+
+
+/*
+ *  The clock.
+ */
+void timer_init(void) {
+}
+
+
+uint32_t timer_us(void) {
+    if (spun++) {
+        clock_ns += 1000;
+    }
+    return clock_ns / 1000;
+}
+
+
+uint32_t timer_ms(void) {
+    return timer_us() / 1000;
+}
+
+
+void timer_rewind(uint32_t ms) {
+}
+
+
+void timer_stop(void) {
+}
+
+
+void timer_start(void) {
+}
+
+
+uint16_t mem_data_size(void) { return 0; }
+uint16_t mem_bss_size(void) { return 0; }
+uint16_t mem_stack_peak(void) { return 0; }
+uint16_t mem_never_used(void) { return 0; }
+uint16_t mem_free_now(void) { return 0; }
+
+
+static void usage(void) {
+    fprintf(stderr, "usage: sdreplay [-v] transcript...\n");
+    exit(2);
+}
+
+
+int main(int argc, char **argv) {
+    int c;
+
+    while ((c = getopt(argc, argv, "v")) != -1) {
+        switch (c) {
+        case 'v':   verbose = 1; break;
+        default:    usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+    for (; optind < argc; optind++) {
+        if (load(argv[optind]) < 0) {
+            return 2;
+        }
+    }
+    if (nflows == 0) {
+        fprintf(stderr, "no complete flows\n");
+        return 2;
+    }
+    PINB = 0xff;                    /* switches up, pull-ups on */
+    PINC = 0xff;
+    PIND = 0xff;
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    firmware_main();
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+
+static uint16_t lz_head[LZ_HASH_SIZE];  /* last position + 1 per hash, 0 if none */
+
+
+static uint8_t lz_hash(const uint8_t *p) {
+    return (p[0] ^ (p[1] << 2) ^ (p[2] << 4) ^ (p[2] >> 3)) & (LZ_HASH_SIZE - 1);
+}
+
+
+static uint16_t lz_literals(const uint8_t *p, uint16_t n, void (*out)(uint8_t c)) {
+    uint16_t size;
+    uint8_t run;
+    uint8_t k;
+
+    size = 0;
+    while (n) {
+        run = n > LZ_MAX_LITERAL ? LZ_MAX_LITERAL : n;
+        if (out) {
+            out(run - 1);
+            for (k = 0; k < run; k++) {
+                out(p[k]);
+            }
+        }
+        size += run + 1;
+        p += run;
+        n -= run;
+    }
+    return size;
+}
+
+
+/*
+ *  Greedy: take the most recent position with the same 3-byte hash and
+ *  use it if at least LZ_MIN_MATCH bytes agree.  Every position, inside
+ *  matches too, goes into the table.
+ */
+uint16_t lz_pack(const uint8_t *src, uint16_t len, void (*out)(uint8_t c)) {
+    uint16_t i;
+    uint16_t lit;
+    uint16_t size;
+    uint16_t cand;
+    uint16_t mlen;
+    uint16_t max;
+    uint16_t off;
+    uint16_t end;
+    uint8_t h;
+
+    memset(lz_head, 0, sizeof(lz_head));
+    i = 0;
+    lit = 0;
+    size = 0;
+    while (i + LZ_MIN_MATCH <= len) {
+        h = lz_hash(src + i);
+        cand = lz_head[h];
+        lz_head[h] = i + 1;
+        mlen = 0;
+        if (cand && (i - (cand - 1) <= LZ_MAX_OFFSET)) {
+            cand--;
+            max = len - i < LZ_MAX_MATCH ? len - i : LZ_MAX_MATCH;
+            while ((mlen < max) && (src[cand + mlen] == src[i + mlen])) {
+                mlen++;
+            }
+        }
+        if (mlen < LZ_MIN_MATCH) {
+            i++;
+            continue;
+        }
+
+        size += lz_literals(src + lit, i - lit, out);
+        off = i - cand - 1;
+        if (out) {
+            out(0x80 | ((mlen - LZ_MIN_MATCH) << 1) | (off >> 8));
+            out(off);
+        }
+        size += 2;
+        for (end = i + mlen, i++; i < end; i++) {
+            if (i + LZ_MIN_MATCH <= len) {
+                lz_head[lz_hash(src + i)] = i + 1;
+            }
+        }
+        lit = i;
+    }
+    size += lz_literals(src + lit, len - lit, out);
+    return size;
+}
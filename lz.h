@@ -0,0 +1,30 @@
+#ifndef _SDLOCKER_LZ_
+#define _SDLOCKER_LZ_
+
+
+/*
+ *  Small LZ77 packer for single blocks.  The dictionary is the block
+ *  itself, so matches reach back at most 512 bytes and no history is kept
+ *  between blocks; the only extra SRAM is the match hash table.
+ *
+ *  The packed stream is a sequence of tokens:
+ *
+ *    0nnnnnnn                  literal run, n+1 bytes follow (1..128)
+ *    1lllllloo oooooooo        match, copy l+3 bytes (3..66) from o+1
+ *                              bytes back; may overlap, so o=0 is a run
+ */
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (LZ_MIN_MATCH + 63)
+#define LZ_MAX_LITERAL  128
+#define LZ_MAX_OFFSET   512
+#define LZ_HASH_SIZE    64          /* entries in the match table, power of 2 */
+
+
+/*
+ *  Pack len bytes of src, handing each output byte to out, and return the
+ *  packed size.  A NULL out only sizes the result, so a caller can decide
+ *  between packed and raw before sending anything.
+ */
+extern uint16_t lz_pack(const uint8_t *src, uint16_t len, void (*out)(uint8_t c));
+
+#endif /* _SDLOCKER_LZ_ */
@@ -0,0 +1,72 @@
+#include <avr/io.h>
+#include "mem.h"
+
+
+extern uint8_t __data_start;        /* from the linker script */
+extern uint8_t __data_end;
+extern uint8_t __bss_start;
+extern uint8_t __bss_end;
+extern uint8_t _end;
+extern uint8_t __stack;
+
+
+/*
+ *  Runs from .init1, before the C runtime has set up r1 or copied .data,
+ *  so it is plain assembler and touches only Z and r24/r25.
+ */
+void mem_paint(void) __attribute__((naked, used, section(".init1")));
+
+void mem_paint(void) {
+    __asm volatile (
+        "    ldi r30, lo8(_end)\n"
+        "    ldi r31, hi8(_end)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(__stack)\n"
+        "    rjmp 2f\n"
+        "1:  st Z+, r24\n"
+        "2:  cpi r30, lo8(__stack)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        "    breq 1b\n"
+        :: "i" (MEM_PAINT));
+}
+
+
+uint16_t mem_data_size(void) {
+    return &__data_end - &__data_start;
+}
+
+
+uint16_t mem_bss_size(void) {
+    return &__bss_end - &__bss_start;
+}
+
+
+/*
+ *  Painted bytes above the end of .bss that the stack has never written.
+ */
+uint16_t mem_never_used(void) {
+    const uint8_t *p;
+
+    p = &_end;
+    while ((p <= (const uint8_t *)SP) && (*p == MEM_PAINT)) {
+        p++;
+    }
+    return p - &_end;
+}
+
+
+/*
+ *  Deepest the stack has been, in bytes below the top of RAM.
+ */
+uint16_t mem_stack_peak(void) {
+    return (&__stack + 1) - (&_end + mem_never_used());
+}
+
+
+/*
+ *  Gap between the end of .bss and the stack pointer right now.
+ */
+uint16_t mem_free_now(void) {
+    return (const uint8_t *)SP - &_end;
+}
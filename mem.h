@@ -0,0 +1,20 @@
+#ifndef _SDLOCKER_MEM_
+#define _SDLOCKER_MEM_
+
+
+/*
+ *  SRAM use.  Everything between the end of .bss and the top of RAM is
+ *  painted with MEM_PAINT before main() runs; the stack grows down into
+ *  it, so the painted bytes left show how deep the stack has ever been.
+ *  There is no heap.
+ */
+#define MEM_PAINT       0xc5
+
+
+extern uint16_t mem_data_size(void);
+extern uint16_t mem_bss_size(void);
+extern uint16_t mem_stack_peak(void);
+extern uint16_t mem_never_used(void);
+extern uint16_t mem_free_now(void);
+
+#endif /* _SDLOCKER_MEM_ */
@@ -5,14 +5,25 @@
 #include  <stdio.h>
 #include  <string.h>
 #include  <ctype.h>
+#include  <stdlib.h>
 
-#include  <util/delay.h>
 
 #include  <avr/io.h>
 #include  <avr/pgmspace.h>
 #include  <avr/interrupt.h>
+#include  <avr/eeprom.h>
+#include  <avr/sleep.h>
+#include  <avr/power.h>
+#include  <util/crc16.h>
 
 #include "uart.h"
+#include "timer.h"
+#include "frame.h"
+#include "crc32.h"
+#include "fsdump.h"
+#include "fsformat.h"
+#include "trace.h"
+#include "mem.h"
 
 
 #ifndef  FALSE
@@ -22,11 +33,9 @@
 
 
 /*
- *  Calc the value to write to the UART baud rate register, based on desired
- *  baud rate and MCU operating frequency (F_CPU).
+ *  The console baud rate is BAUD, set in the Makefile for each clock; uart.c
+ *  works out the UART registers from it.
  */
-#define  BAUDRATE				38400L
-#define  BAUDREG				((unsigned int)((F_CPU/(BAUDRATE*8UL))-1))
 
 
 
@@ -38,13 +47,23 @@
 #define  SD_SEND_IF_COND	(0x40 + 8)			/* CMD8 - send interface (conditional), works for SDHC only */
 #define  SD_SEND_CSD		(0x40 + 9)			/* CMD9 - send CSD block (16 bytes) */
 #define  SD_SEND_CID		(0x40 + 10)			/* CMD10 - send CID block (16 bytes) */
+#define  SD_STOP_TRANS		(0x40 + 12)			/* CMD12 - stop multiple-block read */
 #define  SD_SEND_STATUS		(0x40 + 13)			/* CMD13 - send card status */
 #define  SD_SET_BLK_LEN		(0x40 + 16)			/* CMD16 - set length of block in bytes */
 #define  SD_READ_BLK		(0x40 + 17)			/* read single block */
+#define  SD_READ_MULTI		(0x40 + 18)			/* CMD18 - read blocks until CMD12 */
+#define  SD_WRITE_BLK		(0x40 + 24)			/* CMD24 - write single block */
+#define  SD_WRITE_MULTI		(0x40 + 25)			/* CMD25 - write blocks until stop token */
+#define  SD_ERASE_START		(0x40 + 32)			/* CMD32 - first block to erase */
+#define  SD_ERASE_END		(0x40 + 33)			/* CMD33 - last block to erase */
+#define  SD_ERASE			(0x40 + 38)			/* CMD38 - erase the selected blocks */
 #define  SD_LOCK_UNLOCK		(0x40 + 42)			/* CMD42 - lock/unlock card */
 #define  CMD55				(0x40 + 55)			/* multi-byte preface command */
 #define  SD_READ_OCR		(0x40 + 58)			/* read OCR */
+#define  SD_CRC_ON_OFF		(0x40 + 59)			/* CMD59 - turn CRC checking on (1) or off (0) */
 #define  SD_ADV_INIT		(0xc0 + 41)			/* ACMD41, for SDHC cards - advanced start initialization */
+#define  SD_SEND_SD_STATUS	(0xc0 + 13)			/* ACMD13 - send SD status block (64 bytes) */
+#define  SD_SET_WR_ERASE	(0xc0 + 23)			/* ACMD23 - pre-erase count for next CMD25 */
 #define  SD_PROGRAM_CSD		(0x40 + 27)			/* CMD27 - get CSD block (15 bytes data + CRC) */
 
 
@@ -65,6 +84,30 @@
 #define  SDCARD_NO_DETECT			1			/* unable to detect SD card */
 #define  SDCARD_TIMEOUT				2			/* last operation timed out */
 #define  SDCARD_RWFAIL				-1			/* read/write command failed */
+#define  SDCARD_BUSY				3			/* request still running; poll again */
+#define  SDCARD_BLOCK				4			/* a block of a multi-block read is in buf; poll on */
+
+
+/*
+ *  Define the card requests run by SDBegin() and SDPoll().
+ */
+#define  SDREQ_NONE					0			/* no request running */
+#define  SDREQ_INIT					1			/* CMD0, CMD8, ACMD41 or CMD1, CMD58 */
+#define  SDREQ_READ					2			/* CMD17 into buf */
+#define  SDREQ_NOT_BUSY				3			/* wait out busy, arg is the timeout in ms */
+#define  SDREQ_FORCE_ERASE			4			/* CMD42 forced erase, retried if TUNE_CMD42_RETRY */
+#define  SDREQ_READ_MULTI			5			/* CMD18 of blocks blocks from arg, each into buf */
+#define  SDREQ_CMD42				6			/* CMD42 with pwd[], arg is mask | len << 8; then busy */
+#define  SDREQ_WRITE_CSD			7			/* CMD27 with csd[]; then busy */
+#define  SDREQ_CHUNK				64			/* most data bytes moved per poll */
+#define  FORCE_ERASE_WAIT_MS		1000		/* before checking a forced erase */
+#define  SD_READY_MS				1000		/* ACMD41/CMD1 until ready; the spec's limit */
+#define  SD_POLL_MAX_MS				16			/* longest gap between ACMD41/CMD1 polls */
+#define  SD_OCR_MS					250			/* CMD58 once ready, before the CSD is asked */
+#define  SD_READ_MS					100			/* command to data token; the spec's limit */
+#define  SD_NCR_MAX					8			/* bytes polled for R1; the spec's NCR limit */
+#define  SD_MAX_KHZ					25000		/* SPI clock limit of a default-speed card */
+#define  PWD_HOLD_MS				10000		/* PWD held this long forces an erase */
 
 
 /*
@@ -80,8 +123,8 @@
  *  Define card types that could be reported by the SD card during probe
  */
 #define  SDTYPE_UNKNOWN			0				/* card type not determined */
-#define  SDTYPE_SD				1				/* SD v1 (1 MB to 2 GB) */
-#define  SDTYPE_SDHC			2				/* SDHC (4 GB to 32 GB) */
+#define  SDTYPE_SD				1				/* SD v1, v2 standard capacity or MMC: byte addresses */
+#define  SDTYPE_SDHC			2				/* SDHC or SDXC (CCS set): block numbers */
 
 
 
@@ -98,6 +141,22 @@
 #define  SW_PWD_CHECK	8
 #define  SW_LOCK_CHECK	9
 #define  SW_ERASE		10
+#define  SW_UNKNOWN		11
+#define  SW_BENCH		12
+#define  SW_NOP			13
+#define  SW_DUMP		14
+#define  SW_FSDUMP		15
+#define  SW_FORMAT		16
+#define  SW_ERASE_RANGE	17
+#define  SW_WIPE		18
+#define  SW_AUTO		19
+#define  SW_TRACE		20
+#define  SW_MEM			21
+#define  SW_STREAM		22
+#define  SW_DELTA		23
+#define  SW_CLONE		24
+#define  SW_UPLOAD		25
+#define  SW_LINE		26
 
 
 
@@ -126,6 +185,24 @@
 #define  SD_CS_MASK		(1<<SD_CS_BIT)
 
 
+/*
+ *  Define the port, DDR, and bit used as chip-select for the card in
+ *  the second socket, the target of the clone command.  It shares the
+ *  SPI lines with the first socket.
+ */
+#define  SD2_CS_PORT	PORTB
+#define  SD2_CS_DDR		DDRB
+#define  SD2_CS_BIT		1
+#define  SD2_CS_MASK	(1<<SD2_CS_BIT)
+
+
+/*
+ *  Both chip selects as CAPTURE_CS_xxx flags, for the SPI capture.
+ */
+#define  SPI_CS_FLAGS	(((SD_CS_PORT & SD_CS_MASK) ? 0 : CAPTURE_CS_MAIN) | \
+						 ((SD2_CS_PORT & SD2_CS_MASK) ? 0 : CAPTURE_CS_SECOND))
+
+
 /*
  *  Define the port and bit used for the lock LED.
  */
@@ -164,6 +241,9 @@
 #define  SW_UNLOCK_MASK		(1<<SW_UNLOCK_BIT)
 #define  SW_PWD_MASK		(1<<SW_PWD_BIT)
 #define  SW_ALL_MASK		(SW_LOCK_MASK | SW_UNLOCK_MASK | SW_PWD_MASK)
+#define  SW_PCMSK		PCMSK1				/* pin-change mask for PORTC; PCINT8 is PC0 */
+#define  SW_PCIE		PCIE1
+#define  SW_PCINT_vect	PCINT1_vect
 
 
 /*
@@ -179,6 +259,89 @@
 #define  CRC7_POLY		0x89		/* polynomial used for CSD CRCs */
 
 
+/*
+ *  Define the benchmark parameters.
+ */
+#define  BENCH_SAMPLES		16			/* samples per measurement */
+#define  BENCH_SEQ_BLOCKS	32			/* blocks per sequential CMD18 run */
+#define  BUSY_TIMEOUT_MS	500			/* longest a write may hold the card busy */
+#define  FILL_RUN_MAX		4096		/* blocks per FRAME_FILL, a few seconds of reading */
+#define  ERASE_AU_MS		2000		/* erase timeout per AU if the SD status has none */
+#define  WIPE_CHUNK			2048		/* blocks written, then read back, per pass */
+#define  WIPE_MAX_LISTED	16			/* mismatching blocks printed */
+#define  WIPE_ZEROS			0			/* wipe patterns */
+#define  WIPE_ONES			1
+#define  WIPE_RANDOM		2
+
+
+/*
+ *  Define the card-to-card copy (clone command).  The source is the card
+ *  in the main socket, the target the one in the second socket.
+ */
+#define  SLOT_MAIN			0
+#define  SLOT_SECOND		1
+#define  CLONE_CHUNK		2048		/* blocks copied, then verified, per pass */
+
+
+/*
+ *  Define the upload (w command).  The data is received into block[] in
+ *  two halves; the host is flow controlled (see uart.h).
+ */
+#define  UPLOAD_HALF		256
+#define  UPLOAD_IDLE_MS		3000		/* no data this long ends the upload */
+#define  UPLOAD_MAX			0x7fffffUL	/* most blocks per command; bytes fit 32 bits */
+
+
+/*
+ *  Define the windowed dump (s command).  Up to a window of frames go out
+ *  ahead of the host's acknowledgements; a frame the host asks for again
+ *  is read back from the card, as there is no SRAM to keep it in.
+ */
+#define  STREAM_WINDOW		8			/* frames in flight, unless the host asks */
+#define  STREAM_WINDOW_MAX	16			/* ring size; must be a power of two */
+#define  STREAM_RETRY_MS	1000		/* no ack this long sends the oldest frame again */
+#define  STREAM_GIVEUP_MS	10000		/* no ack this long ends the dump */
+
+
+/*
+ *  Define the unattended (auto) mode actions and timing.  The action is
+ *  kept in EEPROM; an erased EEPROM (0xff) reads as AUTO_OFF.
+ */
+#define  AUTO_OFF			0
+#define  AUTO_PWD_LOCK		1			/* same as P */
+#define  AUTO_PWD_UNLOCK	2			/* same as p */
+#define  AUTO_ERASE			3			/* same as E */
+#define  AUTO_TEMP_LOCK		4			/* same as l */
+#define  AUTO_TEMP_UNLOCK	5			/* same as u */
+#define  AUTO_FORMAT		6			/* same as format */
+#define  AUTO_LAST			AUTO_FORMAT
+
+#define  AUTO_POLL_MS		250			/* card presence probe interval */
+#define  AUTO_WAIT_CARD		0			/* auto mode states */
+#define  AUTO_WAIT_REMOVE	1
+
+
+/*
+ *  Define the per-card tuning.  A card starts from the quirks[] entry for
+ *  its maker (CID manufacturer and OEM IDs) and is probed for the fastest
+ *  SPI clock it works at; what was found is kept in EEPROM for the last
+ *  TUNE_CACHE_LEN cards seen, keyed on a CRC-32 of the CID.
+ */
+#define  TUNE_CMD42_RETRY	0x01		/* a CMD42 that did not take is sent once more */
+#define  TUNE_OCR_FLAKY		0x02		/* CMD58 may fail once the card is ready */
+#define  TUNE_CACHE_LEN		4			/* cards remembered in EEPROM */
+#define  TUNE_TABLE			0			/* tunesrc: quirks[] and a probe just now */
+#define  TUNE_LEARNED		1			/* tunesrc: the EEPROM cache */
+
+
+/*
+ *  Define sizes for the console command line.
+ */
+#define  CMDLINE_LEN		32			/* longest command line accepted, with terminator */
+#define  CMD_MAX_ARGS		3			/* most numeric arguments to a command */
+#define  CONSOLE_ABORT		0x03		/* Ctrl-C: stop the running r or erase */
+
+
 /*
  *  Define bit masks for fields in the lock/unlock command (CMD42) data structure
  */
@@ -189,25 +352,193 @@
 
 
 
+/*
+ *  A card request.  SDBegin() fills it in, each SDPoll() does one step of
+ *  bounded SPI work (a command, a token wait, or SDREQ_CHUNK data bytes).
+ */
+struct sdreq
+{
+	uint8_t						op;					// SDREQ_xxx; SDREQ_NONE when done
+	uint8_t						step;				// position within the request
+	uint16_t					count;				// tries left, or bytes moved
+	uint32_t					arg;				// block number or timeout
+	uint32_t					blocks;				// blocks left to read, SDREQ_READ_MULTI
+	uint8_t						*buf;
+	uint32_t					start;				// timer_us() when the step began
+	uint32_t					start_ms;			// timer_ms() when the step began
+};
+
+
+
+/*
+ *  The console command that cardreq carries on from the main loop (see
+ *  CardReqPoll()).  One runs at a time, so r and erase share their state.
+ */
+struct dumpjob
+{
+	uint8_t						prev[16];			// last line printed
+	uint8_t						have_prev;
+	uint8_t						folding;			// inside a run of equal lines
+};
+
+struct erasejob
+{
+	uint32_t					start;				// next block to erase
+	uint32_t					end;				// first block past the erase sectors
+	uint32_t					last;				// end of the run being erased
+	uint32_t					chunk;				// blocks per run
+	uint32_t					t0;
+	uint32_t					tdot;				// timer_ms() of the last progress dot
+	uint32_t					maxbusy;			// us
+	uint16_t					timeout;			// ms per run
+};
+
+struct actjob
+{
+	uint8_t						what;				// SW_PWD_LOCK, SW_PWD_UNLOCK, SW_LOCK, SW_UNLOCK or SW_ERASE
+	uint8_t						step;				// requests started so far
+};
+
+struct job
+{
+	uint8_t						sw;					// SW_xxx being run
+	uint8_t						argc;				// its cmdargc, kept while the card starts
+	uint8_t						abort;				// Ctrl-C typed meanwhile
+	uint8_t						next;				// SW_xxx typed meanwhile, run after it
+	union
+	{
+		struct dumpjob			dump;
+		struct erasejob			erase;
+		struct actjob			act;
+	}  u;
+};
+
+
+
+/*
+ *  How to run one card: the fastest SPI clock it is used at and how long
+ *  to wait for it.  spikhz is a limit; the AVR divides F_CPU by a power of
+ *  two at or under it.
+ */
+struct cardtune
+{
+	uint16_t					spikhz;				// SPI clock limit, kHz
+	uint16_t					busy_ms;			// longest a write may hold the card busy
+	uint8_t						token_ms;			// command to data token
+	uint8_t						flags;				// TUNE_xxx
+};
+
+struct cardquirk
+{
+	uint8_t						mid;				// CID manufacturer ID
+	char						oid[2];				// CID OEM/application ID
+	struct cardtune				tune;
+};
+
+struct tunecache
+{
+	uint32_t					key;				// crc32_update() of the CID
+	struct cardtune				tune;
+};
+
+
+
+/*
+ *  A frame of a windowed dump the host has not acknowledged yet; enough
+ *  to send it again.
+ */
+struct streamframe
+{
+	uint32_t					block;				// first block in the frame
+	uint16_t					count;				// blocks in a fill run; 0 for a data block
+	uint8_t						fill;
+};
+
+struct stream
+{
+	struct streamframe			ring[STREAM_WINDOW_MAX];
+	uint8_t						head;				// oldest unacknowledged frame
+	uint8_t						used;				// frames in flight
+	uint32_t					acked;				// host has every block before this
+	uint32_t					tack;				// timer_ms() when acked last moved
+	uint32_t					tretry;				// timer_ms() of the last (re)send
+};
+
+
+
 /*
  *  Local variables
  */
 uint32_t						LEDPattern;
 uint8_t							sdtype;				// flag for SD card type
+uint8_t							sdslot;				// socket select() drives, SLOT_xxx
+uint8_t							slottype[2];		// sdtype of the card in each socket
+struct cardtune					tune;				// settings for the card in use
+struct cardtune					slottune[2];		// tune of the card in each socket
+uint8_t							tunesrc;			// TUNE_TABLE or TUNE_LEARNED
+uint8_t							spifast;			// SPISetFast(TRUE) is in force
 uint8_t							csd[16];
 uint8_t							cid[16];
 uint8_t							ocr[4];
+uint16_t						sdreadyms;			// first ACMD41 to ready, last card initialized
+uint8_t							sdreadypolls;		// ACMD41s (or CMD1s) it took
 uint8_t							crctable[256];
 uint8_t							block[512];
 uint8_t							cardstatus[2];		// updated by ReadLockStatus
+uint32_t						busytime;			// us spent in last WaitNotBusy()
+uint8_t							sdtxn;				// open SDTxnBegin()s; CS stays low while nonzero
+uint32_t						spisaved;			// SPI bytes not sent thanks to transactions
+uint8_t							blockuniform;		// set by ReadMultiNext() if every byte
+													// of the block equals block[0]
+uint32_t						randstate = 1;		// xorshift state for Random32()
 uint8_t							pwd[16];
 uint8_t							pwd_len;
 
+char							cmdline[CMDLINE_LEN];	// console line being assembled
+uint8_t							cmdlen;
+uint32_t						cmdargs[CMD_MAX_ARGS];	// numeric arguments of last command
+uint8_t							cmdargc;
+uint8_t							consolecmd;				// last command came from the console
+
+uint8_t							autoaction;			// AUTO_xxx profile, copy of autoprofile
+uint8_t							autostate;			// AUTO_WAIT_CARD or AUTO_WAIT_REMOVE
+uint8_t							autoseen;			// consecutive probes that saw the change
+uint8_t							autofailed;			// last card failed; blink the lock LED
+uint32_t						autopoll;			// timer_ms() of the last probe
+uint16_t						autopass;			// cards done since auto mode was set
+uint16_t						autofail;
+uint8_t							autoprofile EEMEM;
+struct tunecache				tunecache[TUNE_CACHE_LEN] EEMEM;	// most recently seen first
+struct sdreq					cardreq;			// request run from the main loop
+struct job						cardjob;			// the command it belongs to
+
 const char						GlobalPWDStr[16] PROGMEM =
 								{'F', 'o', 'u', 'r', 't', 'h', ' ', 'A',
 								 'm', 'e', 'n', 'd', 'm', 'e', 'n', 't'};
 #define  GLOBAL_PWD_LEN			(sizeof(GlobalPWDStr))
 
+/*
+ *  Known card quirks.  Samsung cards have failed CMD58 after initialization
+ *  and sometimes need CMD42 twice.  A failed CMD58 during init is already
+ *  covered for every card, as the CID is only read afterwards; the quirk
+ *  lets the ? listing go on to the CSD and CID past a failed OCR.  The last entry is for every other card;
+ *  it keeps the CMD42 retry that all cards used to get.
+ */
+static const struct cardquirk	quirks[] PROGMEM =
+{
+	{0x1b, {'S', 'M'}, {SD_MAX_KHZ, BUSY_TIMEOUT_MS, SD_READ_MS, TUNE_CMD42_RETRY | TUNE_OCR_FLAKY}},
+	{0x00, {0, 0}, {SD_MAX_KHZ, BUSY_TIMEOUT_MS, SD_READ_MS, TUNE_CMD42_RETRY}}
+};
+#define  QUIRK_DEFAULT			(sizeof(quirks) / sizeof(quirks[0]) - 1)
+
+static const uint16_t			au_kb[16] PROGMEM =		// SD status AU_SIZE, in KB
+								{0, 16, 32, 64, 128, 256, 512, 1024,
+								 2048, 4096, 8192, 12288, 16384, 24576, 32768, 65535};
+
+static const char				autonames[AUTO_LAST+1][12] PROGMEM =
+								{"off", "pwd lock", "pwd unlock", "force erase",
+								 "temp lock", "temp unlock", "format"};
+
 
 
 
@@ -216,24 +547,107 @@ const char						GlobalPWDStr[16] PROGMEM =
  */
 static void						select(void);
 static void						deselect(void);
+static uint8_t					SDSelected(void);
+static void						SDSlot(uint8_t  slot);
 static uint8_t					xchg(uint8_t  c);
 static int8_t					SDInit(void);
+static void						SDTxnBegin(void);
+static void						SDTxnEnd(void);
+static void						SDBegin(struct sdreq  *q, uint8_t  op, uint32_t  arg, uint8_t  *buf);
+static int8_t					SDPoll(struct sdreq  *q);
+static int8_t					SDRun(struct sdreq  *q);
+static int8_t					SDPollInit(struct sdreq  *q);
+static int8_t					SDInitRetry(struct sdreq  *q, uint32_t  elapsed, uint16_t  limit);
+static int8_t					SDPollRead(struct sdreq  *q);
+static int8_t					SDPollNotBusy(struct sdreq  *q);
+static int8_t					SDPollForceErase(struct sdreq  *q);
+static void						CardReqPoll(void);
+static void						CardInitDone(int8_t  r);
+static void						ForceEraseDone(int8_t  r);
+static int8_t					SDPollReadMulti(struct sdreq  *q);
+static int8_t					SDPollCmd42(struct sdreq  *q);
+static int8_t					SDPollWriteCSD(struct sdreq  *q);
+static int8_t					SDPollWritten(struct sdreq  *q);
+static int8_t					SDPollBusy(struct sdreq  *q, uint16_t  timeout_ms);
+static void						ActStart(uint8_t  what);
+static void						ActNext(int8_t  r);
+static void						ActDone(int8_t  r);
+static void						ShowMem(void);
 static void						BlinkLED(uint32_t  pattern);
+static void						DelayMs(uint16_t  ms);
 static uint8_t					ReadSwitch(void);
+static void						IdleWait(uint16_t  ms);
+static uint8_t					ReadConsole(char  c);
+static uint8_t					ParseCommand(void);
 static void  					ProcessSwitch(void);
+static void						RunCommand(uint8_t  sw);
 static int8_t					ExamineSD(void);
 static int8_t  					ReadOCR(void);
 static int8_t  					ReadCID(void);
 static int8_t  					ReadCSD(void);
-static int8_t					WriteCSD(void);
 static int8_t					ReadBlock(uint32_t  blocknum, uint8_t  *buffer);
-static void						ShowBlock(void);
+static void						DumpStart(uint32_t  first, uint32_t  count);
+static void						DumpNext(int8_t  r);
+static void						ShowDumpLine(uint32_t  blocknum, uint16_t  offset);
+static int8_t					ReadMultiStart(uint32_t  blocknum);
+static int8_t					ReadMultiNext(uint8_t  *buffer);
+static int8_t					ReadMultiStop(void);
+static uint32_t					BlockAddr(uint32_t  blocknum);
+static uint32_t					CardBlocks(void);
+static int8_t					ReadSDStatus(void);
+static int8_t					WaitNotBusy(uint16_t  timeout_ms);
+static void						SPISetFast(uint8_t  fast);
+static uint8_t					SPIShift(uint16_t  khz);
+static void						CardTune(void);
+static void						TuneQuirk(void);
+static uint8_t					TuneCacheFind(uint32_t  key);
+static void						TuneCacheAdd(uint32_t  key, uint8_t  slot);
+static uint32_t					Random32(void);
+static void						Bench(void);
+static void						SparseDump(uint32_t  first, uint32_t  count);
+static uint32_t					DumpRange(uint32_t  first, uint32_t  count);
+static void						SendFillRun(uint32_t  start, uint32_t  len, uint8_t  fill);
+static void						Stream(uint32_t  first, uint32_t  count, uint8_t  window);
+static void						StreamPush(struct stream  *s, uint32_t  blocknum, uint16_t  count, uint8_t  fill);
+static void						StreamAck(struct stream  *s, uint32_t  acked);
+static int8_t					StreamResend(struct stream  *s, uint32_t  blocknum);
+static void						DeltaDump(uint32_t  first, uint32_t  count, uint32_t  crc);
+static void						FsDump(void);
+static int8_t					Format(void);
+static void						EraseRange(uint32_t  first, uint32_t  last);
+static void						EraseRun(void);
+static void						EraseNext(int8_t  r);
+static int8_t					EraseStart(uint32_t  first, uint32_t  last);
+static int8_t					ZeroBlocks(uint32_t  first, uint32_t  count);
+static void						Wipe(uint32_t  first, uint32_t  last, uint8_t  mode);
+static void						PatternStart(uint32_t  blocknum, uint32_t  seed);
+static uint32_t					PatternWord(uint8_t  mode);
+static uint32_t					AUBlocks(void);
+static void						SetAuto(uint8_t  action);
+static void						AutoPoll(void);
+static uint8_t					AutoProbe(uint8_t  command);
+static void						AutoStart(int8_t  r);
+static void						AutoDone(int8_t  r);
+static int8_t					WriteMultiStart(uint32_t  blocknum, uint32_t  count);
+static int8_t					WriteMultiNext(const uint8_t  *buffer);
+static int8_t					WriteBlock(uint32_t  blocknum, const uint8_t  *buffer);
+static int8_t					WriteMultiSend(const uint8_t  *buffer);
+static int8_t					WriteMultiEnd(uint16_t  crc);
+static int8_t					ReadMultiCompare(const uint8_t  *buffer, uint8_t  *same);
+static void						Clone(uint32_t  first, uint32_t  count, uint8_t  verify);
+static uint32_t					CloneCopy(uint32_t  first, uint32_t  count);
+static uint32_t					CloneVerify(uint32_t  first, uint32_t  count, uint32_t  bad);
+static int8_t					ReadBlockCompare(uint32_t  blocknum, const uint8_t  *buffer, uint8_t  *same);
+static void						Upload(uint32_t  first, uint32_t  count);
+static int8_t					UploadWait(void);
+static int8_t					WriteMultiStop(void);
+static void						ShowStats(PGM_P  label, uint32_t  *samples, PGM_P  unit);
 static void						ShowErrorCode(int8_t  status);
 static int8_t  					ReadCardStatus(void);
 static void						ShowCardStatus(void);
 static void						ShowLockState(void);
 static void						LoadGlobalPWD(void);
-static int8_t					ModifyPWD(uint8_t  mask);
+static int8_t					ModifyPWD(uint8_t  mask, uint8_t  len);
 static int8_t					ForceErase(void);
 
 static  int8_t  				sd_send_command(uint8_t  command, uint32_t  arg);
@@ -251,6 +665,8 @@ int  main(void)
  */
 	SD_CS_DDR = SD_CS_DDR | SD_CS_MASK;		// make CS line an output
 	deselect();								// always start with SD card deselected
+	SD2_CS_PORT = SD2_CS_PORT | SD2_CS_MASK;	// same for the second socket
+	SD2_CS_DDR = SD2_CS_DDR | SD2_CS_MASK;
 
 
 	SPI_PORT = SPI_PORT | ((1<<MOSI_BIT) | (1<<SCK_BIT));	// drive outputs to the SPI port
@@ -258,6 +674,9 @@ int  main(void)
 	SPI_PORT = SPI_PORT | (1<<MISO_BIT);						// turn on pull-up for DI
 
 	SPCR = (1<<SPE) | (1<<MSTR) | (1<<SPR1) | (1<<SPR0);
+	memcpy_P(&tune, &quirks[QUIRK_DEFAULT].tune, sizeof(tune));
+	slottune[SLOT_MAIN] = tune;
+	slottune[SLOT_SECOND] = tune;
 
 /*
  *  Set up the hardware line and port for accessing the LEDs.
@@ -272,6 +691,18 @@ int  main(void)
  */
  	SW_DDR = SW_DDR & ~(SW_PWD_MASK | SW_LOCK_MASK | SW_UNLOCK_MASK);
 	SW_PORT = SW_PORT | (SW_PWD_MASK | SW_LOCK_MASK | SW_UNLOCK_MASK);	// turn on pullups for switch lines
+	SW_PCMSK = SW_ALL_MASK;					// a switch press wakes the CPU from sleep
+	PCICR = PCICR | (1<<SW_PCIE);
+
+/*
+ *  Turn off what the board never uses; the idle loop sleeps with only the
+ *  UART, Timer1 and the pin-change logic running.
+ */
+	ACSR = ACSR | (1<<ACD);					// analog comparator
+	power_adc_disable();
+	power_twi_disable();
+	power_timer0_disable();
+	power_timer2_disable();
 
 /*
  *  Set up the UART, then connect to standard I/O streams.
@@ -290,13 +721,45 @@ int  main(void)
 	printf_P(PSTR("p - Password Unlock\r\n"));
 	printf_P(PSTR("P - Password Lock\r\n"));
 	printf_P(PSTR("E - Erase\r\n"));
-	printf_P(PSTR("r - Read\r\n"));
+	printf_P(PSTR("r [block] [count] - Read\r\n"));
+	printf_P(PSTR("bench - Card benchmark\r\n"));
+	printf_P(PSTR("d <block> <count> - Binary sparse dump\r\n"));
+	printf_P(PSTR("fs - Binary dump of used file system blocks\r\n"));
+	printf_P(PSTR("format - Partition and quick format (FAT32/exFAT)\r\n"));
+	printf_P(PSTR("erase <first> <last> - Erase a block range\r\n"));
+	printf_P(PSTR("wipe <first> <last> [pattern] - Overwrite and verify\r\n"));
+	printf_P(PSTR("clone [verify] [first] [count] - Copy to the card in socket 2\r\n"));
+	printf_P(PSTR("w <block> <count> - Write binary data sent after the command\r\n"));
+	printf_P(PSTR("auto [0-6] - Unattended mode: off, P, p, E, l, u, format\r\n"));
+#if SPI_TRACE
+	printf_P(PSTR("trace [0=text|1=binary|2=clear|3=capture next] - SPI trace\r\n"));
+#endif
+	printf_P(PSTR("mem - SRAM use and stack high-water mark\r\n"));
+	printf_P(PSTR("Ctrl-C - Stop a running r or erase\r\n"));
 
 	GenerateCRCTable();
+	timer_init();
 
+	autoaction = eeprom_read_byte(&autoprofile);
+	if (autoaction > AUTO_LAST)  autoaction = AUTO_OFF;
+	if (autoaction != AUTO_OFF)
+	{
+		printf_P(PSTR("Auto mode: %S on every card inserted\r\n"), autonames[autoaction]);
+	}
+	printf_P(PSTR("> "));
+
+	cardjob.next = SW_NONE;
 	while (1)
 	{
-		ProcessSwitch();
+		if (cardreq.op != SDREQ_NONE)		// a card command is running; it reads
+		{									// the console between its steps
+			CardReqPoll();
+		}
+		else
+		{
+			ProcessSwitch();
+		}
+		AutoPoll();
 	}
 	return  0;						// should never happen
 }
@@ -318,7 +781,7 @@ void  BlinkLED(uint32_t  pattern)
 			LOCK_LED_OFF;
 			if (pattern == 0) break;		// leave blink loop if no more ON bits
 		}
-		_delay_ms(50);
+		DelayMs(50);
 		pattern = pattern << 1;
 	}
 }
@@ -326,6 +789,20 @@ void  BlinkLED(uint32_t  pattern)
 
 
 
+/*
+ *  DelayMs      busy-wait on the millisecond tick
+ */
+static void  DelayMs(uint16_t  ms)
+{
+	uint32_t					start;
+
+	start = timer_ms();
+	while ((timer_ms() - start) < ms)  ;
+}
+
+
+
+
 static void GenerateCRCTable()
 {
     int i, j;
@@ -356,364 +833,619 @@ static void  ProcessSwitch(void)
 {
 	uint8_t				sw;
 	static 	uint8_t		prev_sw = 0;
-	uint8_t				r;
 
 
 	sw = ReadSwitch();
-	if ((sw != prev_sw) && (prev_sw == SW_NONE))
+	if (((sw != prev_sw) && (prev_sw == SW_NONE)) || consolecmd)
 	{
+		CAPTURE_BEGIN();					// if trace 3 asked for this command
 /*
  *  Need to access the card.  In all cases, first try to initialize
- *  the card.
+ *  the card.  That runs from the main loop; CardInitDone() then runs
+ *  the command.
  */
-		r = SDInit();
-		if (r != SDCARD_OK)
+		if ((sw != SW_NOP) && (sw != SW_UNKNOWN) && (sw != SW_AUTO) && (sw != SW_TRACE) &&
+			(sw != SW_MEM))
 		{
-			printf_P(PSTR("\n\r\n\rCannot initialize card.  Make sure the card is plugged in properly."));
-			BlinkLED(PATTERN_NO_DETECT);
+			cardjob.sw = sw;
+			cardjob.argc = cmdargc;
+			cardjob.abort = FALSE;
+			SDBegin(&cardreq, SDREQ_INIT, 0, NULL);
 		}
-/*
- *  Now see what we need to do.
- */
-		if (sw == SW_INFO)
+		else
 		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			printf_P(PSTR("\r\nCard type %d"), sdtype);
-			r = ExamineSD();
-			if (r == SDCARD_OK)
-			{
-				printf_P(PSTR("\r\nOCR = "));
-				for (r = 0; r<4; r++)
-				{
-					printf_P(PSTR("%02X "), ocr[r]);
-				}
-				printf_P(PSTR("\r\nCSD = "));
-				for (r=0; r<16; r++)
-				{
-					printf_P(PSTR("%02X "), csd[r]);
-				}
-				printf_P(PSTR("\r\nCID = "));
-				for (r=0; r<16; r++)
-				{
-					printf_P(PSTR("%02X "), cid[r]);
-				}
-				ShowCardStatus();
-			}
-			else
-			{
-				printf_P(PSTR("\r\nUnable to read CSD."));
-			}
+			RunCommand(sw);
+		}
+		if (cardreq.op == SDREQ_NONE)		// else CardReqPoll() ends the reply
+		{
+			CAPTURE_END();
+			printf_P(PSTR("\r\n> "));		// prompt; marks the end of the reply for a host
 		}
+	}
+/*
+ *  Console commands are not edges of a switch state; a host may queue the
+ *  same command several times in a row and each one must run.
+ */
+	if (consolecmd)
+	{
+		consolecmd = FALSE;
+		sw = SW_NONE;
+	}
+	prev_sw = sw;
+}
+
+
+
+/*
+ *  RunCommand      carry out a switch or console command; the card, if it
+ *                  needs one, has been initialized
+ *
+ *  r, erase, the lock commands and the forced erase leave a request in
+ *  cardreq to finish from the main loop.
+ */
+static void  RunCommand(uint8_t  sw)
+{
+	uint8_t				r;
 
-		else if (sw == SW_LOCK)
+	if (sw == SW_INFO)
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		printf_P(PSTR("\r\nCard type %d, ready in %u ms after %u polls"), sdtype, sdreadyms,
+			sdreadypolls);
+		printf_P(PSTR("\r\nSPI %u kHz, token %u ms, busy %u ms, quirks %02X (%S)"),
+			(uint16_t)((F_CPU / 1000UL) >> SPIShift(tune.spikhz)), tune.token_ms,
+			tune.busy_ms, tune.flags, (tunesrc == TUNE_LEARNED) ? PSTR("cached") : PSTR("table"));
+		r = ExamineSD();
+		if (r == SDCARD_OK)
 		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			printf_P(PSTR("\r\nSetting temporary lock on SD card..."));
-			r = ReadCSD();
-			if (r == SDCARD_OK)
+			printf_P(PSTR("\r\nOCR = "));
+			for (r = 0; r<4; r++)
 			{
-				csd[14] = csd[14] | 0x10;	// set bit 12 of CSD (temp lock)
-				r = WriteCSD();
-				if (r == SDCARD_OK)
-				{
-					ReadOCR();
-					r = ReadCSD();
-					if (r == SDCARD_OK)
-					{
-						ShowLockState();
-						printf_P(PSTR("done."));
-					}
-					else
-					{
-						printf_P(PSTR("failed; cannot read CSD to confirm."));
-					}
-				}
-				else
-				{
-					printf_P(PSTR("failed; response was %d."), r);
-					BlinkLED(PATTERN_CANNOT_CHG);
-				}
+				printf_P(PSTR("%02X "), ocr[r]);
 			}
-			else
-			{
-				printf_P(PSTR("failed; unable to read CSD."));
-				BlinkLED(PATTERN_NO_DETECT);
-			}
-		}
-		else if (sw == SW_UNLOCK)
-		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			printf_P(PSTR("\r\nClearing temporary lock on SD card..."));
-			r = ReadCSD();
-			if (r == SDCARD_OK)
+			printf_P(PSTR("\r\nCSD = "));
+			for (r=0; r<16; r++)
 			{
-				csd[14] = csd[14] & ~0x10;	// clear bit 12 of CSD (temp lock)
-				r = WriteCSD();
-				if (r == SDCARD_OK)
-				{
-					ReadOCR();
-					r = ReadCSD();
-					if (r == SDCARD_OK)
-					{
-						ShowLockState();
-						printf_P(PSTR("done."));
-					}
-					else
-					{
-						printf_P(PSTR("failed; cannot read CSD to confirm."));
-					}
-				}
-				else
-				{
-					printf_P(PSTR("failed; response was %d."), r);
-					BlinkLED(PATTERN_CANNOT_CHG);
-				}
+				printf_P(PSTR("%02X "), csd[r]);
 			}
-			else
+			printf_P(PSTR("\r\nCID = "));
+			for (r=0; r<16; r++)
 			{
-				printf_P(PSTR("failed; unable to read CSD."));
-				BlinkLED(PATTERN_NO_DETECT);
+				printf_P(PSTR("%02X "), cid[r]);
 			}
+			ShowCardStatus();
+			printf_P(PSTR("\r\nSPI bytes saved by transactions: %lu"), spisaved);
 		}
-		else if (sw == SW_READBLK)
+		else
 		{
-			printf_P(PSTR("\r\nTest read of block 0 on SD card..."));
-			r = ReadBlock(0, block);
-			if (r == SDCARD_OK)
-			{
-				ShowBlock();
-			}
+			printf_P(PSTR("\r\nUnable to read CSD."));
 		}
-		else if (sw == SW_ERASE)
-		{
-            printf_P(PSTR("\r\nTrying to ERASE SD CARD..."));
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			ReadCardStatus();
-			if (cardstatus[1] & 0x01)		// if card is locked...
-			{
-				r = ForceErase();
-
-                printf_P(PSTR("please wait..."));
-                _delay_ms(1000);
-
-				ReadCardStatus();
-
-				if (cardstatus[1] & 0x01)	// if card is still locked...
-				{
-					r = ForceErase();		// erasing failed, try one more time
-
-                    printf_P(PSTR("please wait..."));
-                    _delay_ms(1000);
+	}
 
-					ReadCardStatus();
-				}
-				if (cardstatus[1] & 0x01)	// if card is still locked...
-				{
-					printf_P(PSTR("failed!  Card is still locked."));
-					LOCK_LED_ON;
-				}
-				else
-				{
-					printf_P(PSTR("done."));
-					UNLOCK_LED_ON;
-				}
-			}
-			else							// silly person, card is already unlocked
-			{
-                printf_P(PSTR("the card is not locked"));
-				UNLOCK_LED_ON;
-			}
+	else if ((sw == SW_LOCK) || (sw == SW_UNLOCK))
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		if (sw == SW_LOCK)  printf_P(PSTR("\r\nSetting temporary lock on SD card..."));
+		else  printf_P(PSTR("\r\nClearing temporary lock on SD card..."));
+		ActStart(sw);						// finished by ActDone()
+	}
+	else if (sw == SW_READBLK)
+	{
+		if (cmdargc < 2)  cmdargs[1] = 1;		// default is a single block
+		if (cmdargc < 1)  cmdargs[0] = 0;		// starting at block 0
+		printf_P(PSTR("\r\nReading %lu block(s) from block %lu..."), cmdargs[1], cmdargs[0]);
+		DumpStart(cmdargs[0], cmdargs[1]);
+	}
+	else if (sw == SW_BENCH)
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		printf_P(PSTR("\r\nBenchmarking card..."));
+		Bench();
+	}
+	else if (sw == SW_DUMP)
+	{
+		if (cmdargc < 2)
+		{
+			printf_P(PSTR("\r\nUsage: d <block> <count>"));
 		}
-		else if (sw == SW_PWD_UNLOCK)
+		else
 		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			ReadCardStatus();
-			if (cardstatus[1] & 0x01)		// if card is locked...
-			{
-				printf_P(PSTR("\r\nTrying to unlock card..."));
-				LoadGlobalPWD();
-				r = ModifyPWD(MASK_CLR_PWD);
-				ReadCardStatus();
-				if (cardstatus[1] & 0x01)	// if card is still locked...
-				{
-					r = ModifyPWD(MASK_CLR_PWD);		// the unlock failed, try one more time
-					ReadCardStatus();
-				}
-				if (cardstatus[1] & 0x01)	// if card is still locked...
-				{
-					printf_P(PSTR("failed!  Card is still locked."));
-					LOCK_LED_ON;
-				}
-				else
-				{
-					printf_P(PSTR("done."));
-					UNLOCK_LED_ON;
-				}
-			}
-			else							// silly person, card is already unlocked
-			{
-				UNLOCK_LED_ON;
-			}
+			printf_P(PSTR("\r\n"));
+			SparseDump(cmdargs[0], cmdargs[1]);
 		}
-		else if (sw == SW_PWD_LOCK)
+	}
+	else if (sw == SW_STREAM)
+	{
+		if (cmdargc < 2)
 		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			ReadCardStatus();
-			if ((cardstatus[1] & 0x01) == 0)	// if card is unlocked...
-			{
-				printf_P(PSTR("\r\nTrying to lock card..."));
-				LoadGlobalPWD();
-				r = ModifyPWD(MASK_SET_PWD);
-				ReadCardStatus();
-
-				r = ModifyPWD(MASK_LOCK_UNLOCK);
-				ReadCardStatus();
-				if ((cardstatus[1] & 0x01) == 0)	// if card is still unlocked...
-				{
-					printf_P(PSTR("failed!  Card is still unlocked."));
-					UNLOCK_LED_ON;
-				}
-				else
-				{
-					printf_P(PSTR("done."));
-					LOCK_LED_ON;
-				}
-			}
-			else							// silly person, card is already locked
-			{
-				LOCK_LED_ON;
-			}
+			printf_P(PSTR("\r\nUsage: s <block> <count> [window]"));
 		}
-		else if (sw == SW_PWD_CHECK)
+		else
 		{
-			LOCK_LED_OFF;
-			UNLOCK_LED_OFF;
-			printf_P(PSTR("\r\nChecking PWD state..."));
-			ReadCardStatus();
-			if ((cardstatus[1] & 0x01) == 0)	// if card is unlocked...
-			{
-				UNLOCK_LED_ON;
-			}
-			else
-			{
-				LOCK_LED_ON;
-			}
+			if ((cmdargc < 3) || (cmdargs[2] > STREAM_WINDOW_MAX))  cmdargs[2] = STREAM_WINDOW;
+			printf_P(PSTR("\r\n"));
+			Stream(cmdargs[0], cmdargs[1], cmdargs[2]);
 		}
-		else if (sw == SW_LOCK_CHECK)
+	}
+	else if (sw == SW_DELTA)
+	{
+		if (cmdargc < 3)
 		{
-			printf_P(PSTR("\r\nChecking temp-lock state..."));
-			ReadOCR();
-			r = ReadCSD();
-			if (r == SDCARD_OK)
-			{
-				ShowLockState();
-			}
-			else
-			{
-				BlinkLED(PATTERN_NO_DETECT);
-			}
+			printf_P(PSTR("\r\nUsage: c <block> <count> <crc32>"));
+		}
+		else
+		{
+			printf_P(PSTR("\r\n"));
+			DeltaDump(cmdargs[0], cmdargs[1], cmdargs[2]);
 		}
 	}
-	prev_sw = sw;
-}
-
-
-
-static uint8_t  ReadSwitch(void)
-{
-	uint8_t						r;
-	static uint8_t				prev_sw = SW_ALL_MASK;
-	static uint16_t             sw_hold_counter = 0;
-	uint8_t						sw;
-
-	_delay_ms(50);
-	r = SW_NONE;
-	if (uart_pending_data())
+	else if (sw == SW_FSDUMP)
 	{
-		r = getchar();
-		if      (r == 'u')  r = SW_UNLOCK;
-		else if (r == 'l')  r = SW_LOCK;
-		else if (r == '?')  r = SW_INFO;
-		else if (r == 'r')  r = SW_READBLK;
-		else if (r == 'p')  r = SW_PWD_UNLOCK;
-		else if (r == 'P')  r = SW_PWD_LOCK;
-		else if (r == 'E')  r = SW_ERASE;
-		else				r = SW_NONE;
+		printf_P(PSTR("\r\n"));
+		FsDump();
 	}
-
-	if (r == SW_NONE)
+	else if (sw == SW_FORMAT)
+	{
+		printf_P(PSTR("\r\nFormatting card..."));
+		Format();
+	}
+	else if (sw == SW_WIPE)
 	{
-		sw = SW_PIN & SW_ALL_MASK;
-		if (sw != SW_ALL_MASK)						// if at least one switch is down...
+		if ((cmdargc < 2) || ((cmdargc > 2) && (cmdargs[2] > WIPE_RANDOM)))
 		{
-			if (((sw & SW_PWD_MASK) == 0) && ((prev_sw & SW_PWD_MASK) == 0))	// if PWD switch is down both scans...
-			{
-                sw_hold_counter++;
-                if(sw_hold_counter > 0xB0) // PWD hold (about 10 sec timeout)
-                {
-                    sw_hold_counter = 0;
-                    r = SW_ERASE;
-                }
-				else if (((sw & SW_LOCK_MASK) == 0) && (prev_sw & SW_LOCK_MASK))	// if LOCK switch was just pressed...
-				{
-                    sw_hold_counter = 0;
-					r = SW_PWD_LOCK;
-				}
-				else if (((sw & SW_UNLOCK_MASK) == 0) && (prev_sw & SW_UNLOCK_MASK))	// if UNLOCK switch was just pressed...
-				{
-                    sw_hold_counter = 0;
-					r = SW_PWD_UNLOCK;
-				}
-			}
-			else if (((sw & SW_PWD_MASK) == 0) && (prev_sw & SW_PWD_MASK))		// if PWD switch was just pressed...
+			printf_P(PSTR("\r\nUsage: wipe <first> <last> [0=zeros|1=ones|2=random]"));
+		}
+		else
+		{
+			if (cmdargc < 3)  cmdargs[2] = WIPE_ZEROS;
+			printf_P(PSTR("\r\nWiping blocks %lu to %lu..."), cmdargs[0], cmdargs[1]);
+			Wipe(cmdargs[0], cmdargs[1], cmdargs[2]);
+		}
+	}
+	else if (sw == SW_CLONE)
+	{
+		if ((cmdargc > 0) && (cmdargs[0] > 1))
+		{
+			printf_P(PSTR("\r\nUsage: clone [0=copy|1=copy and verify] [first] [count]"));
+		}
+		else
+		{
+			if (cmdargc < 1)  cmdargs[0] = FALSE;
+			if (cmdargc < 2)  cmdargs[1] = 0;
+			if (cmdargc < 3)  cmdargs[2] = 0;		// to the end of the card
+			printf_P(PSTR("\r\nCloning to the card in socket 2..."));
+			Clone(cmdargs[1], cmdargs[2], cmdargs[0]);
+		}
+	}
+	else if (sw == SW_UPLOAD)
+	{
+		if ((cmdargc < 2) || (cmdargs[1] > UPLOAD_MAX))
+		{
+			printf_P(PSTR("\r\nUsage: w <block> <count>, then count * 512 bytes"));
+		}
+		else
+		{
+			Upload(cmdargs[0], cmdargs[1]);
+		}
+	}
+	else if (sw == SW_AUTO)
+	{
+		if ((cmdargc > 0) && (cmdargs[0] > AUTO_LAST))
+		{
+			printf_P(PSTR("\r\nUsage: auto [0=off|1=P|2=p|3=E|4=l|5=u|6=format]"));
+		}
+		else
+		{
+			if (cmdargc > 0)  SetAuto(cmdargs[0]);
+			printf_P(PSTR("\r\nAuto mode: %S, %u passed, %u failed."),
+				autonames[autoaction], autopass, autofail);
+		}
+	}
+	else if (sw == SW_TRACE)
+	{
+#if SPI_TRACE
+		if (cmdargc && (cmdargs[0] == 1))
+		{
+			printf_P(PSTR("\r\n"));
+			trace_send();
+		}
+		else if (cmdargc && (cmdargs[0] == 2))
+		{
+			trace_clear();
+		}
+		else if (cmdargc && (cmdargs[0] == 3))
+		{
+			capture_arm();
+			printf_P(PSTR("\r\nCapturing the SPI bus during the next command."));
+		}
+		else
+		{
+			trace_show();
+		}
+#else
+		printf_P(PSTR("\r\nTrace not built in; rebuild with make TRACE=1."));
+#endif
+	}
+	else if (sw == SW_MEM)
+	{
+		ShowMem();
+	}
+	else if (sw == SW_ERASE_RANGE)
+	{
+		if (cmdargc < 2)
+		{
+			printf_P(PSTR("\r\nUsage: erase <first> <last>"));
+		}
+		else
+		{
+			printf_P(PSTR("\r\nErasing blocks %lu to %lu..."), cmdargs[0], cmdargs[1]);
+			EraseRange(cmdargs[0], cmdargs[1]);
+		}
+	}
+	else if (sw == SW_UNKNOWN)
+	{
+		printf_P(PSTR("\r\nUnknown command."));
+	}
+	else if (sw == SW_ERASE)
+	{
+            printf_P(PSTR("\r\nTrying to ERASE SD CARD..."));
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		ReadCardStatus();
+		if (cardstatus[1] & 0x01)		// if card is locked...
+		{
+                printf_P(PSTR("please wait..."));
+			ActStart(SW_ERASE);				// finished by ActDone()
+		}
+		else							// silly person, card is already unlocked
+		{
+                printf_P(PSTR("the card is not locked"));
+			UNLOCK_LED_ON;
+		}
+	}
+	else if (sw == SW_PWD_UNLOCK)
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		ReadCardStatus();
+		if (cardstatus[1] & 0x01)		// if card is locked...
+		{
+			printf_P(PSTR("\r\nTrying to unlock card..."));
+			LoadGlobalPWD();
+			ActStart(SW_PWD_UNLOCK);		// finished by ActDone()
+		}
+		else							// silly person, card is already unlocked
+		{
+			UNLOCK_LED_ON;
+		}
+	}
+	else if (sw == SW_PWD_LOCK)
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		ReadCardStatus();
+		if ((cardstatus[1] & 0x01) == 0)	// if card is unlocked...
+		{
+			printf_P(PSTR("\r\nTrying to lock card..."));
+			LoadGlobalPWD();
+			ActStart(SW_PWD_LOCK);			// finished by ActDone()
+		}
+		else							// silly person, card is already locked
+		{
+			LOCK_LED_ON;
+		}
+	}
+	else if (sw == SW_PWD_CHECK)
+	{
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		printf_P(PSTR("\r\nChecking PWD state..."));
+		ReadCardStatus();
+		if ((cardstatus[1] & 0x01) == 0)	// if card is unlocked...
+		{
+			UNLOCK_LED_ON;
+		}
+		else
+		{
+			LOCK_LED_ON;
+		}
+	}
+	else if (sw == SW_LOCK_CHECK)
+	{
+		printf_P(PSTR("\r\nChecking temp-lock state..."));
+		ReadOCR();
+		r = ReadCSD();
+		if (r == SDCARD_OK)
+		{
+			ShowLockState();
+		}
+		else
+		{
+			BlinkLED(PATTERN_NO_DETECT);
+		}
+	}
+}
+
+
+
+static uint8_t  ReadSwitch(void)
+{
+	uint8_t						r;
+	static uint8_t				prev_sw = SW_ALL_MASK;
+	static uint32_t             sw_hold_start = 0;
+	uint8_t						sw;
+
+	if (cardjob.next != SW_NONE)				// typed while a card command ran
+	{
+		r = cardjob.next;
+		cardjob.next = SW_NONE;
+		cmdargc = 0;
+		if (r == SW_LINE)
+		{
+			printf_P(PSTR("%s"), cmdline);		// the echo held back
+			r = ParseCommand();
+		}
+		consolecmd = TRUE;
+		return  r;
+	}
+
+/*
+ *  Sleep between scans; 50 ms apart debounces the switches.  With every
+ *  switch up and nothing to poll, sleep until a switch or a byte arrives.
+ */
+	if (((SW_PIN & SW_ALL_MASK) == SW_ALL_MASK) && (prev_sw == SW_ALL_MASK) && (autoaction == AUTO_OFF))
+	{
+		IdleWait(0);
+	}
+	else
+	{
+		IdleWait(50);
+	}
+	r = SW_NONE;
+	while ((r == SW_NONE) && uart_pending_data())
+	{
+		r = ReadConsole(getchar());
+	}
+	if (r != SW_NONE)
+	{
+		consolecmd = TRUE;
+		return  r;
+	}
+
+	sw = SW_PIN & SW_ALL_MASK;
+	if (sw != SW_ALL_MASK)						// if at least one switch is down...
+	{
+		if (((sw & SW_PWD_MASK) == 0) && ((prev_sw & SW_PWD_MASK) == 0))	// if PWD switch is down both scans...
+		{
+            if ((timer_ms() - sw_hold_start) > PWD_HOLD_MS) // PWD hold (10 sec timeout)
+            {
+                sw_hold_start = timer_ms();
+                r = SW_ERASE;
+            }
+			else if (((sw & SW_LOCK_MASK) == 0) && (prev_sw & SW_LOCK_MASK))	// if LOCK switch was just pressed...
 			{
-                sw_hold_counter = 0;
-				if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == (SW_LOCK_MASK | SW_UNLOCK_MASK))	// if other switches are open...
-				{
-					r = SW_PWD_CHECK;
-				}
+                sw_hold_start = timer_ms();
+				r = SW_PWD_LOCK;
 			}
-			else if ((sw & SW_PWD_MASK) == SW_PWD_MASK)					// if PWD switch is now open...
+			else if (((sw & SW_UNLOCK_MASK) == 0) && (prev_sw & SW_UNLOCK_MASK))	// if UNLOCK switch was just pressed...
 			{
-                sw_hold_counter = 0;
-				if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == SW_UNLOCK_MASK)	// if LOCK switch is pressed...
-				{
-					if (prev_sw & SW_LOCK_MASK)							// but LOCK switch wasn't pressed before...
-					{
-						r = SW_LOCK;
-					}
+                sw_hold_start = timer_ms();
+				r = SW_PWD_UNLOCK;
+			}
+		}
+		else if (((sw & SW_PWD_MASK) == 0) && (prev_sw & SW_PWD_MASK))		// if PWD switch was just pressed...
+		{
+            sw_hold_start = timer_ms();
+			if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == (SW_LOCK_MASK | SW_UNLOCK_MASK))	// if other switches are open...
+			{
+				r = SW_PWD_CHECK;
+			}
+		}
+		else if ((sw & SW_PWD_MASK) == SW_PWD_MASK)					// if PWD switch is now open...
+		{
+            sw_hold_start = timer_ms();
+			if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == SW_UNLOCK_MASK)	// if LOCK switch is pressed...
+			{
+				if (prev_sw & SW_LOCK_MASK)							// but LOCK switch wasn't pressed before...
+				{
+					r = SW_LOCK;
 				}
-				else if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == SW_LOCK_MASK)	// if UNLOCK switch is pressed...
+			}
+			else if ((sw & (SW_LOCK_MASK | SW_UNLOCK_MASK)) == SW_LOCK_MASK)	// if UNLOCK switch is pressed...
+			{
+				if (prev_sw & SW_UNLOCK_MASK)							// but UNLOCK switch wasn't pressed before...
 				{
-					if (prev_sw & SW_UNLOCK_MASK)							// but UNLOCK switch wasn't pressed before...
-					{
-						r = SW_UNLOCK;
-					}
+					r = SW_UNLOCK;
 				}
 			}
 		}
-		else														// no switches are down...
+	}
+	else														// no switches are down...
+	{
+        sw_hold_start = timer_ms();
+		if ((prev_sw & SW_PWD_MASK) == 0)						// if PWD switch was just released...
 		{
-            sw_hold_counter = 0;
-			if ((prev_sw & SW_PWD_MASK) == 0)						// if PWD switch was just released...
-			{
-				r = SW_LOCK_CHECK;
-			}
+			r = SW_LOCK_CHECK;
 		}
-		prev_sw = sw;												// record for next time
 	}
+	prev_sw = sw;												// record for next time
 
 	return  r;
 }
 
 
 
+/*
+ *  IdleWait      sleep for ms milliseconds, or with ms 0 until a switch
+ *                is pressed; any received byte ends the wait at once
+ *
+ *  The millisecond tick wakes the CPU to check the time again.  With ms 0
+ *  nothing needs the time, so the tick is stopped and only the UART or a
+ *  switch wakes it; timer_ms() does not count that wait.  The card is
+ *  deselected and the SPI clock stopped while asleep.  Idle sleep keeps
+ *  the UART running; power-down would not, and would lose the byte that
+ *  woke it, so it is not used.
+ */
+static void  IdleWait(uint16_t  ms)
+{
+	uint32_t					start;
+
+	start = timer_ms();
+	deselect();
+	power_spi_disable();
+	if (ms == 0)  timer_stop();
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	while (!uart_pending_data())
+	{
+		if (ms)
+		{
+			if ((timer_ms() - start) >= ms)  break;
+		}
+		else if ((SW_PIN & SW_ALL_MASK) != SW_ALL_MASK)
+		{
+			break;
+		}
+		cli();
+		if (!uart_pending_data())			// a byte may have come in since the test
+		{
+			sleep_enable();
+			sei();							// the instruction after sei runs first,
+			sleep_cpu();					// so no interrupt is missed here
+			sleep_disable();
+		}
+		sei();
+	}
+	if (ms == 0)  timer_start();
+	power_spi_enable();
+	SPISetFast(FALSE);						// SPI must be set up again after power-up
+}
+
+
+
+/*
+ *  A switch press only needs to end IdleWait(); ReadSwitch() does the rest.
+ */
+EMPTY_INTERRUPT(SW_PCINT_vect)
+
+
+
+/*
+ *  ReadConsole      add a character to the console line, return a command
+ *
+ *  The single-key commands act at once when typed at the start of a line,
+ *  as they always have.  Everything else is collected (and echoed) until
+ *  CR or LF, then handed to ParseCommand().  A host control frame that
+ *  arrives after its dump has ended is dropped whole.  While a card
+ *  request runs, the line is not echoed, so the reply being printed stays
+ *  whole, and it comes back as SW_LINE, to be parsed when it is run.
+ */
+static uint8_t  ReadConsole(char  c)
+{
+	static uint8_t				ctlskip;			// bytes left of a stray control frame
+
+	if (ctlskip)
+	{
+		ctlskip--;
+		return  SW_NONE;
+	}
+	if ((uint8_t)c == FRAME_SYNC)				// an ack that outlived its dump
+	{
+		ctlskip = FRAME_HDR_LEN + 1;
+		return  SW_NONE;
+	}
+	if (cmdlen == 0)
+	{
+		cmdargc = 0;
+		if      (c == 'u')  return  SW_UNLOCK;
+		else if (c == 'l')  return  SW_LOCK;
+		else if (c == '?')  return  SW_INFO;
+		else if (c == 'p')  return  SW_PWD_UNLOCK;
+		else if (c == 'P')  return  SW_PWD_LOCK;
+		else if (c == 'E')  return  SW_ERASE;
+	}
+
+	if ((c == '\r') || (c == '\n'))
+	{
+		if (cmdlen == 0)						// empty line just gets a fresh prompt,
+		{										// but not the LF of a CRLF pair
+			return  (c == '\r') ? SW_NOP : SW_NONE;
+		}
+		cmdline[cmdlen] = 0;
+		cmdlen = 0;
+		if (cardreq.op != SDREQ_NONE)  return  SW_LINE;
+		return  ParseCommand();
+	}
+	if ((c == '\b') || (c == 0x7f))
+	{
+		if (cmdlen)
+		{
+			cmdlen--;
+			if (cardreq.op == SDREQ_NONE)  printf_P(PSTR("\b \b"));
+		}
+		return  SW_NONE;
+	}
+	if (isprint(c) && (cmdlen < (CMDLINE_LEN-1)))
+	{
+		cmdline[cmdlen++] = c;
+		if (cardreq.op == SDREQ_NONE)  putchar(c);
+	}
+	return  SW_NONE;
+}
+
+
+
+/*
+ *  ParseCommand      split the console line into a command word and
+ *                    numeric arguments (decimal, or hex with 0x prefix)
+ */
+static uint8_t  ParseCommand(void)
+{
+	char						*p;
+	char						*end;
+	char						*word;
+
+	p = cmdline;
+	while (*p == ' ')  p++;
+	word = p;
+	while (*p && (*p != ' '))  p++;
+	if (*p)  *p++ = 0;
+
+	cmdargc = 0;
+	while (*p && (cmdargc < CMD_MAX_ARGS))
+	{
+		if (*p == ' ')
+		{
+			p++;
+			continue;
+		}
+		cmdargs[cmdargc] = strtoul(p, &end, 0);
+		if (end == p)  return  SW_UNKNOWN;			// not a number
+		cmdargc++;
+		p = end;
+	}
+
+	if (strcmp_P(word, PSTR("r")) == 0)  return  SW_READBLK;
+	if (strcmp_P(word, PSTR("bench")) == 0)  return  SW_BENCH;
+	if (strcmp_P(word, PSTR("d")) == 0)  return  SW_DUMP;
+	if (strcmp_P(word, PSTR("s")) == 0)  return  SW_STREAM;
+	if (strcmp_P(word, PSTR("c")) == 0)  return  SW_DELTA;
+	if (strcmp_P(word, PSTR("fs")) == 0)  return  SW_FSDUMP;
+	if (strcmp_P(word, PSTR("format")) == 0)  return  SW_FORMAT;
+	if (strcmp_P(word, PSTR("erase")) == 0)  return  SW_ERASE_RANGE;
+	if (strcmp_P(word, PSTR("wipe")) == 0)  return  SW_WIPE;
+	if (strcmp_P(word, PSTR("clone")) == 0)  return  SW_CLONE;
+	if (strcmp_P(word, PSTR("w")) == 0)  return  SW_UPLOAD;
+	if (strcmp_P(word, PSTR("auto")) == 0)  return  SW_AUTO;
+	if (strcmp_P(word, PSTR("trace")) == 0)  return  SW_TRACE;
+	if (strcmp_P(word, PSTR("mem")) == 0)  return  SW_MEM;
+	return  SW_UNKNOWN;
+}
+
+
+
 static void  ShowLockState(void)
 {
 	LOCK_LED_OFF;
@@ -736,7 +1468,8 @@ static void  ShowLockState(void)
  */
 static  void  select(void)
 {
-	SD_CS_PORT = SD_CS_PORT & ~SD_CS_MASK;
+	if (sdslot == SLOT_SECOND)  SD2_CS_PORT = SD2_CS_PORT & ~SD2_CS_MASK;
+	else  SD_CS_PORT = SD_CS_PORT & ~SD_CS_MASK;
 }
 
 
@@ -746,7 +1479,43 @@ static  void  select(void)
  */
 static  void  deselect(void)
 {
-	SD_CS_PORT = SD_CS_PORT | SD_CS_MASK;
+	if (sdslot == SLOT_SECOND)  SD2_CS_PORT = SD2_CS_PORT | SD2_CS_MASK;
+	else  SD_CS_PORT = SD_CS_PORT | SD_CS_MASK;
+}
+
+
+
+/*
+ *  SDSelected      nonzero if the card in the current socket is selected
+ */
+static uint8_t  SDSelected(void)
+{
+	if (sdslot == SLOT_SECOND)  return  (SD2_CS_PORT & SD2_CS_MASK) == 0;
+	return  (SD_CS_PORT & SD_CS_MASK) == 0;
+}
+
+
+
+/*
+ *  SDSlot      make the card in another socket the one the driver talks to
+ *
+ *  The card in use is deselected and given eight clocks to let go of DO
+ *  before the other one can be selected.  sdtype and tune follow the
+ *  socket, and the SPI clock too if it is fast.  Callers only switch
+ *  between whole commands, busy included, so no card is ever left in
+ *  the middle of a transfer.
+ */
+static void  SDSlot(uint8_t  slot)
+{
+	if (slot == sdslot)  return;
+	deselect();
+	xchg(0xff);
+	slottype[sdslot] = sdtype;
+	slottune[sdslot] = tune;
+	sdslot = slot;
+	sdtype = slottype[slot];
+	tune = slottune[slot];
+	if (spifast)  SPISetFast(TRUE);			// at this card's clock
 }
 
 
@@ -756,9 +1525,14 @@ static  void  deselect(void)
  */
 static  unsigned char  xchg(unsigned char  c)
 {
+#if SPI_REPLAY
+	return  replay_xchg(c, SPI_CS_FLAGS);			// host/sdreplay plays the card
+#else
 	SPDR = c;
 	while ((SPSR & (1<<SPIF)) == 0)  ;
+	CAPTURE_XCHG(c, SPDR, SPI_CS_FLAGS);
 	return  SPDR;
+#endif
 }
 
 
@@ -769,353 +1543,2901 @@ static  unsigned char  xchg(unsigned char  c)
 
 static int8_t  SDInit(void)
 {
-	int					i;
-	int8_t				response;
+	struct sdreq				q;
+	int8_t						r;
+
+	SDBegin(&q, SDREQ_INIT, 0, NULL);
+	r = SDRun(&q);
+	if (r == SDCARD_OK)  CardTune();
+	return  r;
+}
+
+
 
-	sdtype = SDTYPE_UNKNOWN;			// assume this fails
 /*
- *  Begin initialization by sending CMD0 and waiting until SD card
- *  responds with In Idle Mode (0x01).  If the response is not 0x01
- *  within a reasonable amount of time, there is no SD card on the bus.
+ *  SDBegin      set up a card request; nothing is sent until SDPoll()
  */
-	deselect();							// always make sure
-	for (i=0; i<10; i++)				// send several clocks while card power stabilizes
-		xchg(0xff);
+static void  SDBegin(struct sdreq  *q, uint8_t  op, uint32_t  arg, uint8_t  *buf)
+{
+	q->op = op;
+	q->step = 0;
+	q->count = 0;
+	q->arg = arg;
+	q->blocks = 0;
+	q->buf = buf;
+	q->start = timer_us();
+	q->start_ms = timer_ms();
+}
+
+
+
+/*
+ *  SDPoll      run the next step of a card request
+ *
+ *  Returns SDCARD_BUSY while there is more to do, SDCARD_BLOCK when a
+ *  multi-block read has a block for the caller, else the result of the
+ *  request, which is then finished (q->op is SDREQ_NONE).
+ */
+static int8_t  SDPoll(struct sdreq  *q)
+{
+	int8_t						r;
+
+	r = SDCARD_RWFAIL;
+	if      (q->op == SDREQ_INIT)  r = SDPollInit(q);
+	else if (q->op == SDREQ_READ)  r = SDPollRead(q);
+	else if (q->op == SDREQ_NOT_BUSY)  r = SDPollNotBusy(q);
+	else if (q->op == SDREQ_FORCE_ERASE)  r = SDPollForceErase(q);
+	else if (q->op == SDREQ_READ_MULTI)  r = SDPollReadMulti(q);
+	else if (q->op == SDREQ_CMD42)  r = SDPollCmd42(q);
+	else if (q->op == SDREQ_WRITE_CSD)  r = SDPollWriteCSD(q);
+	if ((r != SDCARD_BUSY) && (r != SDCARD_BLOCK))  q->op = SDREQ_NONE;
+	return  r;
+}
+
+
+
+/*
+ *  SDRun      poll a request until it is done, for callers that can wait
+ *
+ *  Card init, r, erase, the lock commands and the forced erase run their
+ *  requests from the main loop instead (CardReqPoll()).  The rest wait
+ *  here: the CMD25 streams of w, clone, format and wipe, bench, and the
+ *  d, s, c and fs dumps, whose data goes out as it is read.
+ */
+static int8_t  SDRun(struct sdreq  *q)
+{
+	int8_t						r;
+
+	do
+	{
+		r = SDPoll(q);
+	}  while (r == SDCARD_BUSY);
+	return  r;
+}
+
+
+
+/*
+ *  SDPollInit      one step of the card initialization
+ *
+ *  After CMD0, CMD8 tells a v2 card, which echoes the check pattern, from
+ *  a v1 card, which calls it illegal.  ACMD41 (with HCS for v2) is then
+ *  polled until the card leaves the idle state: the polls are a quarter
+ *  of the time waited so far apart, at most SD_POLL_MAX_MS, and the card
+ *  has SD_READY_MS from the first one, as the spec allows.  A v1 card that
+ *  rejects ACMD41 is an MMC and gets CMD1 instead.  Once ready, the CCS
+ *  bit of a v2 card's OCR says whether it takes block numbers (SDHC,
+ *  SDXC) or byte addresses.  CMD58 is polled the same way for SD_OCR_MS
+ *  until the card gives its OCR.  A card that never does (see quirks[])
+ *  is typed from its CSD instead, with a warning: version 1.0 CSDs are
+ *  byte-addressed cards, later ones take block numbers.  Only
+ *  byte-addressed cards need CMD16, which a card only takes once it is
+ *  out of the idle state.
+ */
+static int8_t  SDPollInit(struct sdreq  *q)
+{
+	int					i;
+	int8_t				response;
+	uint8_t				r7[4];
+	uint32_t			elapsed;
+
+/*
+ *  Begin initialization by sending CMD0 and waiting until SD card
+ *  responds with In Idle Mode (0x01).  If the response is not 0x01
+ *  within a reasonable amount of time, there is no SD card on the bus.
+ */
+	if (q->step == 0)
+	{
+		sdtype = SDTYPE_UNKNOWN;			// assume this fails
+		deselect();							// always make sure
+		for (i=0; i<10; i++)				// send several clocks while card power stabilizes
+			xchg(0xff);
+		q->step = 1;
+		return  SDCARD_BUSY;
+	}
+	if (q->step == 1)
+	{
+		response = sd_send_command(SD_GO_IDLE, 0);	// send CMD0 - go to idle state
+		if (response == 1)
+		{
+			q->step = 2;
+			return  SDCARD_BUSY;
+		}
+		if (++q->count < 0x10)  return  SDCARD_BUSY;
+		return  SDCARD_NO_DETECT;
+	}
+	if (q->step == 2)
+	{
+		q->arg = 0;									// no HCS for a v1 card
+		response = sd_send_command(SD_SEND_IF_COND, 0x1aa);	// probe to see if card is SD v2
+		if (response == 0x01)
+		{
+			for (i=0; i<4; i++)						// R7: accepted voltage, check pattern
+			{
+				r7[i] = xchg(0xff);
+			}
+			if (((r7[2] & 0x0f) != 0x01) || (r7[3] != 0xaa))  return  SDCARD_NO_DETECT;	// unusable
+			q->arg = 1UL<<30;						// HCS: we take high capacity cards
+		}
+		q->step = 3;
+		q->count = 0;								// ms to the next poll; the first at once
+		q->start_ms = timer_ms();
+		sdreadyms = 0;
+		sdreadypolls = 0;
+		return  SDCARD_BUSY;
+	}
+	if ((q->step == 3) || (q->step == 4))			// ACMD41, or CMD1 for an MMC, until ready
+	{
+		elapsed = timer_ms() - q->start_ms;
+		if (elapsed < q->count)  return  SDCARD_BUSY;
+		if (q->step == 3)  response = sd_send_command(SD_ADV_INIT, q->arg);
+		else  response = sd_send_command(SD_INIT, 0);
+		sdreadypolls++;
+		if ((q->step == 3) && (q->arg == 0) && (response & 0x04))	// illegal command: MMC
+		{
+			q->step = 4;
+			return  SDCARD_BUSY;
+		}
+		if (response != 0)  return  SDInitRetry(q, elapsed, SD_READY_MS);
+		sdreadyms = timer_ms() - q->start_ms;
+		if (q->arg)									// v2: CCS in the OCR says which
+		{
+			q->step = 5;
+			q->count = 0;
+			q->start_ms = timer_ms();				// CMD58 gets its own SD_OCR_MS
+			return  SDCARD_BUSY;
+		}
+		sdtype = SDTYPE_SD;
+	}
+	if (q->step == 5)								// CMD58 until the card answers
+	{
+		elapsed = timer_ms() - q->start_ms;
+		if (elapsed < q->count)  return  SDCARD_BUSY;
+		if ((ReadOCR() == SDCARD_OK) && (ocr[0] & 0x80))	// CCS only valid once powered up
+		{
+			sdtype = (ocr[0] & 0x40) ? SDTYPE_SDHC : SDTYPE_SD;
+		}
+		else if (SDInitRetry(q, elapsed, SD_OCR_MS) == SDCARD_BUSY)
+		{
+			return  SDCARD_BUSY;
+		}
+		else										// no OCR; the CSD version says instead
+		{
+			if (ReadCSD() != SDCARD_OK)  return  SDCARD_TIMEOUT;
+			sdtype = (csd[0] >> 6) ? SDTYPE_SDHC : SDTYPE_SD;
+			printf_P(PSTR("\r\nCMD58 failed; card type from the CSD."));
+		}
+	}
+
+	if (sdtype == SDTYPE_SD)
+	{
+		sd_send_command(SD_SET_BLK_LEN, 512);		// byte-addressed cards only
+	}
+	xchg(0xff);								// send 8 final clocks
+
+/*
+ *  At this point, the SD card has completed initialization.  The calling routine
+ *  can now increase the SPI clock rate for the SD card to the maximum allowed by
+ *  the SD card (typically, 20 MHz).
+ */
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  SDInitRetry      set the next ACMD41, CMD1 or CMD58 of SDPollInit() a
+ *                   quarter of the time waited so far away (1 ms to
+ *                   SD_POLL_MAX_MS), or time out once limit ms are up
+ */
+static int8_t  SDInitRetry(struct sdreq  *q, uint32_t  elapsed, uint16_t  limit)
+{
+	if (elapsed >= limit)  return  SDCARD_TIMEOUT;
+	elapsed = elapsed / 4;							// back off as the wait grows
+	if (elapsed < 1)  elapsed = 1;
+	if (elapsed > SD_POLL_MAX_MS)  elapsed = SD_POLL_MAX_MS;
+	q->count = timer_ms() - q->start_ms + elapsed;
+	return  SDCARD_BUSY;
+}
+
+
+
+/*
+ *  SDPollRead      CMD17, then the data token, then SDREQ_CHUNK bytes a poll
+ */
+static int8_t  SDPollRead(struct sdreq  *q)
+{
+	uint8_t						status;
+	uint8_t						i;
+
+	if (q->step == 0)
+	{
+		status = sd_send_command(SD_READ_BLK, BlockAddr(q->arg));	// send read command and logical sector address
+		if (status != SDCARD_OK)  return  SDCARD_RWFAIL;
+		q->step = 1;
+		return  SDCARD_BUSY;
+	}
+	if (q->step == 1)
+	{
+		status = sd_wait_for_data();		// wait for valid data token from card
+		if (status != 0xfe)					// card must return 0xfe for CMD17
+		{
+			ShowErrorCode(status);			// tell the user
+			return  SDCARD_RWFAIL;			// return error code
+		}
+		q->step = 2;
+		return  SDCARD_BUSY;
+	}
+	for (i=0; i<SDREQ_CHUNK; i++)			// read sector data
+	{
+		q->buf[q->count++] = xchg(0xff);
+	}
+	if (q->count < 512)  return  SDCARD_BUSY;
+	xchg(0xff);								// ignore CRC
+	xchg(0xff);								// ignore CRC
+	return  SDCARD_OK;						// return success
+}
+
+
+
+/*
+ *  SDPollReadMulti      CMD18, then per block the data token and
+ *                       SDREQ_CHUNK bytes a poll, then CMD12
+ *
+ *  Returns SDCARD_BLOCK each time a block is in buf; arg is then the next
+ *  block number.  The caller must be done with buf before polling again.
+ *  To stop early, call ReadMultiStop() and drop the request.
+ */
+static int8_t  SDPollReadMulti(struct sdreq  *q)
+{
+	uint8_t						status;
+	uint8_t						i;
+
+	if (q->step == 0)
+	{
+		if (q->blocks == 0)  return  SDCARD_OK;
+		if (ReadMultiStart(q->arg) != SDCARD_OK)  return  SDCARD_RWFAIL;
+		q->step = 1;
+		return  SDCARD_BUSY;
+	}
+	if (q->step == 1)
+	{
+		status = sd_wait_for_data();
+		if (status != 0xfe)
+		{
+			ShowErrorCode(status);
+			ReadMultiStop();
+			return  SDCARD_RWFAIL;
+		}
+		q->count = 0;
+		q->step = 2;
+		return  SDCARD_BUSY;
+	}
+	if (q->step == 2)
+	{
+		for (i=0; i<SDREQ_CHUNK; i++)
+		{
+			q->buf[q->count++] = xchg(0xff);
+		}
+		if (q->count < 512)  return  SDCARD_BUSY;
+		xchg(0xff);							// ignore CRC
+		xchg(0xff);
+		q->arg++;
+		q->blocks--;
+		q->step = q->blocks ? 1 : 3;
+		return  SDCARD_BLOCK;
+	}
+	return  ReadMultiStop();
+}
+
+
+
+/*
+ *  SDPollNotBusy      wait for the card to release the data line, up to
+ *                     SDREQ_CHUNK bytes a poll; sets busytime when done
+ */
+static int8_t  SDPollNotBusy(struct sdreq  *q)
+{
+	uint8_t						r;
+
+	if (q->step == 0)
+	{
+		q->step = 1;
+		r = xchg(0xff);
+		if ((r & 0x11) == 0x01)						// data response token (xxx0sss1)
+		{
+			TRACE_TOKEN(r);
+			r = xchg(0xff);
+		}
+		if (r != 0xff)  return  SDCARD_BUSY;
+		busytime = timer_us() - q->start;
+		TRACE_BUSY(busytime);
+		return  SDCARD_OK;
+	}
+	return  SDPollBusy(q, q->arg);
+}
+
+
+
+/*
+ *  SDPollBusy      clock up to SDREQ_CHUNK bytes while the card holds the
+ *                  data line low; SDCARD_RWFAIL once timeout_ms from
+ *                  q->start is up.  Sets busytime when done.
+ */
+static int8_t  SDPollBusy(struct sdreq  *q, uint16_t  timeout_ms)
+{
+	uint8_t						i;
+
+	for (i=0; i<SDREQ_CHUNK; i++)
+	{
+		if (xchg(0xff) == 0xff)  break;
+	}
+	if ((i == SDREQ_CHUNK) && ((timer_us() - q->start) <= (timeout_ms * 1000UL)))
+	{
+		return  SDCARD_BUSY;
+	}
+	busytime = timer_us() - q->start;
+	TRACE_BUSY(busytime);
+	return  (i == SDREQ_CHUNK) ? SDCARD_RWFAIL : SDCARD_OK;
+}
+
+
+
+/*
+ *  SDPollCmd42      CMD42 with mask arg & 0x07 and the first arg >> 8
+ *                   bytes of pwd[], SDREQ_CHUNK bytes of the 512-byte
+ *                   block a poll, then its data response and busy
+ */
+static int8_t  SDPollCmd42(struct sdreq  *q)
+{
+	uint8_t						len;
+	uint8_t						i;
+
+	len = q->arg >> 8;
+	if (q->step == 0)
+	{
+		if (sd_send_command(SD_LOCK_UNLOCK, 0) != 0)  return  SDCARD_RWFAIL;
+		xchg(0xfe);							// send data token marking start of data block
+		xchg(q->arg & 0x07);				// top five bits MUST be 0, do not allow forced-erase!
+		xchg(len);							// then send the password length
+		q->count = 2;						// block bytes sent
+		q->step = 1;
+		return  SDCARD_BUSY;
+	}
+	if (q->step == 1)
+	{
+		for (i=0; (i<SDREQ_CHUNK) && (q->count<512); i++, q->count++)
+		{
+			xchg(((q->count - 2) < len) ? pwd[q->count - 2] : 0xff);
+		}
+		if (q->count < 512)  return  SDCARD_BUSY;
+		xchg(0xff);							// ignore dummy checksum
+		xchg(0xff);							// ignore dummy checksum
+		q->step = 2;
+	}
+	return  SDPollWritten(q);
+}
+
+
+
+/*
+ *  SDPollWriteCSD      CMD27 with csd[] and its CRC7, then its data
+ *                      response and busy
+ */
+static int8_t  SDPollWriteCSD(struct sdreq  *q)
+{
+	uint8_t						tcrc;
+	uint8_t						i;
+
+	if (q->step == 0)
+	{
+		if (sd_send_command(SD_PROGRAM_CSD, 0) != 0)  return  SDCARD_RWFAIL;
+		xchg(0xfe);							// send data token marking start of data block
+		tcrc = 0;
+		for (i=0; i<15; i++)				// for all 15 data bytes in CSD...
+		{
+			xchg(csd[i]);
+			tcrc = AddByteToCRC(tcrc, csd[i]);
+		}
+		xchg((tcrc<<1) + 1);				// format the CRC7 value and send it
+		xchg(0xff);							// ignore dummy checksum
+		xchg(0xff);							// ignore dummy checksum
+		q->step = 2;
+	}
+	return  SDPollWritten(q);
+}
+
+
+
+/*
+ *  SDPollWritten      end a CMD27 or CMD42 data block: its data response,
+ *                     then the busy while the card programs it
+ *
+ *  SDCARD_RWFAIL if the card refused the block or was busy longer than
+ *  tune.busy_ms.
+ */
+static int8_t  SDPollWritten(struct sdreq  *q)
+{
+	uint8_t						r;
+
+	if (q->step == 2)
+	{
+		r = xchg(0xff);						// data response
+		TRACE_DATA(TRACE_DATA_OUT, r);
+		q->step = ((r & 0x1f) == 0x05) ? 3 : 4;		// accepted, or refused
+		q->start = timer_us();
+		return  SDCARD_BUSY;
+	}
+	r = SDPollBusy(q, tune.busy_ms);
+	if ((r == SDCARD_OK) && (q->step == 4))  return  SDCARD_RWFAIL;
+	return  (int8_t)r;
+}
+
+
+
+/*
+ *  SDPollForceErase      send the CMD42 forced erase, give the card a
+ *                        second, and try once more if it is still locked
+ *                        and its quirks call for it
+ */
+static int8_t  SDPollForceErase(struct sdreq  *q)
+{
+	if (q->step == 0)
+	{
+		ForceErase();
+		q->start_ms = timer_ms();
+		q->step = 1;
+		return  SDCARD_BUSY;
+	}
+	if ((timer_ms() - q->start_ms) < FORCE_ERASE_WAIT_MS)  return  SDCARD_BUSY;
+	ReadCardStatus();
+	if ((cardstatus[1] & 0x01) == 0)  return  SDCARD_OK;	// unlocked and erased
+	if ((tune.flags & TUNE_CMD42_RETRY) && (++q->count < 2))
+	{
+		q->step = 0;						// erasing failed, try one more time
+		return  SDCARD_BUSY;
+	}
+	return  SDCARD_RWFAIL;
+}
+
+
+
+/*
+ *  CardReqPoll      advance cardreq from the main loop and carry on the
+ *                   command it belongs to
+ *
+ *  Every card command starts by initializing the card this way.  The
+ *  hexdump (r) and the erase of a block range then go on a block or an
+ *  erase run at a time, and the lock commands and the forced erase a
+ *  CMD27 or CMD42 and its busy at a time (ActNext()); both LEDs blink
+ *  during the forced erase.  Auto mode runs its action the same way
+ *  (AutoStart()).  Between steps the console is
+ *  read: Ctrl-C stops an r or erase, and the next command is kept to run
+ *  afterwards.  The prompt ends the reply, with any part of a line typed
+ *  meanwhile after it.  An upload's data follows its command line, so
+ *  the console is left alone while a w starts.
+ */
+static void  CardReqPoll(void)
+{
+	uint8_t						op;
+	int8_t						r;
+	char						c;
+
+	op = cardreq.op;
+	r = SDPoll(&cardreq);
+	if (r == SDCARD_BUSY)
+	{
+		if (op == SDREQ_FORCE_ERASE)
+		{
+			if ((timer_ms() >> 8) & 1)
+			{
+				LOCK_LED_ON;
+				UNLOCK_LED_OFF;
+			}
+			else
+			{
+				LOCK_LED_OFF;
+				UNLOCK_LED_ON;
+			}
+		}
+	}
+	else if (op == SDREQ_INIT)  CardInitDone(r);
+	else if (cardjob.sw == SW_READBLK)  DumpNext(r);
+	else if (cardjob.sw == SW_ERASE_RANGE)  EraseNext(r);
+	else  ActNext(r);
+
+	if (cardreq.op == SDREQ_NONE)
+	{
+		if (cardjob.sw != SW_AUTO)			// auto mode reports on its own
+		{
+			CAPTURE_END();
+			printf_P(PSTR("\r\n> "));
+		}
+		if (cardjob.next == SW_NONE)			// part of a line typed meanwhile
+		{
+			cmdline[cmdlen] = 0;
+			printf_P(PSTR("%s"), cmdline);
+		}
+		return;
+	}
+	if (cardjob.sw == SW_UPLOAD)  return;
+	while ((cardjob.next == SW_NONE) && uart_pending_data())
+	{
+		c = getchar();
+		if (c == CONSOLE_ABORT)  cardjob.abort = TRUE;
+		else  cardjob.next = ReadConsole(c);
+	}
+}
+
+
+
+/*
+ *  CardInitDone      run the command once its card is initialized
+ */
+static void  CardInitDone(int8_t  r)
+{
+	if (r == SDCARD_OK)
+	{
+		CardTune();
+	}
+	if (cardjob.sw == SW_AUTO)
+	{
+		AutoStart(r);
+		return;
+	}
+	if (r != SDCARD_OK)
+	{
+		printf_P(PSTR("\n\r\n\rCannot initialize card.  Make sure the card is plugged in properly."));
+		BlinkLED(PATTERN_NO_DETECT);
+	}
+	cmdargc = cardjob.argc;
+	if (cardjob.abort)
+	{
+		printf_P(PSTR("\r\nStopped."));
+		return;
+	}
+	RunCommand(cardjob.sw);
+}
+
+
+
+/*
+ *  ForceEraseDone      report the forced erase started by E or a held PWD
+ */
+static void  ForceEraseDone(int8_t  r)
+{
+	LOCK_LED_OFF;
+	UNLOCK_LED_OFF;
+	if (r == SDCARD_OK)
+	{
+		printf_P(PSTR("done."));
+		UNLOCK_LED_ON;
+	}
+	else
+	{
+		printf_P(PSTR("failed!  Card is still locked."));
+		LOCK_LED_ON;
+	}
+}
+
+
+
+/*
+ *  ActStart      change the lock state of the card in use: what is
+ *                SW_PWD_LOCK or SW_PWD_UNLOCK (with pwd[]), SW_LOCK or
+ *                SW_UNLOCK (temporary write lock) or SW_ERASE (forced)
+ *
+ *  Each CMD42 or CMD27 runs in cardreq from the main loop; ActNext()
+ *  goes on when it ends and ActDone() reports the result.
+ */
+static void  ActStart(uint8_t  what)
+{
+	cardjob.u.act.what = what;
+	cardjob.u.act.step = 0;
+	ActNext(SDCARD_OK);
+}
+
+
+
+/*
+ *  ActNext      start the next request of a lock-state change, or end it
+ *
+ *  A password lock is SET_PWD then LOCK; a SET_PWD the card refused, in
+ *  its data response or with the LOCK_UNLOCK_FAILED bit of the status
+ *  after it, ends it before the LOCK.  An unlock is sent twice if it did
+ *  not take and the card's quirks call for it.  A temporary lock change
+ *  is confirmed by reading the CSD back.
+ */
+static void  ActNext(int8_t  r)
+{
+	struct actjob				*a;
+
+	a = &cardjob.u.act;
+	a->step++;
+	if (a->what == SW_ERASE)
+	{
+		if (a->step == 1)  SDBegin(&cardreq, SDREQ_FORCE_ERASE, 0, NULL);
+		else  ActDone(r);
+		return;
+	}
+	if ((a->what == SW_LOCK) || (a->what == SW_UNLOCK))
+	{
+		if (a->step == 1)
+		{
+			SDTxnBegin();
+			if (ReadCSD() != SDCARD_OK)
+			{
+				SDTxnEnd();
+				ActDone(SDCARD_NO_DETECT);
+				return;
+			}
+			if (a->what == SW_LOCK)  csd[14] = csd[14] | 0x10;	// bit 12 of CSD (temp lock)
+			else  csd[14] = csd[14] & ~0x10;
+			SDBegin(&cardreq, SDREQ_WRITE_CSD, 0, NULL);
+			return;
+		}
+		if (r == SDCARD_OK)					// written; read it back
+		{
+			a->step = 3;
+			ReadOCR();
+			r = ReadCSD();
+			if ((r == SDCARD_OK) && (((csd[14] & 0x10) != 0) != (a->what == SW_LOCK)))
+			{
+				a->step = 4;				// read back, but unchanged
+				r = SDCARD_RWFAIL;
+			}
+		}
+		SDTxnEnd();
+		ActDone(r);
+		return;
+	}
+	if (a->what == SW_PWD_LOCK)
+	{
+		if (a->step == 1)
+		{
+			SDTxnBegin();
+			SDBegin(&cardreq, SDREQ_CMD42, MASK_SET_PWD | ((uint16_t)pwd_len << 8), NULL);
+			return;
+		}
+		ReadCardStatus();
+		if (cardstatus[1] & 0x02)  r = SDCARD_RWFAIL;	// LOCK_UNLOCK_FAILED
+		if ((a->step == 2) && (r == SDCARD_OK))
+		{
+			SDBegin(&cardreq, SDREQ_CMD42, MASK_LOCK_UNLOCK | ((uint16_t)pwd_len << 8), NULL);
+			return;
+		}
+		SDTxnEnd();
+		ActDone(r);
+		return;
+	}
+	if (a->step == 1)						// SW_PWD_UNLOCK
+	{
+		SDTxnBegin();
+	}
+	else
+	{
+		ReadCardStatus();
+		if (((cardstatus[1] & 0x01) == 0) || ((tune.flags & TUNE_CMD42_RETRY) == 0) || (a->step > 2))
+		{
+			SDTxnEnd();
+			ActDone(r);
+			return;
+		}
+	}
+	SDBegin(&cardreq, SDREQ_CMD42, MASK_CLR_PWD | ((uint16_t)pwd_len << 8), NULL);
+}
+
+
+
+/*
+ *  ActDone      report a lock-state change, on the console or to auto
+ *               mode; only a card seen to end up in the wanted state passes
+ */
+static void  ActDone(int8_t  r)
+{
+	struct actjob				*a;
+
+	a = &cardjob.u.act;
+	if (a->what == SW_PWD_LOCK)  r = (cardstatus[1] & 0x01) ? SDCARD_OK : SDCARD_RWFAIL;
+	if (a->what == SW_PWD_UNLOCK)  r = (cardstatus[1] & 0x01) ? SDCARD_RWFAIL : SDCARD_OK;
+
+	if (cardjob.sw == SW_AUTO)
+	{
+		AutoDone(r);
+	}
+	else if (a->what == SW_ERASE)
+	{
+		ForceEraseDone(r);
+	}
+	else if (a->what == SW_PWD_UNLOCK)
+	{
+		if (r != SDCARD_OK)
+		{
+			printf_P(PSTR("failed!  Card is still locked."));
+			LOCK_LED_ON;
+		}
+		else
+		{
+			printf_P(PSTR("done."));
+			UNLOCK_LED_ON;
+		}
+	}
+	else if (a->what == SW_PWD_LOCK)
+	{
+		if (r != SDCARD_OK)
+		{
+			printf_P(PSTR("failed!  Card is still unlocked."));
+			UNLOCK_LED_ON;
+		}
+		else
+		{
+			printf_P(PSTR("done."));
+			LOCK_LED_ON;
+		}
+	}
+	else if (a->step == 1)
+	{
+		printf_P(PSTR("failed; unable to read CSD."));
+		BlinkLED(PATTERN_NO_DETECT);
+	}
+	else if (a->step == 2)
+	{
+		printf_P(PSTR("failed; response was %d."), r);
+		BlinkLED(PATTERN_CANNOT_CHG);
+	}
+	else if (r == SDCARD_OK)
+	{
+		ShowLockState();
+		printf_P(PSTR("done."));
+	}
+	else if (a->step == 4)
+	{
+		ShowLockState();
+		printf_P(PSTR("failed; the card kept its old setting."));
+		BlinkLED(PATTERN_CANNOT_CHG);
+	}
+	else
+	{
+		printf_P(PSTR("failed; cannot read CSD to confirm."));
+	}
+}
+
+
+
+/*
+ *  DumpStart      hexdump a range of blocks to the console; DumpNext()
+ *                 prints each block as the CMD18 request brings it in
+ *
+ *  Lines are 16 bytes with a 40-bit card byte address, so SDHC/SDXC
+ *  offsets past 4 GB print correctly.  As with hexdump(1), a line equal
+ *  to the one before it is not printed; a run of them shows as one '*',
+ *  even across block boundaries.  The last line is the end address.
+ */
+static void  DumpStart(uint32_t  first, uint32_t  count)
+{
+	cardjob.u.dump.have_prev = FALSE;
+	cardjob.u.dump.folding = FALSE;
+	SDBegin(&cardreq, SDREQ_READ_MULTI, first, block);
+	cardreq.blocks = count;
+}
+
+
+
+static void  DumpNext(int8_t  r)
+{
+	struct dumpjob				*d;
+	uint16_t					i;
+
+	d = &cardjob.u.dump;
+	if (r == SDCARD_OK)
+	{
+		printf_P(PSTR("\r\n%02X%08lX\r\n"), (uint8_t)(cardreq.arg>>23), cardreq.arg<<9);
+		return;
+	}
+	if (r != SDCARD_BLOCK)
+	{
+		printf_P(PSTR("\r\nRead of block %lu failed."), cardreq.arg);
+		return;
+	}
+	for (i=0; i<512; i+=16)
+	{
+		if (d->have_prev && (memcmp(d->prev, &block[i], 16) == 0))
+		{
+			if (!d->folding)  printf_P(PSTR("\r\n*"));
+			d->folding = TRUE;
+			continue;
+		}
+		d->folding = FALSE;
+		d->have_prev = TRUE;
+		memcpy(d->prev, &block[i], 16);
+		ShowDumpLine(cardreq.arg-1, i);
+	}
+	if (cardjob.abort && cardreq.blocks)
+	{
+		ReadMultiStop();
+		cardreq.op = SDREQ_NONE;
+		printf_P(PSTR("\r\nStopped after block %lu."), cardreq.arg-1);
+	}
+}
+
+
+
+static void  ShowDumpLine(uint32_t  blocknum, uint16_t  offset)
+{
+	uint8_t					i;
+	uint8_t					c;
+
+	printf_P(PSTR("\r\n%02X%08lX: "), (uint8_t)(blocknum>>23), (blocknum<<9)+offset);
+	for (i=0; i<16; i++)
+	{
+		printf_P(PSTR("%02X "), block[offset+i]);
+	}
+	printf_P(PSTR(" |"));
+	for (i=0; i<16; i++)
+	{
+		c = block[offset+i];
+		putchar(isprint(c) ? c : '.');
+	}
+	putchar('|');
+}
+
+
+
+static int8_t  ExamineSD(void)
+{
+	int8_t			response;
+
+	SDTxnBegin();
+	response = ReadOCR();
+	if (tune.flags & TUNE_OCR_FLAKY)  response = SDCARD_OK;	// see quirks[]
+	if (response == SDCARD_OK)  response = ReadCSD();
+	if (response == SDCARD_OK)
+	{
+//		printf_P(PSTR(" ReadCSD is OK "));
+		response = ReadCID();
+	}
+	if (response == SDCARD_OK)
+	{
+//		printf_P(PSTR(" ReadCID is OK "));
+		response = ReadCardStatus();
+	}
+	SDTxnEnd();
+
+	return  response;
+}
+
+
+
+
+/*
+ *  ReadOCR      CMD58; the OCR follows R1 in the same response (R3)
+ */
+static int8_t  ReadOCR(void)
+{
+	uint8_t				i;
+	int8_t				response;
+
+	for (i=0; i<4;  i++)  ocr[i] = 0;
+
+	response = sd_send_command(SD_READ_OCR, 0);
+	if ((response & 0xfe) != 0x00)			// idle is fine; init reads it before CMD16
+	{
+		return  SDCARD_RWFAIL;
+	}
+	for (i=0; i<4; i++)						// OCR is 4 bytes
+	{
+		ocr[i] = xchg(0xff);
+	}
+	return  SDCARD_OK;
+}
+
+
+
+static  int8_t  ReadCSD(void)
+{
+	uint8_t			i;
+	int8_t			response;
+
+	for (i=0; i<16; i++)  csd[i] = 0;
+
+	response = sd_send_command(SD_SEND_CSD, 0);
+	response = sd_wait_for_data();
+	if (response != (int8_t)0xfe)
+	{
+		printf_P(PSTR("\n\rReadCSD(), sd_wait_for_data returns %02x."), response);
+		return  SDCARD_RWFAIL;
+	}
+
+	for (i=0; i<16; i++)
+	{
+		csd[i] = xchg(0xff);
+	}
+	xchg(0xff);							// burn the CRC
+	xchg(0xff);
+	return  SDCARD_OK;
+}
+
+
+
+static  int8_t  ReadCID(void)
+{
+	uint8_t			i;
+	int8_t			response;
+
+	for (i=0; i<16; i++)  cid[i] = 0;
+
+	response = sd_send_command(SD_SEND_CID, 0);
+	response = sd_wait_for_data();
+	if (response != (int8_t)0xfe)
+	{
+		return  SDCARD_RWFAIL;
+	}
+
+	for (i=0; i<16; i++)
+	{
+		cid[i] = xchg(0xff);
+	}
+	xchg(0xff);							// burn the CRC
+	xchg(0xff);
+	return  SDCARD_OK;
+}
+
+
+
+static int8_t  ReadCardStatus(void)
+{
+	cardstatus[0] = sd_send_command(SD_SEND_STATUS, 0);
+	cardstatus[1] = xchg(0xff);
+//	printf_P(PSTR("\r\nReadCardStatus = %02x %02x"), cardstatus[0], cardstatus[1]);
+	xchg(0xff);
+	return  SDCARD_OK;
+}
+
+
+
+
+static int8_t  ReadBlock(uint32_t  blocknum, uint8_t  *buffer)
+{
+	struct sdreq				q;
+
+	SDBegin(&q, SDREQ_READ, blocknum, buffer);
+	return  SDRun(&q);
+}
+
+
+
+/*
+ *  ModifyPWD      send CMD42 with mask and the first len bytes of pwd[],
+ *                 and wait while the card programs it
+ */
+static int8_t  ModifyPWD(uint8_t  mask, uint8_t  len)
+{
+	struct sdreq				q;
+
+	SDBegin(&q, SDREQ_CMD42, (mask & 0x07) | ((uint16_t)len << 8), NULL);
+	return  SDRun(&q);
+}
+
+
+
+static int8_t  ForceErase(void)
+{
+	int8_t	r;
+
+	sd_send_command(SD_SET_BLK_LEN, 1);		// always set block length (CMD6) to 512 bytes
+
+	r = sd_send_command(SD_LOCK_UNLOCK, 0);
+	if (r != 0)
+	{
+		return  SDCARD_RWFAIL;
+	}
+	xchg(0xfe);							// send data token marking start of data block
+
+	xchg(MASK_ERASE);					// always start with required command
+
+	return  SDCARD_OK;			// return success
+}
+
+
+/*
+ *  BlockAddr      convert a block number to a data command argument
+ *
+ *  For SD cards, the argument to CMD17/CMD18 must be a byte address.
+ *  For SDHC cards, the argument must be a block (512 bytes) number.
+ */
+static uint32_t  BlockAddr(uint32_t  blocknum)
+{
+	if (sdtype == SDTYPE_SD) 	return  blocknum << 9;	// SD card; convert block number to byte addr
+	return  blocknum;									// SDHC/SDXC card; block number as is
+}
+
+
+
+/*
+ *  ReadMultiStart      start a CMD18 multiple-block read at blocknum
+ *
+ *  The card stays selected; fetch blocks with ReadMultiNext() and end the
+ *  transfer with ReadMultiStop().
+ */
+static int8_t  ReadMultiStart(uint32_t  blocknum)
+{
+	if (sd_send_command(SD_READ_MULTI, BlockAddr(blocknum)) != SDCARD_OK)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  ReadMultiNext      read the next block of a CMD18 transfer into buffer;
+ *                     a NULL buffer clocks the data through and drops it
+ *
+ *  While the bytes come in, blockuniform is worked out so a dump can send
+ *  a uniform (erased or zeroed) block as a run instead of its data.
+ */
+static int8_t  ReadMultiNext(uint8_t  *buffer)
+{
+	uint16_t					i;
+	uint8_t						status;
+	uint8_t						c;
+
+	status = sd_wait_for_data();
+	if (status != 0xfe)
+	{
+		ShowErrorCode(status);
+		return  SDCARD_RWFAIL;
+	}
+	if (buffer)
+	{
+		blockuniform = TRUE;
+		buffer[0] = xchg(0xff);
+		for (i=1; i<512; i++)
+		{
+			c = xchg(0xff);
+			buffer[i] = c;
+			if (c != buffer[0])  blockuniform = FALSE;
+		}
+	}
+	else
+	{
+		for (i=0; i<512; i++)  xchg(0xff);
+	}
+	xchg(0xff);							// ignore CRC
+	xchg(0xff);
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  ReadMultiCompare      read the next block of a CMD18 transfer and compare
+ *                        it with buffer as the bytes come in
+ *
+ *  same is set if every byte matched.  Returns SDCARD_RWFAIL only if the
+ *  block could not be read.
+ */
+static int8_t  ReadMultiCompare(const uint8_t  *buffer, uint8_t  *same)
+{
+	uint16_t					i;
+	uint8_t						status;
+	uint8_t						diff;
+
+	*same = FALSE;
+	status = sd_wait_for_data();
+	if (status != 0xfe)
+	{
+		ShowErrorCode(status);
+		return  SDCARD_RWFAIL;
+	}
+	diff = 0;
+	for (i=0; i<512; i++)
+	{
+		diff = diff | (xchg(0xff) ^ buffer[i]);
+	}
+	xchg(0xff);							// ignore CRC
+	xchg(0xff);
+	*same = (diff == 0);
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  ReadBlockCompare      read blocknum with CMD17 and compare it with buffer
+ *                        as it comes in; *same says whether it matched
+ */
+static int8_t  ReadBlockCompare(uint32_t  blocknum, const uint8_t  *buffer, uint8_t  *same)
+{
+	int8_t						r;
+
+	*same = FALSE;
+	r = SDCARD_RWFAIL;
+	if (sd_send_command(SD_READ_BLK, BlockAddr(blocknum)) == SDCARD_OK)
+	{
+		r = ReadMultiCompare(buffer, same);
+	}
+	deselect();
+	xchg(0xff);
+	return  r;
+}
+
+
+
+static int8_t  ReadMultiStop(void)
+{
+	int8_t						r;
+
+	r = sd_send_command(SD_STOP_TRANS, 0);
+	if (WaitNotBusy(tune.busy_ms) != SDCARD_OK)  r = SDCARD_RWFAIL;
+	deselect();
+	xchg(0xff);
+	return  (r == SDCARD_OK) ? SDCARD_OK : SDCARD_RWFAIL;
+}
+
+
+
+/*
+ *  WriteBlock      write one block with CMD24 and wait while the card
+ *                  programs it; the card is deselected on return
+ */
+static int8_t  WriteBlock(uint32_t  blocknum, const uint8_t  *buffer)
+{
+	uint16_t					i;
+	int8_t						r;
+
+	if (sd_send_command(SD_WRITE_BLK, BlockAddr(blocknum)) != SDCARD_OK)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	xchg(0xff);							// one byte gap before the token
+	xchg(0xfe);							// single-block data token
+	for (i=0; i<512; i++)  xchg(buffer[i]);
+	xchg(0xff);							// dummy CRC
+	xchg(0xff);
+	r = xchg(0xff);
+	TRACE_DATA(TRACE_DATA_OUT, r);
+	if ((r & 0x1f) == 0x05)  r = WaitNotBusy(tune.busy_ms);	// data response: accepted
+	else  r = SDCARD_RWFAIL;
+	deselect();
+	xchg(0xff);
+	return  r;
+}
+
+
+
+/*
+ *  WriteMultiStart      start a CMD25 write of count blocks at blocknum;
+ *                       ACMD23 first lets the card pre-erase them
+ */
+static int8_t  WriteMultiStart(uint32_t  blocknum, uint32_t  count)
+{
+	if (sd_send_command(SD_SET_WR_ERASE, count) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	if (sd_send_command(SD_WRITE_MULTI, BlockAddr(blocknum)) != SDCARD_OK)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	xchg(0xff);							// one byte gap before the first token
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  WriteMultiNext      send one block of a CMD25 write and wait while the
+ *                      card programs it; a NULL buffer sends zeros
+ */
+static int8_t  WriteMultiNext(const uint8_t  *buffer)
+{
+	if (WriteMultiSend(buffer) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	return  WaitNotBusy(tune.busy_ms);
+}
+
+
+
+/*
+ *  WriteMultiSend      send one block of a CMD25 write and check the data
+ *                      response; the card is left busy programming it
+ *
+ *  buffer is free again on return.  Wait with WaitNotBusy() before the
+ *  next block or the stop token.
+ */
+static int8_t  WriteMultiSend(const uint8_t  *buffer)
+{
+	uint16_t					i;
+
+	xchg(0xfc);							// multi-block data token
+	if (buffer)
+	{
+		for (i=0; i<512; i++)  xchg(buffer[i]);
+	}
+	else
+	{
+		for (i=0; i<512; i++)  xchg(0x00);
+	}
+	return  WriteMultiEnd(0xffff);			// CRC checking is off
+}
+
+
+
+/*
+ *  WriteMultiEnd      close a CMD25 data block whose token and 512 bytes
+ *                     have been sent: its CRC16, then the data response
+ *
+ *  The CRC is only checked by a card that CMD59 turned CRC checking on
+ *  for; the others take any value.
+ */
+static int8_t  WriteMultiEnd(uint16_t  crc)
+{
+	uint8_t						r;
+
+	xchg(crc >> 8);
+	xchg(crc & 0xff);
+	r = xchg(0xff);
+	TRACE_DATA(TRACE_DATA_OUT, r);
+	if ((r & 0x1f) != 0x05)				// data response: accepted
+	{
+		WriteMultiStop();
+		return  SDCARD_RWFAIL;
+	}
+	return  SDCARD_OK;
+}
+
+
+
+static int8_t  WriteMultiStop(void)
+{
+	int8_t						r;
+
+	xchg(0xfd);							// stop tran token
+	xchg(0xff);
+	TRACE_DATA(TRACE_STOP_TRAN, 0xfd);
+	r = WaitNotBusy(tune.busy_ms);
+	deselect();
+	xchg(0xff);
+	return  r;
+}
+
+
+
+
+/*
+ *  WaitNotBusy      clock the card until it releases DO (reads 0xff)
+ *
+ *  Skips the data response token a write leaves behind, then waits out the
+ *  busy (0x00) bytes.  The time spent busy is left in busytime.
+ */
+static int8_t  WaitNotBusy(uint16_t  timeout_ms)
+{
+	struct sdreq				q;
+
+	SDBegin(&q, SDREQ_NOT_BUSY, timeout_ms, NULL);
+	return  SDRun(&q);
+}
+
+
+
+/*
+ *  ReadSDStatus      read the 64-byte SD status (ACMD13) into block[]
+ */
+static int8_t  ReadSDStatus(void)
+{
+	uint8_t						i;
+	int8_t						r;
+
+	r = sd_send_command(SD_SEND_SD_STATUS, 0);
+	xchg(0xff);							// second byte of the R2 response
+	if (r != 0)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	if (sd_wait_for_data() != (int8_t)0xfe)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	for (i=0; i<64; i++)
+	{
+		block[i] = xchg(0xff);
+	}
+	xchg(0xff);							// burn the CRC
+	xchg(0xff);
+	deselect();
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  CardBlocks      return card capacity in 512-byte blocks, from csd[]
+ */
+static uint32_t  CardBlocks(void)
+{
+	uint32_t					csize;
+	uint8_t						shift;
+
+	if ((csd[0] >> 6) == 1)				// CSD version 2.0 (SDHC/SDXC)
+	{
+		csize = ((uint32_t)(csd[7] & 0x3f) << 16) | ((uint16_t)csd[8] << 8) | csd[9];
+		return  (csize + 1) << 10;
+	}
+	csize = ((uint16_t)(csd[6] & 0x03) << 10) | ((uint16_t)csd[7] << 2) | (csd[8] >> 6);
+	shift = (((csd[9] & 0x03) << 1) | (csd[10] >> 7)) + 2;		// C_SIZE_MULT+2
+	shift = shift + (csd[5] & 0x0f) - 9;						// READ_BL_LEN, in 512-byte blocks
+	return  (csize + 1) << shift;
+}
+
+
+
+/*
+ *  SPISetFast      switch the SPI clock between the 250 kHz-or-less init rate
+ *                  (F_CPU/128) and the fastest rate the card in use takes
+ *                  (F_CPU/2 unless its tune says less)
+ */
+static void  SPISetFast(uint8_t  fast)
+{
+	uint8_t				n;
+	uint8_t				spcr;
+
+	spifast = fast;
+	n = fast ? SPIShift(tune.spikhz) : 7;
+	spcr = (1<<SPE) | (1<<MSTR);
+	if (n >= 5)  spcr = spcr | (1<<SPR1);				// F_CPU/32 and slower
+	if ((n == 3) || (n == 4) || (n == 7))  spcr = spcr | (1<<SPR0);
+	SPCR = spcr;
+	if ((n & 1) && (n < 7))  SPSR = SPSR | (1<<SPI2X);	// F_CPU/2, /8, /32
+	else  SPSR = SPSR & ~(1<<SPI2X);
+}
+
+
+
+/*
+ *  SPIShift      the SPI clock as a shift of F_CPU (1 for F_CPU/2, up to 7
+ *                for F_CPU/128), the fastest at or under khz
+ */
+static uint8_t  SPIShift(uint16_t  khz)
+{
+	uint8_t				n;
+
+	for (n=1; n<7; n++)
+	{
+		if (((F_CPU / 1000UL) >> n) <= khz)  break;
+	}
+	return  n;
+}
+
+
+
+/*
+ *  CardTune      pick the SPI clock, timeouts and quirks for the card just
+ *                initialized
+ *
+ *  A card in the EEPROM cache gets what was learned for it.  Any other
+ *  card starts from its quirks[] entry and has its CID read again at each
+ *  clock from there down, until it comes back as it did at the init rate;
+ *  the clock found goes in the cache, over the card seen longest ago.
+ */
+static void  CardTune(void)
+{
+	uint8_t				saved[16];
+	uint8_t				i;
+	uint8_t				n;
+	uint8_t				crc;
+	int8_t				r;
+	uint32_t			key;
+
+	memcpy_P(&tune, &quirks[QUIRK_DEFAULT].tune, sizeof(tune));
+	tunesrc = TUNE_TABLE;
+	if (ReadCID() != SDCARD_OK)  return;
+	crc = 0;
+	for (i=0; i<15; i++)  crc = AddByteToCRC(crc, cid[i]);
+	if (((crc << 1) | 1) != cid[15])  return;		// even the init rate garbles it
+
+	key = crc32_update(0, cid, 16);
+	i = TuneCacheFind(key);
+	if (i < TUNE_CACHE_LEN)
+	{
+		tunesrc = TUNE_LEARNED;
+		TuneCacheAdd(key, i);						// now the most recently seen
+		return;
+	}
+
+	TuneQuirk();
+	memcpy(saved, cid, 16);
+	for (n=SPIShift(tune.spikhz); n<7; n++)
+	{
+		tune.spikhz = (F_CPU / 1000UL) >> n;
+		SPISetFast(TRUE);
+		r = ReadCID();
+		SPISetFast(FALSE);
+		if ((r == SDCARD_OK) && (memcmp(cid, saved, 16) == 0))  break;
+	}
+	if (n == 7)  tune.spikhz = (F_CPU / 1000UL) >> 7;	// only the init rate works
+	memcpy(cid, saved, 16);
+	TuneCacheAdd(key, TUNE_CACHE_LEN - 1);
+}
+
+
+
+/*
+ *  TuneQuirk      load tune from the quirks[] entry matching the CID in cid[]
+ */
+static void  TuneQuirk(void)
+{
+	uint8_t				i;
+
+	for (i=0; i<QUIRK_DEFAULT; i++)
+	{
+		if ((pgm_read_byte(&quirks[i].mid) == cid[0]) &&
+			(pgm_read_byte(&quirks[i].oid[0]) == cid[1]) &&
+			(pgm_read_byte(&quirks[i].oid[1]) == cid[2]))  break;
+	}
+	memcpy_P(&tune, &quirks[i].tune, sizeof(tune));
+}
+
+
+
+/*
+ *  TuneCacheFind      load tune from the EEPROM cache entry for key;
+ *                     returns its slot, or TUNE_CACHE_LEN if there is none
+ */
+static uint8_t  TuneCacheFind(uint32_t  key)
+{
+	uint8_t				i;
+	struct tunecache	e;
+
+	for (i=0; i<TUNE_CACHE_LEN; i++)
+	{
+		eeprom_read_block(&e, &tunecache[i], sizeof(e));
+		if ((e.key == key) && (e.tune.spikhz != 0) && (e.tune.spikhz != 0xffff))	// erased EEPROM
+		{
+			tune = e.tune;
+			break;
+		}
+	}
+	return  i;
+}
+
+
+
+/*
+ *  TuneCacheAdd      store tune for key as the first cache entry, moving
+ *                    the entries before slot down one (slot is dropped)
+ *
+ *  eeprom_update_block() only writes bytes that change, so a card used
+ *  over and over costs no EEPROM wear.
+ */
+static void  TuneCacheAdd(uint32_t  key, uint8_t  slot)
+{
+	struct tunecache	e;
+
+	for (; slot>0; slot--)
+	{
+		eeprom_read_block(&e, &tunecache[slot-1], sizeof(e));
+		eeprom_update_block(&e, &tunecache[slot], sizeof(e));
+	}
+	e.key = key;
+	e.tune = tune;
+	eeprom_update_block(&e, &tunecache[0], sizeof(e));
+}
+
+
+
+/*
+ *  Random32      xorshift32 pseudo-random number generator
+ */
+static uint32_t  Random32(void)
+{
+	randstate ^= randstate << 13;
+	randstate ^= randstate >> 17;
+	randstate ^= randstate << 5;
+	return  randstate;
+}
+
+
+
+/*
+ *  Bench      measure the card and print a min/median/max table
+ *
+ *  All tests are read-only.  The CMD42 test sends an unlock with an empty
+ *  password, which the card rejects without changing anything, and times
+ *  the busy period that follows.  Measurements run at the card's fast SPI clock.
+ */
+static void  Bench(void)
+{
+	uint32_t					samples[BENCH_SAMPLES];
+	uint32_t					blocks;
+	uint32_t					t;
+	uint8_t						n;
+	uint8_t						i;
+	static const uint8_t		speed_class[8] PROGMEM = {0, 2, 4, 6, 10, 0, 0, 0};
+
+	if (ReadCSD() != SDCARD_OK)
+	{
+		printf_P(PSTR("failed; unable to read CSD."));
+		return;
+	}
+	blocks = CardBlocks();
+	if (blocks == 0)  blocks = 1;
+
+	if (ReadSDStatus() == SDCARD_OK)
+	{
+		printf_P(PSTR("\r\nSpeed class %d, UHS grade %d, AU %u KB, erase %u AU in %d s"),
+			pgm_read_byte(&speed_class[block[8] & 0x07]), block[14] >> 4,
+			pgm_read_word(&au_kb[block[10] >> 4]),
+			((uint16_t)block[11] << 8) | block[12], block[13] >> 2);
+	}
+	else
+	{
+		printf_P(PSTR("\r\nUnable to read SD status."));
+	}
+	printf_P(PSTR("\r\nCapacity %lu blocks, SPI clock %lu kHz"), blocks,
+		(F_CPU / 1000UL) >> SPIShift(tune.spikhz));
+	printf_P(PSTR("\r\n                min      med      max"));
+
+	SPISetFast(TRUE);
+
+	for (n=0; n<BENCH_SAMPLES; n++)			// sequential CMD18, KB/s per run
+	{
+		t = timer_us();
+		if (ReadMultiStart((uint32_t)n * BENCH_SEQ_BLOCKS) != SDCARD_OK)  break;
+		for (i=0; i<BENCH_SEQ_BLOCKS; i++)
+		{
+			if (ReadMultiNext(NULL) != SDCARD_OK)  break;
+		}
+		ReadMultiStop();
+		if (i != BENCH_SEQ_BLOCKS)  break;
+		t = timer_us() - t;
+		samples[n] = (BENCH_SEQ_BLOCKS * 512UL * 1000UL) / (t ? t : 1);		// bytes/ms = KB/s
+	}
+	if (n == BENCH_SAMPLES)  ShowStats(PSTR("seq CMD18"), samples, PSTR("KB/s"));
+	else  printf_P(PSTR("\r\nseq CMD18    failed"));
+
+	randstate = timer_us() | 1;
+	for (n=0; n<BENCH_SAMPLES; n++)			// random CMD17, us per read
+	{
+		t = timer_us();
+		if (ReadBlock(Random32() % blocks, block) != SDCARD_OK)  break;
+		samples[n] = timer_us() - t;
+	}
+	if (n == BENCH_SAMPLES)
+	{
+		ShowStats(PSTR("rnd CMD17"), samples, PSTR("us"));
+		printf_P(PSTR(" (%lu IOPS)"), 1000000UL / (samples[BENCH_SAMPLES/2] ? samples[BENCH_SAMPLES/2] : 1));
+	}
+	else  printf_P(PSTR("\r\nrnd CMD17    failed"));
+
+	for (n=0; n<BENCH_SAMPLES; n++)			// CMD13 round trip
+	{
+		t = timer_us();
+		ReadCardStatus();
+		samples[n] = timer_us() - t;
+	}
+	ShowStats(PSTR("CMD13"), samples, PSTR("us"));
+
+	for (n=0; n<BENCH_SAMPLES; n++)			// CMD42 busy time
+	{
+		ModifyPWD(0, 0);					// no password, leaves pwd[] alone
+		samples[n] = busytime;
+		ReadCardStatus();					// clears LOCK_UNLOCK_FAILED
+	}
+	ShowStats(PSTR("CMD42 busy"), samples, PSTR("us"));
+
+	SPISetFast(FALSE);
+}
+
+
+
+/*
+ *  SparseDump      send count blocks from first as binary frames, then a
+ *                  FRAME_END that says how far it got, so a host can
+ *                  resume after a read error
+ */
+static void  SparseDump(uint32_t  first, uint32_t  count)
+{
+	uint32_t					n;
+
+	SPISetFast(TRUE);
+	n = DumpRange(first, count);
+	SPISetFast(FALSE);
+
+	frame_begin(FRAME_END, 1, first + n);
+	frame_byte(n == count ? FRAME_OK : FRAME_RDERR);
+	frame_end();
+}
+
+
+
+/*
+ *  DumpRange      send count blocks from first as frames; returns the
+ *                 number of blocks read before any error
+ *
+ *  Blocks are read with one CMD18.  A block whose bytes are all the same
+ *  (typically 0x00 or 0xff) is not sent; consecutive ones with the same
+ *  fill are merged into a single FRAME_FILL run, cut at FILL_RUN_MAX so
+ *  the host keeps hearing from us.  Other blocks go out LZ-packed, or as
+ *  FRAME_DATA when packing does not help.
+ */
+static uint32_t  DumpRange(uint32_t  first, uint32_t  count)
+{
+	uint32_t					n;
+	uint32_t					runstart;
+	uint32_t					runlen;
+	uint8_t						runfill;
+
+	if (count == 0)  return  0;
+	if (ReadMultiStart(first) != SDCARD_OK)  return  0;
+
+	runstart = first;
+	runlen = 0;
+	runfill = 0;
+	for (n=0; n<count; n++)
+	{
+		if (ReadMultiNext(block) != SDCARD_OK)  break;
+		if (blockuniform)
+		{
+			if (runlen && (block[0] == runfill) && (runlen < FILL_RUN_MAX))
+			{
+				runlen++;
+				continue;
+			}
+			SendFillRun(runstart, runlen, runfill);
+			runstart = first + n;
+			runlen = 1;
+			runfill = block[0];
+			continue;
+		}
+		SendFillRun(runstart, runlen, runfill);
+		runlen = 0;
+		frame_block(first + n, block);
+	}
+	ReadMultiStop();
+	SendFillRun(runstart, runlen, runfill);
+	return  n;
+}
+
+
+
+static void  SendFillRun(uint32_t  start, uint32_t  len, uint8_t  fill)
+{
+	if (len == 0)  return;
+	frame_begin(FRAME_FILL, 5, start);
+	frame_dword(len);
+	frame_byte(fill);
+	frame_end();
+}
+
+
+
+/*
+ *  Stream      windowed, acknowledged dump of count blocks from first
+ *
+ *  The frames are those of d.  The host answers with FRAME_ACK, giving the
+ *  first block it does not have yet, and with FRAME_RESEND for a frame it
+ *  lost or got corrupted; at most window frames are out unacknowledged.
+ *  If the host goes quiet the oldest frame is sent again every
+ *  STREAM_RETRY_MS, and after STREAM_GIVEUP_MS the dump ends with
+ *  FRAME_ABORTED.  FRAME_END gives the first block the host may not have,
+ *  so it resumes by starting the next dump there.
+ */
+static void  Stream(uint32_t  first, uint32_t  count, uint8_t  window)
+{
+	struct stream				s;
+	uint32_t					next;
+	uint32_t					end;
+	uint32_t					runstart;
+	uint16_t					runlen;
+	uint8_t						runfill;
+	uint8_t						reading;
+	uint8_t						status;
+	uint8_t						type;
+	uint32_t					arg;
+
+	if (window < 2)  window = 2;				// room for a fill run and the block that ends it
+	s.head = 0;
+	s.used = 0;
+	s.acked = first;
+	next = first;
+	end = first + count;
+	runstart = first;
+	runlen = 0;
+	runfill = 0;
+	reading = FALSE;
+	status = FRAME_OK;
+
+	SPISetFast(TRUE);
+	while (s.acked < end)
+	{
+		type = 0;
+		while ((type == 0) && uart_pending_data())
+		{
+			type = frame_recv(getchar(), &arg);
+		}
+		if (type == FRAME_CANCEL)
+		{
+			status = FRAME_ABORTED;
+			break;
+		}
+		if (type == FRAME_ACK)
+		{
+			StreamAck(&s, arg);
+		}
+		if (s.used && ((timer_ms() - s.tack) > STREAM_GIVEUP_MS))
+		{
+			status = FRAME_ABORTED;
+			break;
+		}
+		if ((type == FRAME_RESEND) || (s.used && ((timer_ms() - s.tretry) > STREAM_RETRY_MS)))
+		{
+			if (reading)								// a single read needs CMD18 stopped
+			{
+				ReadMultiStop();
+				reading = FALSE;
+			}
+			if (type != FRAME_RESEND)  arg = s.ring[s.head].block;
+			if (StreamResend(&s, arg) != SDCARD_OK)
+			{
+				status = FRAME_RDERR;
+				break;
+			}
+			continue;
+		}
+
+		if ((next == end) || (s.used + 2 > window))  continue;
+		if (!reading)
+		{
+			reading = (ReadMultiStart(next) == SDCARD_OK);
+		}
+		if (!reading || (ReadMultiNext(block) != SDCARD_OK))
+		{
+			if (reading)  ReadMultiStop();
+			reading = FALSE;
+			status = FRAME_RDERR;
+			end = next;									// deliver what was read, then stop
+		}
+		else if (blockuniform && runlen && (block[0] == runfill) && (runlen < FILL_RUN_MAX))
+		{
+			runlen++;
+			next++;
+		}
+		else
+		{
+			if (runlen)  StreamPush(&s, runstart, runlen, runfill);
+			runlen = 0;
+			if (blockuniform)
+			{
+				runstart = next;
+				runlen = 1;
+				runfill = block[0];
+			}
+			else
+			{
+				StreamPush(&s, next, 0, 0);
+			}
+			next++;
+		}
+		if ((next == end) && runlen)
+		{
+			StreamPush(&s, runstart, runlen, runfill);
+			runlen = 0;
+		}
+	}
+	if (reading)  ReadMultiStop();
+	SPISetFast(FALSE);
+
+	frame_begin(FRAME_END, 1, s.acked < end ? s.acked : end);
+	frame_byte(status);
+	frame_end();
+}
+
+
+
+/*
+ *  StreamPush      send a new frame of a windowed dump and keep it in the
+ *                  ring; count 0 sends the block buffer, else a fill run
+ */
+static void  StreamPush(struct stream  *s, uint32_t  blocknum, uint16_t  count, uint8_t  fill)
+{
+	struct streamframe			*f;
+
+	f = &s->ring[(s->head + s->used) % STREAM_WINDOW_MAX];
+	f->block = blocknum;
+	f->count = count;
+	f->fill = fill;
+	if (s->used++ == 0)							// the clocks run while frames are out
+	{
+		s->tack = timer_ms();
+		s->tretry = s->tack;
+	}
+	if (count)  SendFillRun(blocknum, count, fill);
+	else  frame_block(blocknum, block);
+}
+
+
+
+/*
+ *  StreamAck      the host has every block before acked; drop the frames it
+ *                 covers from the ring
+ */
+static void  StreamAck(struct stream  *s, uint32_t  acked)
+{
+	struct streamframe			*f;
+
+	if (acked <= s->acked)  return;				// a repeat, or overtaken
+	s->acked = acked;
+	s->tack = timer_ms();
+	s->tretry = s->tack;
+	while (s->used)
+	{
+		f = &s->ring[s->head];
+		if ((f->block + (f->count ? f->count : 1)) > acked)  break;
+		s->head = (s->head + 1) % STREAM_WINDOW_MAX;
+		s->used--;
+	}
+}
+
+
+
+/*
+ *  StreamResend      send the frame starting at blocknum again, reading a
+ *                    data block back from the card; a frame no longer in
+ *                    the ring has been acknowledged and is ignored
+ */
+static int8_t  StreamResend(struct stream  *s, uint32_t  blocknum)
+{
+	struct streamframe			*f;
+	uint8_t						i;
+	int8_t						r;
+
+	s->tretry = timer_ms();
+	for (i=0; i<s->used; i++)
+	{
+		f = &s->ring[(s->head + i) % STREAM_WINDOW_MAX];
+		if (f->block != blocknum)  continue;
+		if (f->count)
+		{
+			SendFillRun(f->block, f->count, f->fill);
+			return  SDCARD_OK;
+		}
+		r = ReadBlock(f->block, block);
+		if (r == SDCARD_OK)  frame_block(f->block, block);
+		return  r;
+	}
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  DeltaDump      send count blocks from first as d does, unless their
+ *                 CRC-32 is crc; then only a FRAME_END with FRAME_UNCHANGED
+ *                 goes out
+ *
+ *  The host keeps a digest per chunk of its last image, so re-imaging a
+ *  card costs a read of every chunk on the board but only the changed
+ *  chunks on the serial line.  A changed chunk is read twice, once to
+ *  hash it and once to send it, as there is no room to keep it.
+ */
+static void  DeltaDump(uint32_t  first, uint32_t  count, uint32_t  crc)
+{
+	uint32_t					n;
+	uint32_t					c;
+	uint8_t						status;
+
+	SPISetFast(TRUE);
+	c = 0;
+	n = 0;
+	if ((count > 0) && (ReadMultiStart(first) == SDCARD_OK))
+	{
+		for (n=0; n<count; n++)
+		{
+			if (ReadMultiNext(block) != SDCARD_OK)  break;
+			c = crc32_update(c, block, 512);
+		}
+		ReadMultiStop();
+	}
+	if (n < count)
+	{
+		status = FRAME_RDERR;
+	}
+	else if (c == crc)
+	{
+		status = FRAME_UNCHANGED;
+	}
+	else
+	{
+		n = DumpRange(first, count);
+		status = (n == count) ? FRAME_OK : FRAME_RDERR;
+	}
+	SPISetFast(FALSE);
+
+	frame_begin(FRAME_END, 1, first + n);
+	frame_byte(status);
+	frame_end();
+}
+
+
+
+/*
+ *  FsDump      send the MBR, file system metadata and allocated clusters
+ *              of every FAT16/FAT32/exFAT volume as frames (see fsdump.c),
+ *              then a FRAME_END for the whole card
+ */
+static void  FsDump(void)
+{
+	uint32_t					total;
+	int8_t						r;
+
+	total = CardBlocks();
+	SPISetFast(TRUE);
+	r = fs_dump(total, block);
+	SPISetFast(FALSE);
+
+	frame_begin(FRAME_END, 1, total);
+	frame_byte(r == 0 ? FRAME_OK : FRAME_RDERR);
+	frame_end();
+}
+
+
+
+/*
+ *  Block I/O for fs_dump()
+ */
+int8_t  fs_read_block(uint32_t  blocknum, uint8_t  *buf)
+{
+	return  (ReadBlock(blocknum, buf) == SDCARD_OK) ? 0 : -1;
+}
+
+
+
+int8_t  fs_send_range(uint32_t  first, uint32_t  count)
+{
+	return  (DumpRange(first, count) == count) ? 0 : -1;
+}
+
+
+
+void  fs_send_zero(uint32_t  first, uint32_t  count)
+{
+	while (count)
+	{
+		SendFillRun(first, count < FILL_RUN_MAX ? count : FILL_RUN_MAX, 0);
+		first += FILL_RUN_MAX;
+		count = count < FILL_RUN_MAX ? 0 : count - FILL_RUN_MAX;
+	}
+}
+
+
+
+void  fs_send_copy(uint32_t  from, uint32_t  to, uint32_t  count)
+{
+	frame_begin(FRAME_COPY, 8, to);
+	frame_dword(from);
+	frame_dword(count);
+	frame_end();
+}
+
+
+/*
+ *  Format      partition and quick-format the card for its CSD capacity,
+ *              aligned to the AU from the SD status (see fsformat.c)
+ */
+static int8_t  Format(void)
+{
+	uint32_t					total;
+	uint32_t					start;
+	int8_t						r;
+
+	if (ReadCSD() != SDCARD_OK)
+	{
+		printf_P(PSTR("failed; unable to read CSD."));
+		return  SDCARD_RWFAIL;
+	}
+	total = CardBlocks();
+	start = timer_ms();
+	SPISetFast(TRUE);
+	r = fs_format(total, AUBlocks(), Random32() ^ timer_us(), block);
+	SPISetFast(FALSE);
+	if (r < 0)
+	{
+		printf_P(PSTR("failed."));
+		return  SDCARD_RWFAIL;
+	}
+	printf_P(PSTR("done, %S in %lu ms."), r == FMT_EXFAT ? PSTR("exFAT") : PSTR("FAT32"),
+		timer_ms() - start);
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  EraseRange      erase blocks first..last with CMD32/CMD33/CMD38
+ *
+ *  The range is cut at AU boundaries into runs of ERASE_SIZE AUs, the
+ *  unit the SD status gives an erase timeout for, so each CMD38 can be
+ *  busy-polled against a known limit.  A card whose CSD says it cannot
+ *  erase single blocks (ERASE_BLK_EN = 0, SDSC only) has the ends that
+ *  are not whole erase sectors written with zeros instead.  The runs go
+ *  on from the main loop (EraseRun(), EraseNext()).
+ */
+static void  EraseRange(uint32_t  first, uint32_t  last)
+{
+	uint32_t					au;
+	uint32_t					chunk;
+	uint32_t					group;
+	uint32_t					start;
+	uint32_t					end;
+	uint16_t					timeout;
+	uint8_t						n;
+	int8_t						r;
+	struct erasejob				*e;
+
+	if ((ReadCSD() != SDCARD_OK) || (last < first) || (last >= CardBlocks()))
+	{
+		printf_P(PSTR("failed; bad block range."));
+		return;
+	}
+	au = AUBlocks();
+	chunk = 0;
+	timeout = ERASE_AU_MS;
+	if (au)
+	{
+		chunk = au * (((uint16_t)block[11] << 8) | block[12]);		// ERASE_SIZE AUs
+		n = (block[13] >> 2) + (block[13] & 0x03);					// ERASE_TIMEOUT + ERASE_OFFSET, s
+		if (chunk && n)  timeout = (n > 65) ? 65000 : n * 1000U;
+		else  chunk = 0;
+	}
+	if (au == 0)  au = FMT_ALIGN_MIN;
+	if (chunk == 0)  chunk = au;
+
+	group = 1;
+	if ((csd[10] & 0x40) == 0)			// ERASE_BLK_EN clear: erase whole SECTOR_SIZE units
+	{
+		group = ((((uint32_t)csd[10] & 0x3f) << 1) | (csd[11] >> 7)) + 1;
+	}
+
+	start = (first + group - 1) / group * group;	// whole erase sectors: start .. end-1
+	end = (last + 1) / group * group;
+	if (start >= end)  start = end = last + 1;
+
+	e = &cardjob.u.erase;
+	e->t0 = timer_ms();
+	e->tdot = e->t0;
+	e->maxbusy = 0;
+	e->start = start;
+	e->end = end;
+	e->chunk = chunk;
+	e->timeout = timeout;
+	r = SDCARD_OK;
+	SPISetFast(TRUE);
+	if (start > first)  r = ZeroBlocks(first, start - first);
+	if ((r == SDCARD_OK) && (end <= last))  r = ZeroBlocks(end, last + 1 - end);
+	if (r != SDCARD_OK)
+	{
+		SPISetFast(FALSE);
+		printf_P(PSTR("failed near block %lu."), start);
+		return;
+	}
+	EraseRun();
+}
+
+
+
+/*
+ *  EraseRun      start the CMD32/CMD33/CMD38 of the next run of an erase
+ *                and a request to wait out its busy, or end the erase
+ */
+static void  EraseRun(void)
+{
+	struct erasejob				*e;
+
+	e = &cardjob.u.erase;
+	if (cardjob.abort || (e->start >= e->end))
+	{
+		SPISetFast(FALSE);
+		if (e->start < e->end)  printf_P(PSTR("stopped at block %lu."), e->start);
+		else  printf_P(PSTR("done in %lu ms, longest busy %lu ms."), timer_ms() - e->t0, e->maxbusy / 1000);
+		return;
+	}
+	e->last = (e->start / e->chunk + 1) * e->chunk;
+	if (e->last > e->end)  e->last = e->end;
+	if (EraseStart(e->start, e->last - 1) != SDCARD_OK)
+	{
+		SPISetFast(FALSE);
+		printf_P(PSTR("failed near block %lu."), e->start);
+		return;
+	}
+	SDBegin(&cardreq, SDREQ_NOT_BUSY, e->timeout, NULL);	// EraseNext() when done
+}
+
+
+
+/*
+ *  EraseNext      end an erase run once the card is no longer busy
+ */
+static void  EraseNext(int8_t  r)
+{
+	struct erasejob				*e;
+
+	e = &cardjob.u.erase;
+	deselect();
+	xchg(0xff);
+	if (r != SDCARD_OK)
+	{
+		SPISetFast(FALSE);
+		printf_P(PSTR("failed near block %lu."), e->start);
+		return;
+	}
+	if (busytime > e->maxbusy)  e->maxbusy = busytime;
+	if ((timer_ms() - e->tdot) > 1000)
+	{
+		printf_P(PSTR("."));
+		e->tdot = timer_ms();
+	}
+	e->start = e->last;
+	EraseRun();
+}
+
+
+
+/*
+ *  EraseStart      one CMD32/CMD33/CMD38 sequence; the card is left
+ *                  selected and busy with the erase
+ */
+static int8_t  EraseStart(uint32_t  first, uint32_t  last)
+{
+	if (sd_send_command(SD_ERASE_START, BlockAddr(first)) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	if (sd_send_command(SD_ERASE_END, BlockAddr(last)) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	if (sd_send_command(SD_ERASE, 0) != SDCARD_OK)
+	{
+		deselect();
+		return  SDCARD_RWFAIL;
+	}
+	return  SDCARD_OK;
+}
+
+
+
+/*
+ *  ZeroBlocks      write count zero blocks from first
+ */
+static int8_t  ZeroBlocks(uint32_t  first, uint32_t  count)
+{
+	if (WriteMultiStart(first, count) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	while (count--)
+	{
+		if (WriteMultiNext(NULL) != SDCARD_OK)  return  SDCARD_RWFAIL;
+	}
+	return  WriteMultiStop();
+}
+
+
+
+/*
+ *  Wipe      overwrite blocks first..last with a pattern and verify it
+ *
+ *  Works in WIPE_CHUNK passes: the pattern is generated into block[] and
+ *  written with ACMD23 + CMD25, then the same blocks are read back with
+ *  CMD18 and compared against the pattern generated again.  Only a dot
+ *  per pass and the first WIPE_MAX_LISTED bad blocks are printed.
+ */
+static void  Wipe(uint32_t  first, uint32_t  last, uint8_t  mode)
+{
+	uint32_t					seed;
+	uint32_t					start;
+	uint32_t					count;
+	uint32_t					n;
+	uint32_t					bad;
+	uint32_t					t0;
+	uint32_t					w;
+	uint16_t					i;
+	int8_t						r;
+
+	if ((ReadCSD() != SDCARD_OK) || (last < first) || (last >= CardBlocks()))
+	{
+		printf_P(PSTR("failed; bad block range."));
+		return;
+	}
+	seed = Random32() ^ timer_us();
+	if (mode == WIPE_RANDOM)  printf_P(PSTR("pattern seed %08lX"), seed);
+
+	bad = 0;
+	t0 = timer_ms();
+	SPISetFast(TRUE);
+	for (start=first; start<=last; start+=count)
+	{
+		count = last - start + 1;
+		if (count > WIPE_CHUNK)  count = WIPE_CHUNK;
+
+		r = WriteMultiStart(start, count);
+		for (n=0; (r == SDCARD_OK) && (n<count); n++)
+		{
+			PatternStart(start + n, seed);
+			for (i=0; i<512; i+=4)
+			{
+				w = PatternWord(mode);
+				memcpy(block + i, &w, 4);
+			}
+			r = WriteMultiNext(block);
+		}
+		if (r == SDCARD_OK)  r = WriteMultiStop();
+		if (r != SDCARD_OK)
+		{
+			SPISetFast(FALSE);
+			printf_P(PSTR("\r\nWrite failed near block %lu; wipe stopped."), start + n);
+			return;
+		}
+
+		r = ReadMultiStart(start);
+		for (n=0; n<count; n++)
+		{
+			if ((r != SDCARD_OK) || (ReadMultiNext(block) != SDCARD_OK))
+			{
+				if (r == SDCARD_OK)  ReadMultiStop();
+				r = ReadMultiStart(start + n + 1);		// carry on past the bad block
+			}
+			else
+			{
+				PatternStart(start + n, seed);
+				for (i=0; i<512; i+=4)
+				{
+					w = PatternWord(mode);
+					if (memcmp(block + i, &w, 4))  break;
+				}
+				if (i == 512)  continue;
+			}
+			if (bad < WIPE_MAX_LISTED)
+			{
+				printf_P(PSTR("\r\nMismatch in block %lu"), start + n);
+			}
+			bad++;
+		}
+		if (r == SDCARD_OK)  ReadMultiStop();
+		printf_P(PSTR("."));
+	}
+	SPISetFast(FALSE);
+
+	t0 = timer_ms() - t0;
+	printf_P(PSTR("\r\n%lu blocks in %lu ms"), last - first + 1, t0);
+	if (bad)  printf_P(PSTR(", verify failed: %lu bad block(s)."), bad);
+	else  printf_P(PSTR(", verified."));
+}
+
+
+
+/*
+ *  PatternStart      seed the wipe pattern for blocknum
+ *
+ *  Each block gets its own xorshift state, so a block's pattern can be
+ *  generated again for the read-back without keeping a copy.
+ */
+static void  PatternStart(uint32_t  blocknum, uint32_t  seed)
+{
+	randstate = seed ^ (blocknum * 0x9e3779b9UL);
+	if (randstate == 0)  randstate = 1;
+}
+
+
+
+/*
+ *  PatternWord      next four bytes of the wipe pattern
+ */
+static uint32_t  PatternWord(uint8_t  mode)
+{
+	if (mode == WIPE_ZEROS)  return  0;
+	if (mode == WIPE_ONES)  return  0xffffffffUL;
+	return  Random32();
+}
+
+
+
+/*
+ *  Clone      copy count blocks from first (count 0: to the end of the card)
+ *             from the card in the main socket to the one in the second
+ *             socket, then optionally read both back and compare
+ *
+ *  Works in CLONE_CHUNK passes, a dot each.  Each block is read from
+ *  the source with CMD17 into block[], then written to the target with
+ *  CMD24, so the copy never touches the UART.  Both commands end, the
+ *  write's busy included, before the other card is selected; the cards
+ *  share the bus and neither is left inside a transfer.
+ */
+static void  Clone(uint32_t  first, uint32_t  count, uint8_t  verify)
+{
+	uint32_t					blocks;
+	uint32_t					start;
+	uint32_t					len;
+	uint32_t					done;
+	uint32_t					bad;
+	uint32_t					t0;
+	int8_t						r;
+
+	if (ReadCSD() != SDCARD_OK)
+	{
+		printf_P(PSTR("failed; unable to read the source CSD."));
+		return;
+	}
+	blocks = CardBlocks();
+	if (count == 0)  count = blocks - first;
+	if ((first >= blocks) || (count > blocks - first))
+	{
+		printf_P(PSTR("failed; bad block range."));
+		return;
+	}
+
+	SDSlot(SLOT_SECOND);
+	r = SDInit();
+	if (r == SDCARD_OK)  r = ReadCSD();
+	if (r == SDCARD_OK)  r = ReadCardStatus();
+	if (r != SDCARD_OK)
+	{
+		SDSlot(SLOT_MAIN);
+		printf_P(PSTR("failed; no card in socket 2."));
+		return;
+	}
+	if (cardstatus[1] & 0x01)
+	{
+		SDSlot(SLOT_MAIN);
+		printf_P(PSTR("failed; the card in socket 2 is locked."));
+		return;
+	}
+	if (first + count > CardBlocks())
+	{
+		SDSlot(SLOT_MAIN);
+		printf_P(PSTR("failed; the card in socket 2 is too small."));
+		return;
+	}
+	SDSlot(SLOT_MAIN);
+
+	bad = 0;
+	t0 = timer_ms();
+	SPISetFast(TRUE);
+	for (start=first; start<first+count; start+=len)
+	{
+		len = first + count - start;
+		if (len > CLONE_CHUNK)  len = CLONE_CHUNK;
+
+		done = CloneCopy(start, len);
+		if (done != len)
+		{
+			SDSlot(SLOT_MAIN);
+			SPISetFast(FALSE);
+			printf_P(PSTR("\r\nCopy failed near block %lu; clone stopped."), start + done);
+			return;
+		}
+		if (verify)  bad = CloneVerify(start, len, bad);
+		printf_P(PSTR("."));
+	}
+	SDSlot(SLOT_MAIN);
+	SPISetFast(FALSE);
+
+	t0 = timer_ms() - t0;
+	printf_P(PSTR("\r\n%lu blocks in %lu ms (%lu KB/s)"), count, t0,
+		(uint32_t)(((uint64_t)count * 500) / (t0 ? t0 : 1)));		// count * 500 passes 32 bits at 4 GB
+	if (!verify)  printf_P(PSTR(", not verified."));
+	else if (bad)  printf_P(PSTR(", verify failed: %lu bad block(s)."), bad);
+	else  printf_P(PSTR(", verified."));
+}
+
+
+
+/*
+ *  CloneCopy      copy count blocks at first, source to target
+ *
+ *  Returns the number of blocks written, count if all went well.  Ends
+ *  with the main socket current.
+ */
+static uint32_t  CloneCopy(uint32_t  first, uint32_t  count)
+{
+	uint32_t					n;
+	int8_t						r;
+
+	for (n=0; n<count; n++)
+	{
+		if (ReadBlock(first + n, block) != SDCARD_OK)  break;
+		SDSlot(SLOT_SECOND);
+		r = WriteBlock(first + n, block);
+		SDSlot(SLOT_MAIN);
+		if (r != SDCARD_OK)  break;
+	}
+	return  n;
+}
+
+
+
+/*
+ *  CloneVerify      read count blocks at first back from both cards and
+ *                   compare them; returns bad plus the blocks that differ
+ *
+ *  Each block is read from the source into block[] with CMD17, then read
+ *  from the target with CMD17 and compared as it comes in.  A block that
+ *  cannot be read on either card counts as bad.
+ */
+static uint32_t  CloneVerify(uint32_t  first, uint32_t  count, uint32_t  bad)
+{
+	uint32_t					n;
+	uint8_t						same;
+
+	for (n=0; n<count; n++)
+	{
+		same = FALSE;
+		if (ReadBlock(first + n, block) == SDCARD_OK)
+		{
+			SDSlot(SLOT_SECOND);
+			ReadBlockCompare(first + n, block, &same);
+			SDSlot(SLOT_MAIN);
+		}
+		if (!same)
+		{
+			if (bad < WIPE_MAX_LISTED)
+			{
+				printf_P(PSTR("\r\nMismatch in block %lu"), first + n);
+			}
+			bad++;
+		}
+	}
+	return  bad;
+}
+
+
+
+/*
+ *  Upload      write count blocks from first with the count * 512 bytes
+ *              the host sends right after the command line
+ *
+ *  The UART receive interrupt puts the data straight into block[], used
+ *  as two halves: one is clocked out to the card while the other fills.
+ *  When both are full, which happens while the card is busy programming
+ *  a block, the host is stopped (XOFF, or RTS in a make FLOW=rts build),
+ *  and it is started again once the busy token has cleared and a half
+ *  has gone to the card.  If the card cannot be written the data is
+ *  still read and dropped, so none of it is taken for console commands.
+ *
+ *  Half a block is already on the card when the host may stop, so CRC
+ *  checking is on (CMD59) for the write: a block the host did not finish
+ *  is closed with a wrong CRC16, which the card refuses, instead of being
+ *  padded and programmed.  The blocks after the last one written were
+ *  pre-erased by ACMD23 and may now read as erased.
+ */
+static void  Upload(uint32_t  first, uint32_t  count)
+{
+	uint32_t					n;
+	uint32_t					failed;
+	uint32_t					t0;
+	uint16_t					i;
+	uint16_t					lost;
+	uint16_t					crc;
+	uint8_t						half;
+	uint8_t						started;
+	int8_t						r;
+
+	uart_sink_start(block, sizeof(block), count * 512UL);
+	t0 = timer_ms();
+
+	r = ReadCSD();
+	if (r == SDCARD_OK)  r = ReadCardStatus();
+	if ((r != SDCARD_OK) || (cardstatus[1] & 0x01) || (count == 0) ||
+		(first >= CardBlocks()) || (count > CardBlocks() - first))
+	{
+		r = SDCARD_NO_DETECT;				// nothing is written; the data is dropped
+	}
+	SPISetFast(TRUE);
+	failed = first;
+	started = FALSE;
+	if (r == SDCARD_OK)
+	{
+		started = TRUE;
+		if (sd_send_command(SD_CRC_ON_OFF, 1) != SDCARD_OK)  r = SDCARD_RWFAIL;
+	}
+	if (r == SDCARD_OK)  r = WriteMultiStart(first, count);
+
+	half = 2;
+	crc = 0;
+	for (n=0; n<count; n++)
+	{
+		for (half=0; half<2; half++)
+		{
+			if (UploadWait() != SDCARD_OK)  break;		// the host stopped sending
+			if (r == SDCARD_OK)
+			{
+				if (half == 0)
+				{
+					xchg(0xfc);				// multi-block data token
+					crc = 0;
+				}
+				for (i=0; i<UPLOAD_HALF; i++)
+				{
+					xchg(block[half * UPLOAD_HALF + i]);
+					crc = _crc_xmodem_update(crc, block[half * UPLOAD_HALF + i]);
+				}
+			}
+			uart_sink_take(UPLOAD_HALF);	// may start the host again
+		}
+		if (half == 0)  break;				// the host stopped before this block
+		if (r == SDCARD_OK)					// else keep reading and drop the data
+		{
+			if (half == 1)					// the host stopped mid-block; finish it
+			{								// with a CRC the card refuses
+				for (i=0; i<UPLOAD_HALF; i++)
+				{
+					xchg(0xff);
+					crc = _crc_xmodem_update(crc, 0xff);
+				}
+				crc = ~crc;
+			}
+			r = WriteMultiEnd(crc);			// stops the write if refused
+			if (r == SDCARD_OK)
+			{
+				r = WaitNotBusy(tune.busy_ms);
+				if (r != SDCARD_OK)  WriteMultiStop();
+			}
+			if (r != SDCARD_OK)  failed = first + n;
+		}
+		if (half < 2)  break;
+	}
+	if ((r == SDCARD_OK) && (WriteMultiStop() != SDCARD_OK))
+	{
+		r = SDCARD_RWFAIL;
+		failed = first + n - 1;
+	}
+	if (started)  sd_send_command(SD_CRC_ON_OFF, 0);
+	lost = uart_sink_end();
+	SPISetFast(FALSE);
 
-	for (i=0; i<0x10; i++)
+	t0 = timer_ms() - t0;
+	if (r == SDCARD_NO_DETECT)
 	{
-		response = sd_send_command(SD_GO_IDLE, 0);	// send CMD0 - go to idle state
-		if (response == 1)  break;
+		printf_P(PSTR("\r\nUpload failed; no writable card or bad block range."));
 	}
-	if (response != 1)
+	else if ((r == SDCARD_OK) && (half == 2))
 	{
-		return  SDCARD_NO_DETECT;
+		printf_P(PSTR("\r\n%lu blocks in %lu ms (%lu KB/s)"), count, t0,
+			(count * 500UL) / (t0 ? t0 : 1));
 	}
-
-	sd_send_command(SD_SET_BLK_LEN, 512);		// always set block length (CMD6) to 512 bytes
-
-	response = sd_send_command(SD_SEND_IF_COND, 0x1aa);	// probe to see if card is SDv2 (SDHC)
-	if (response == 0x01)						// if card is SDHC...
+	else
 	{
-		for (i=0; i<4; i++)						// burn the 4-byte response (OCR)
+		if (half < 2)
 		{
-			xchg(0xff);
+			printf_P(PSTR("\r\nUpload failed; no data for %u ms at block %lu."),
+				UPLOAD_IDLE_MS, first + n);
+			if (r == SDCARD_OK)  failed = first + n;	// that block was not written
 		}
-		for (i=20000; i>0; i--)
+		else
 		{
-			response = sd_send_command(SD_ADV_INIT, 1UL<<30);
-			if (response == 0)  break;
+			printf_P(PSTR("\r\nUpload failed near block %lu."), failed);
 		}
-		sdtype = SDTYPE_SDHC;
-	}
-	else
-	{
-		response = sd_send_command(SD_READ_OCR, 0);
-		if (response == 0x01)
+		if (failed == first + 1)
 		{
-			for (i=0; i<4; i++)					// OCR is 4 bytes
-			{
-				xchg(0xff);					// burn the 4-byte response (OCR)
-			}
-			for (i=20000; i>0; i--)
-			{
-				response = sd_send_command(SD_INIT, 0);
-				if (response == 0)  break;
-			}
-			sd_send_command(SD_SET_BLK_LEN, 512);
-			sdtype = SDTYPE_SD;
+			printf_P(PSTR("\r\nBlock %lu was written;"), first);
+		}
+		else if (failed > first)
+		{
+			printf_P(PSTR("\r\nBlocks %lu to %lu were written;"), first, failed - 1);
 		}
+		else
+		{
+			printf_P(PSTR("\r\nNo block was written;"));
+		}
+		printf_P(PSTR(" blocks %lu to %lu may now read as erased."), failed, first + count - 1);
 	}
-
-	xchg(0xff);								// send 8 final clocks
-
-/*
- *  At this point, the SD card has completed initialization.  The calling routine
- *  can now increase the SPI clock rate for the SD card to the maximum allowed by
- *  the SD card (typically, 20 MHz).
- */
-	return  SDCARD_OK;					// if no power routine or turning off the card, call it good
+	if (lost)  printf_P(PSTR("\r\n%u bytes overran block[]; the host ignored flow control."), lost);
 }
 
 
 
-static  void  ShowBlock(void)
+/*
+ *  UploadWait      wait until half of block[] has been received
+ */
+static int8_t  UploadWait(void)
 {
-	uint32_t				i;
-	uint8_t					str[17];
-
-	str[16] = 0;
-	str[0] = 0;			// only need for first newline, overwritten as chars are processed
+	uint32_t					start;
+	uint16_t					avail;
+	uint16_t					last;
 
-	printf_P(PSTR("\n\rContents of block buffer:"));
-	for (i=0; i<512; i++)
+	start = timer_ms();
+	last = uart_sink_avail();
+	while ((avail = uart_sink_avail()) < UPLOAD_HALF)
 	{
-		if ((i % 16) == 0)
+		if (avail != last)
 		{
-			printf_P(PSTR(" %s\n\r%04X: "), str, i);
+			last = avail;
+			start = timer_ms();
 		}
-		printf_P(PSTR("%02X "), (uint8_t)block[i]);
-		if (isalpha(block[i]) || isdigit(block[i]))  str[i%16] = block[i];
-		else									     str[i%16] = '.';
+		if ((timer_ms() - start) > UPLOAD_IDLE_MS)  return  SDCARD_TIMEOUT;
 	}
-	printf_P(PSTR(" %s\n\r"), str);
+	return  SDCARD_OK;
 }
 
 
 
-static int8_t  ExamineSD(void)
+/*
+ *  SetAuto      select the auto mode action and save it in EEPROM
+ */
+static void  SetAuto(uint8_t  action)
 {
-	int8_t			response;
-
-	response = ReadOCR();		// this fails with Samsung; don't test response until know why
-	response = ReadCSD();
-	if (response == SDCARD_OK)
-	{
-//		printf_P(PSTR(" ReadCSD is OK "));
-		response = ReadCID();
-	}
-	if (response == SDCARD_OK)
-	{
-//		printf_P(PSTR(" ReadCID is OK "));
-		response = ReadCardStatus();
-	}
-
-	return  response;
+	eeprom_update_byte(&autoprofile, action);
+	autoaction = action;
+	autostate = AUTO_WAIT_CARD;
+	autoseen = 0;
+	autofailed = FALSE;
+	autopass = 0;
+	autofail = 0;
+	LOCK_LED_OFF;
+	UNLOCK_LED_OFF;
 }
 
 
 
-
-static int8_t  ReadOCR(void)
+/*
+ *  AutoPoll      run the auto mode action on each card inserted
+ *
+ *  Called from the main loop between commands.  Every AUTO_POLL_MS the
+ *  card slot is probed with a single command: CMD0 while waiting for a
+ *  card, CMD13 while waiting for the done card to be pulled.  A change
+ *  must be seen on two probes in a row, so the contacts have settled.
+ *  The action then runs in cardreq from the main loop like a console
+ *  command.  Both LEDs are lit while it runs; afterwards the unlock LED
+ *  stays on for a pass, or the lock LED blinks for a failure, until the
+ *  card is removed.
+ */
+static void  AutoPoll(void)
 {
-	uint8_t				i;
-	int8_t				response;
+	if ((autoaction == AUTO_OFF) || (cardreq.op != SDREQ_NONE))  return;
 
-	for (i=0; i<4;  i++)  ocr[i] = 0;
+	if (autofailed)
+	{
+		if ((timer_ms() >> 7) & 1)  LOCK_LED_ON;		// about 4 Hz
+		else  LOCK_LED_OFF;
+	}
+	if ((timer_ms() - autopoll) < AUTO_POLL_MS)  return;
+	autopoll = timer_ms();
 
-	if (sdtype == SDTYPE_SDHC)
+	if (autostate == AUTO_WAIT_CARD)
 	{
-		response = sd_send_command(SD_SEND_IF_COND, 0x1aa);
-		if (response != 0)
-		{
-			return  SDCARD_RWFAIL;
-		}
-		for (i=0; i<4; i++)
+		if (!AutoProbe(SD_GO_IDLE))
 		{
-			ocr[i] = xchg(0xff);
+			autoseen = 0;
+			return;
 		}
-		xchg(0xff);							// burn the CRC
+		if (++autoseen < 2)  return;
+		autoseen = 0;
+
+		LOCK_LED_ON;
+		UNLOCK_LED_ON;
+		printf_P(PSTR("\r\nAuto: card %u, %S..."), autopass + autofail + 1, autonames[autoaction]);
+		cardjob.sw = SW_AUTO;
+		cardjob.argc = 0;
+		cardjob.abort = FALSE;
+		SDBegin(&cardreq, SDREQ_INIT, 0, NULL);		// AutoStart(), then AutoDone()
 	}
 	else
 	{
-		response = sd_send_command(SD_READ_OCR, 0);
-		if (response != 0x00)
-		{
-			return  SDCARD_RWFAIL;
-		}
-		for (i=0; i<4; i++)					// OCR is 4 bytes
+		if (AutoProbe(SD_SEND_STATUS))
 		{
-			ocr[i] = xchg(0xff);
+			autoseen = 0;
+			return;
 		}
-		xchg(0xff);
+		if (++autoseen < 2)  return;
+		autoseen = 0;
+
+		autofailed = FALSE;
+		LOCK_LED_OFF;
+		UNLOCK_LED_OFF;
+		autostate = AUTO_WAIT_CARD;
 	}
-	return  SDCARD_OK;
 }
 
 
 
-static  int8_t  ReadCSD(void)
+/*
+ *  AutoStart      start the auto mode action on the card just initialized
+ *
+ *  A card already in the wanted state passes without a command.  The
+ *  lock-state actions go on from the main loop (ActStart()); a format
+ *  runs to the end here.
+ */
+static void  AutoStart(int8_t  r)
 {
-	uint8_t			i;
-	int8_t			response;
-
-	for (i=0; i<16; i++)  csd[i] = 0;
-
-	response = sd_send_command(SD_SEND_CSD, 0);
-	response = sd_wait_for_data();
-	if (response != (int8_t)0xfe)
+	if (r != SDCARD_OK)
 	{
-		printf_P(PSTR("\n\rReadCSD(), sd_wait_for_data returns %02x."), response);
-		return  SDCARD_RWFAIL;
+		AutoDone(SDCARD_NO_DETECT);
+		return;
 	}
-
-	for (i=0; i<16; i++)
+	ReadCardStatus();
+	if (autoaction == AUTO_PWD_LOCK)
 	{
-		csd[i] = xchg(0xff);
+		if (cardstatus[1] & 0x01)  AutoDone(SDCARD_OK);		// already locked
+		else
+		{
+			LoadGlobalPWD();
+			ActStart(SW_PWD_LOCK);
+		}
 	}
-	xchg(0xff);							// burn the CRC
-	return  SDCARD_OK;
-}
-
-
-
-static  int8_t  ReadCID(void)
-{
-	uint8_t			i;
-	int8_t			response;
-
-	for (i=0; i<16; i++)  cid[i] = 0;
-
-	response = sd_send_command(SD_SEND_CID, 0);
-	response = sd_wait_for_data();
-	if (response != (int8_t)0xfe)
+	else if ((autoaction == AUTO_PWD_UNLOCK) || (autoaction == AUTO_ERASE))
 	{
-		return  SDCARD_RWFAIL;
+		if ((cardstatus[1] & 0x01) == 0)  AutoDone(SDCARD_OK);	// already unlocked
+		else if (autoaction == AUTO_ERASE)  ActStart(SW_ERASE);
+		else
+		{
+			LoadGlobalPWD();
+			ActStart(SW_PWD_UNLOCK);
+		}
 	}
-
-	for (i=0; i<16; i++)
+	else if (autoaction == AUTO_TEMP_LOCK)  ActStart(SW_LOCK);
+	else if (autoaction == AUTO_TEMP_UNLOCK)  ActStart(SW_UNLOCK);
+	else if (autoaction == AUTO_FORMAT)
 	{
-		cid[i] = xchg(0xff);
+		if (cardstatus[1] & 0x01)  AutoDone(SDCARD_RWFAIL);	// locked cards can't be written
+		else  AutoDone(Format());
 	}
-	xchg(0xff);							// burn the CRC
-	return  SDCARD_OK;
+	else  AutoDone(SDCARD_RWFAIL);
 }
 
 
 
-static int8_t  WriteCSD(void)
+/*
+ *  AutoDone      count and show the result of the auto mode action, then
+ *                wait for the card to be pulled
+ *
+ *  Only a card seen to end up in the wanted state passes, not just one
+ *  that accepted the commands.
+ */
+static void  AutoDone(int8_t  r)
 {
-	int8_t				response;
-	uint8_t				tcrc;
-	uint16_t			i;
-
-	response = sd_send_command(SD_PROGRAM_CSD, 0);
-	if (response != 0)
+	if (r == SDCARD_OK)
 	{
-		return  SDCARD_RWFAIL;
+		autopass++;
+		LOCK_LED_OFF;
+		UNLOCK_LED_ON;
+		printf_P(PSTR(" passed."));
 	}
-	xchg(0xfe);							// send data token marking start of data block
-
-	tcrc = 0;
-	for (i=0; i<15; i++)				// for all 15 data bytes in CSD...
+	else
 	{
-    	xchg(csd[i]);					// send each byte via SPI
-		tcrc = AddByteToCRC(tcrc, csd[i]);		// add byte to CRC
+		autofail++;
+		autofailed = TRUE;
+		LOCK_LED_ON;
+		UNLOCK_LED_OFF;
+		printf_P(PSTR(" FAILED."));
 	}
-	xchg((tcrc<<1) + 1);				// format the CRC7 value and send it
-
-	xchg(0xff);							// ignore dummy checksum
-	xchg(0xff);							// ignore dummy checksum
-
-	i = 0xffff;							// max timeout
-	while (!xchg(0xFF) && (--i))  ;		// wait until we are not busy
-
-	if (i)  return  SDCARD_OK;			// return success
-	else  return  SDCARD_RWFAIL;		// nope, didn't work
+	autostate = AUTO_WAIT_REMOVE;
+	autopoll = timer_ms();
 }
 
 
 
-
-
-
-static int8_t  ReadCardStatus(void)
+/*
+ *  AutoProbe      send one command and report whether a card answered
+ *
+ *  With no card the data line floats high and every response byte reads
+ *  0xff.  A new card needs CMD0 to enter SPI mode; a card that is already
+ *  in SPI mode answers CMD13 without losing its state.
+ */
+static uint8_t  AutoProbe(uint8_t  command)
 {
-	cardstatus[0] = sd_send_command(SD_SEND_STATUS, 0);
-	cardstatus[1] = xchg(0xff);
-//	printf_P(PSTR("\r\nReadCardStatus = %02x %02x"), cardstatus[0], cardstatus[1]);
+	uint8_t						i;
+	uint8_t						r;
+
+	deselect();
+	for (i=0; i<10; i++)  xchg(0xff);		// the 74+ clocks a new card needs
+	r = sd_send_command(command, 0);
+	if (command == SD_SEND_STATUS)  xchg(0xff);	// second byte of the R2 response
+	deselect();
 	xchg(0xff);
-	return  SDCARD_OK;
+	return  ((r & 0x80) == 0);
 }
 
 
 
-
-static int8_t  ReadBlock(uint32_t  blocknum, uint8_t  *buffer)
-{
-    uint16_t					i;
-	uint8_t						status;
-	uint32_t					addr;
-
 /*
- *  Compute byte address of start of desired sector.
+ *  ShowMem      report static SRAM, the stack high-water mark and the gap
+ *               left between them, then the biggest static buffers
  *
- *  For SD cards, the argument to CMD17 must be a byte address.
- *  For SDHC cards, the argument to CMD17 must be a block (512 bytes) number.
+ *  make memreport lists static use per module from the ELF file.
  */
-	if (sdtype == SDTYPE_SD) 	addr = blocknum << 9;	// SD card; convert block number to byte addr
+static void  ShowMem(void)
+{
+	printf_P(PSTR("\r\nSRAM %u bytes: data %u, bss %u, stack peak %u, never used %u, free now %u"),
+		RAMEND + 1 - RAMSTART, mem_data_size(), mem_bss_size(), mem_stack_peak(),
+		mem_never_used(), mem_free_now());
+	printf_P(PSTR("\r\nBuffers: block %u, crctable %u, console %u, UART queue %u"),
+		sizeof(block), sizeof(crctable), sizeof(cmdline), UART_RX_SIZE);
+#if SPI_TRACE
+	printf_P(PSTR(", trace %u, capture %u"), TRACE_LEN * sizeof(struct trace_rec),
+		CAPTURE_LEN * CAPTURE_REC_LEN);
+#endif
+}
 
-    status = sd_send_command(SD_READ_BLK, addr);    // send read command and logical sector address
-	if (status != SDCARD_OK)
-	{
-		return  SDCARD_RWFAIL;
-	}
 
-	status = sd_wait_for_data();		// wait for valid data token from card
-	if (status != 0xfe)					// card must return 0xfe for CMD17
-    {
-		ShowErrorCode(status);			// tell the user
-        return  SDCARD_RWFAIL;			// return error code
-    }
 
-    for (i=0; i<512; i++)           	// read sector data
-        block[i] = xchg(0xff);
+/*
+ *  AUBlocks      allocation unit size in blocks from the SD status, 0 if
+ *                the card does not say
+ */
+static uint32_t  AUBlocks(void)
+{
+	if (ReadSDStatus() != SDCARD_OK)  return  0;
+	return  (uint32_t)pgm_read_word(&au_kb[block[10] >> 4]) * 2;
+}
+
 
-    xchg(0xff);                		 	// ignore CRC
-    xchg(0xff);                		 	// ignore CRC
 
-    return  SDCARD_OK;					// return success
+/*
+ *  Block writes for fs_format()
+ */
+int8_t  fs_write_begin(uint32_t  first, uint32_t  count)
+{
+	return  (WriteMultiStart(first, count) == SDCARD_OK) ? 0 : -1;
 }
 
 
 
-static int8_t  ModifyPWD(uint8_t  mask)
+int8_t  fs_write_next(const uint8_t  *buf)
 {
-	int8_t						r;
-	uint16_t					i;
-
-	mask = mask & 0x07;					// top five bits MUST be 0, do not allow forced-erase!
-	r = sd_send_command(SD_LOCK_UNLOCK, 0);
-	if (r != 0)
-	{
-		return  SDCARD_RWFAIL;
-	}
-	xchg(0xfe);							// send data token marking start of data block
+	static uint16_t				n;
 
-	xchg(mask);							// always start with required command
-	xchg(pwd_len);						// then send the password length
-	for (i=0; i<512; i++)				// need to send one full block for CMD42
-	{
-		if (i < pwd_len)
-		{
-    		xchg(pwd[i]);					// send each byte via SPI
-		}
-		else
-		{
-			xchg(0xff);
-		}
-	}
+	if ((++n & 0x3ff) == 0)  printf_P(PSTR("."));		// a dot per 512 KB written
+	return  (WriteMultiNext(buf) == SDCARD_OK) ? 0 : -1;
+}
 
-	xchg(0xff);							// ignore dummy checksum
-	xchg(0xff);							// ignore dummy checksum
 
-	i = 0xffff;							// max timeout
-	while (!xchg(0xFF) && (--i))  ;		// wait until we are not busy
 
-	if (i)  return  SDCARD_OK;			// return success
-	else  return  SDCARD_RWFAIL;		// nope, didn't work
+int8_t  fs_write_end(void)
+{
+	return  (WriteMultiStop() == SDCARD_OK) ? 0 : -1;
 }
 
 
-static int8_t  ForceErase(void)
+
+
+/*
+ *  ShowStats      sort samples in place and print one row of the bench table
+ */
+static void  ShowStats(PGM_P  label, uint32_t  *samples, PGM_P  unit)
 {
-	int8_t	r;
-
-	sd_send_command(SD_SET_BLK_LEN, 1);		// always set block length (CMD6) to 512 bytes
+	uint8_t						i;
+	uint8_t						j;
+	uint32_t					t;
 
-	r = sd_send_command(SD_LOCK_UNLOCK, 0);
-	if (r != 0)
+	for (i=1; i<BENCH_SAMPLES; i++)			// insertion sort, n is tiny
 	{
-		return  SDCARD_RWFAIL;
+		t = samples[i];
+		for (j=i; (j>0) && (samples[j-1] > t); j--)  samples[j] = samples[j-1];
+		samples[j] = t;
 	}
-	xchg(0xfe);							// send data token marking start of data block
-
-	xchg(MASK_ERASE);					// always start with required command
-
-	return  SDCARD_OK;			// return success
+	printf_P(PSTR("\r\n"));
+	printf_P(label);
+	for (i=strlen_P(label); i<11; i++)  putchar(' ');
+	printf_P(PSTR("%8lu %8lu %8lu "), samples[0], samples[BENCH_SAMPLES/2], samples[BENCH_SAMPLES-1]);
+	printf_P(unit);
 }
 
 
+
 static void  ShowErrorCode(int8_t  status)
 {
 	if ((status & 0xe0) == 0)			// if status byte has an error value...
@@ -1146,7 +4468,6 @@ static void  ShowErrorCode(int8_t  status)
 
 static void  ShowCardStatus(void)
 {
-	ReadCardStatus();
 	printf_P(PSTR("\r\nPassword status: "));
 	if ((cardstatus[1] & 0x01) ==  0) {
         printf_P(PSTR("unlocked"));
@@ -1176,6 +4497,36 @@ static void  LoadGlobalPWD(void)
 
 
 
+/*
+ *  SDTxnBegin      hold CS across the commands up to the matching SDTxnEnd()
+ *
+ *  sd_send_command() normally deselects and reselects the card around
+ *  every command.  A sequence that does not need that (status after a
+ *  CMD42, CSD read after a CMD27, CMD55 before an ACMD) keeps the card
+ *  selected and saves the bytes; spisaved counts them.  Transactions nest.
+ */
+static void  SDTxnBegin(void)
+{
+	sdtxn++;
+}
+
+
+
+/*
+ *  SDTxnEnd      close a transaction; the last one releases the card
+ */
+static void  SDTxnEnd(void)
+{
+	if (sdtxn == 0)  return;
+	if (--sdtxn == 0)
+	{
+		deselect();
+		xchg(0xff);
+	}
+}
+
+
+
 /*
  *  ==========================================================================
  *
@@ -1200,42 +4551,73 @@ static  int8_t  sd_send_command(uint8_t  command, uint32_t  arg)
 	uint8_t				response;
 	uint8_t				i;
 	uint8_t				crc;
+	uint8_t				acmd;
 
-	if (command & 0x80)					// special case, ACMD(n) is sent as CMD55 and CMDn
+	acmd = command & 0x80;
+	if (acmd)							// special case, ACMD(n) is sent as CMD55 and CMDn
 	{
 		command = command & 0x7f;		// strip high bit for later
+		SDTxnBegin();					// CMD55 and CMDn share one select
 		response = sd_send_command(CMD55, 0);	// send first part (recursion)
-		if (response > 1)  return response;
+		if (response > 1)
+		{
+			SDTxnEnd();
+			return response;
+		}
 	}
 
-	deselect();
-	xchg(0xff);
-	select();							// enable CS
-	xchg(0xff);
+/*
+ *  Inside a transaction the card is still selected from the previous
+ *  command, so one idle byte is all the gap it needs.  If that byte is
+ *  not 0xff the card is busy or still talking; start over with a full
+ *  deselect and select.
+ */
+	if (sdtxn && SDSelected() && (xchg(0xff) == 0xff))
+	{
+		spisaved++;
+	}
+	else
+	{
+		deselect();
+		xchg(0xff);
+		select();						// enable CS
+		xchg(0xff);
+	}
 
     xchg(command | 0x40);				// command always has bit 6 set!
 	xchg((unsigned char)(arg>>24));		// send data, starting with top byte
 	xchg((unsigned char)(arg>>16));
 	xchg((unsigned char)(arg>>8));
 	xchg((unsigned char)(arg&0xff));
-	crc = 0x01;							// good for most cases
-	if (command == SD_GO_IDLE)  crc = 0x95;			// this will be good enough for most commands
-	if (command == SD_SEND_IF_COND)  crc = 0x87;	// special case, have to use different CRC
-    xchg(crc);         					// send final byte
+	crc = AddByteToCRC(0, command | 0x40);
+	crc = AddByteToCRC(crc, (unsigned char)(arg>>24));
+	crc = AddByteToCRC(crc, (unsigned char)(arg>>16));
+	crc = AddByteToCRC(crc, (unsigned char)(arg>>8));
+	crc = AddByteToCRC(crc, (unsigned char)(arg&0xff));
+    xchg((crc << 1) | 1);				// CRC7 and end bit; a card checks it once CMD59 asks
+
+	if (command == SD_STOP_TRANS)  xchg(0xff);		// skip the stuff byte after CMD12
 
-	for (i=0; i<10; i++)				// loop until timeout or response
+	for (i=0; i<SD_NCR_MAX; i++)		// loop until timeout or response
 	{
 		response = xchg(0xff);
 		if ((response & 0x80) == 0)  break;	// high bit cleared means we got a response
 	}
+	TRACE_CMD(command | 0x40, arg, response);
+	if (acmd)  sdtxn--;					// the ACMD ends like any other command
 
 /*
  *  We have issued the command but the SD card is still selected.  We
  *  only deselect the card if the command we just sent is NOT a command
  *  that requires additional data exchange, such as reading or writing
- *  a block.
+ *  a block, and no transaction is holding it.
  */
 	if ((command != SD_READ_BLK) &&
+		(command != SD_READ_MULTI) &&
+		(command != SD_WRITE_BLK) &&
+		(command != SD_WRITE_MULTI) &&
+		(command != SD_ERASE) &&
+		(command != SD_STOP_TRANS) &&
 		(command != SD_READ_OCR) &&
 		(command != SD_SEND_CSD) &&
 		(command != SD_SEND_STATUS) &&
@@ -1244,8 +4626,15 @@ static  int8_t  sd_send_command(uint8_t  command, uint32_t  arg)
 		(command != SD_LOCK_UNLOCK) &&
 		(command != SD_PROGRAM_CSD))
 	{
-		deselect();							// all done
-		xchg(0xff);							// close with eight more clocks
+		if (sdtxn)
+		{
+			spisaved++;						// the next command's idle byte does this
+		}
+		else
+		{
+			deselect();						// all done
+			xchg(0xff);						// close with eight more clocks
+		}
 	}
 
 	return  response;					// let the caller sort it out
@@ -1255,14 +4644,15 @@ static  int8_t  sd_send_command(uint8_t  command, uint32_t  arg)
 
 static int8_t  sd_wait_for_data(void)
 {
-	int16_t				i;
+	uint32_t			start;
 	uint8_t				r;
 
-	for (i=0; i<100; i++)
+	start = timer_ms();
+	do
 	{
 		r = xchg(0xff);
-		if (r != 0xff)  break;
-	}
+	}  while ((r == 0xff) && ((timer_ms() - start) <= tune.token_ms));
+	TRACE_DATA(TRACE_DATA_IN, r);
 	return  (int8_t) r;
 }
 
@@ -0,0 +1,86 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "timer.h"
+
+
+static volatile uint32_t timer_count_ms;
+
+
+/*
+ *  The tick also wakes the CPU from idle sleep, once a millisecond.
+ */
+ISR(TIMER1_COMPA_vect) {
+    timer_count_ms++;
+}
+
+
+void timer_init(void) {
+    TCCR1A = 0;
+    OCR1A = TIMER_TICKS_PER_MS - 1;
+    timer_start();
+    TIMSK1 = _BV(OCIE1A);
+}
+
+
+/*
+ *  Stop and restart the tick, for a sleep that only a switch or the UART
+ *  can end.  Time spent stopped is not counted, as with timer_rewind().
+ */
+void timer_stop(void) {
+    TCCR1B = _BV(WGM12);                /* no clock; TCNT1 holds */
+}
+
+
+void timer_start(void) {
+    TCCR1B = _BV(WGM12) | _BV(CS11);    /* CTC on OCR1A, clk/8 */
+}
+
+
+/*
+ *  Return milliseconds since timer_init(); wraps after about 49 days.
+ */
+uint32_t timer_ms(void) {
+    uint8_t sreg;
+    uint32_t ms;
+
+    sreg = SREG;
+    cli();
+    ms = timer_count_ms;
+    SREG = sreg;
+    return ms;
+}
+
+
+/*
+ *  Return microseconds since timer_init(); wraps after about 71 minutes,
+ *  so only differences are meaningful.
+ */
+uint32_t timer_us(void) {
+    uint8_t sreg;
+    uint16_t ticks;
+    uint32_t ms;
+
+    sreg = SREG;
+    cli();
+    ticks = TCNT1;
+    ms = timer_count_ms;
+    if ((TIFR1 & _BV(OCF1A)) && (ticks < TIMER_TICKS_PER_MS / 2)) {
+        ms++;                           /* wrapped, ISR not run yet */
+    }
+    SREG = sreg;
+    return ms * 1000UL + (((uint32_t)ticks * TIMER_US_SCALE) >> 16);
+}
+
+
+/*
+ *  Take ms off the clock, for time the firmware is not to count (see the
+ *  SPI capture in trace.c); never more than has passed since it was read.
+ */
+void timer_rewind(uint32_t ms) {
+    uint8_t sreg;
+
+    sreg = SREG;
+    cli();
+    timer_count_ms -= ms;
+    SREG = sreg;
+}
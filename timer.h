@@ -0,0 +1,22 @@
+#ifndef _SDLOCKER_TIMER_
+#define _SDLOCKER_TIMER_
+
+
+/*
+ *  Timer1 counts F_CPU/8 and is reset every millisecond (CTC mode), so
+ *  the tick is exact for any F_CPU that is a multiple of 8 kHz: 8, 16 and
+ *  20 MHz all are.  timer_us() adds the count within the current tick.
+ */
+#define TIMER_PRESCALE 8UL
+#define TIMER_TICKS_PER_MS (F_CPU/TIMER_PRESCALE/1000UL)
+#define TIMER_US_SCALE ((1000UL << 16) / TIMER_TICKS_PER_MS)  /* us per tick, 16.16 fixed point */
+
+
+extern void timer_init(void);
+extern uint32_t timer_ms(void);
+extern uint32_t timer_us(void);
+extern void timer_rewind(uint32_t ms);
+extern void timer_stop(void);
+extern void timer_start(void);
+
+#endif /* _SDLOCKER_TIMER_ */
@@ -0,0 +1,213 @@
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <stdio.h>
+#include "timer.h"
+#include "frame.h"
+#include "trace.h"
+
+#if SPI_TRACE
+
+static struct trace_rec trace_ring[TRACE_LEN];
+static uint8_t trace_head;          /* next record to write */
+static uint8_t trace_count;
+
+
+/*
+ *  Start a record; the token and busy time of the same transaction are
+ *  filled in later by trace_token() and trace_busy().
+ */
+void trace_cmd(uint8_t cmd, uint32_t arg, uint8_t r1) {
+    struct trace_rec *t;
+
+    t = &trace_ring[trace_head];
+    t->t_us = timer_us();
+    t->arg = arg;
+    t->cmd = cmd;
+    t->r1 = r1;
+    t->token = TRACE_NONE;
+    t->busy = 0;
+    if (++trace_head == TRACE_LEN) {
+        trace_head = 0;
+    }
+    if (trace_count < TRACE_LEN) {
+        trace_count++;
+    }
+}
+
+
+static struct trace_rec *trace_last(void) {
+    return &trace_ring[trace_head ? trace_head - 1 : TRACE_LEN - 1];
+}
+
+
+void trace_token(uint8_t token) {
+    if (trace_count) {
+        trace_last()->token = token;
+    }
+}
+
+
+void trace_busy(uint32_t us) {
+    us >>= 4;
+    if (trace_count) {
+        trace_last()->busy = us > 0xffff ? 0xffff : us;
+    }
+}
+
+
+void trace_clear(void) {
+    trace_head = 0;
+    trace_count = 0;
+}
+
+
+static struct trace_rec *trace_get(uint8_t n) {
+    n += trace_head + TRACE_LEN - trace_count;
+    return &trace_ring[n % TRACE_LEN];
+}
+
+
+/*
+ *  Text listing, oldest first, with times relative to the first record.
+ */
+void trace_show(void) {
+    struct trace_rec *t;
+    uint32_t t0;
+    uint8_t n;
+
+    printf_P(PSTR("\r\n    +us  cmd      arg  r1 tok   busy"));
+    t0 = trace_count ? trace_get(0)->t_us : 0;
+    for (n = 0; n < trace_count; n++) {
+        t = trace_get(n);
+        printf_P(PSTR("\r\n%7lu  "), t->t_us - t0);
+        if (t->cmd == TRACE_DATA_IN) {
+            printf_P(PSTR("din  "));
+        } else if (t->cmd == TRACE_DATA_OUT) {
+            printf_P(PSTR("dout "));
+        } else if (t->cmd == TRACE_STOP_TRAN) {
+            printf_P(PSTR("stop "));
+        } else {
+            printf_P(PSTR("CMD%-2u"), t->cmd & 0x3f);
+        }
+        printf_P(PSTR(" %08lX  %02X  %02X %6lu"), t->arg, t->r1, t->token, (uint32_t)t->busy << 4);
+    }
+}
+
+
+/*
+ *  One FRAME_TRACE frame holding every record, oldest first; the frame's
+ *  block field is the record count.
+ */
+void trace_send(void) {
+    struct trace_rec *t;
+    uint8_t n;
+
+    frame_begin(FRAME_TRACE, (uint16_t)trace_count * TRACE_REC_LEN, trace_count);
+    for (n = 0; n < trace_count; n++) {
+        t = trace_get(n);
+        frame_dword(t->t_us);
+        frame_dword(t->arg);
+        frame_byte(t->cmd);
+        frame_byte(t->r1);
+        frame_byte(t->token);
+        frame_byte(t->busy);
+        frame_byte(t->busy >> 8);
+    }
+    frame_end();
+    frame_begin(FRAME_END, 1, trace_count);
+    frame_byte(FRAME_OK);
+    frame_end();
+}
+
+
+
+uint8_t capture_on;                 /* taking records now */
+static uint8_t capture_armed;       /* start with the next command */
+static uint8_t capture_buf[CAPTURE_LEN * CAPTURE_REC_LEN];
+static uint8_t capture_n;           /* records in capture_buf */
+static uint32_t capture_seq;        /* records sent in earlier frames */
+static uint32_t capture_last;       /* timer_us() of the previous record */
+
+
+void capture_arm(void) {
+    capture_armed = 1;
+}
+
+
+/*
+ *  Called as each command starts; does nothing unless trace 3 armed it.
+ */
+void capture_begin(void) {
+    if (capture_armed) {
+        capture_armed = 0;
+        capture_on = 1;
+        capture_n = 0;
+        capture_seq = 0;
+        capture_last = timer_us();
+    }
+}
+
+
+static void capture_put(uint8_t flags, uint8_t mosi, uint8_t miso, uint32_t dt) {
+    uint8_t *p;
+
+    if (dt > 0x7fff) {
+        dt /= 1000;
+        dt = (dt > 0x7fff ? 0x7fff : dt) | CAPTURE_DT_MS;
+    }
+    p = &capture_buf[capture_n++ * CAPTURE_REC_LEN];
+    p[0] = flags;
+    p[1] = mosi;
+    p[2] = miso;
+    p[3] = dt;
+    p[4] = dt >> 8;
+}
+
+
+static void capture_flush(void) {
+    uint8_t n;
+
+    frame_begin(FRAME_SPI, (uint16_t)capture_n * CAPTURE_REC_LEN, capture_seq);
+    for (n = 0; n < capture_n * CAPTURE_REC_LEN; n++) {
+        frame_byte(capture_buf[n]);
+    }
+    frame_end();
+    capture_seq += capture_n;
+    capture_n = 0;
+}
+
+
+/*
+ *  One byte from xchg(); flags are the chip selects at the time.
+ */
+void capture_xchg(uint8_t mosi, uint8_t miso, uint8_t flags) {
+    uint32_t now;
+    uint32_t pause;
+
+    now = timer_us();
+    capture_put(flags, mosi, miso, now - capture_last);
+    capture_last = now;
+    if (capture_n == CAPTURE_LEN) {
+        capture_flush();
+        pause = timer_us() - now;
+        timer_rewind(pause / 1000);
+        capture_put(CAPTURE_PAUSE, 0, 0, pause);
+        capture_last = timer_us();
+    }
+}
+
+
+/*
+ *  Called before each prompt: send what is left and end the frames.
+ */
+void capture_end(void) {
+    if (capture_on) {
+        capture_on = 0;
+        capture_flush();
+        frame_begin(FRAME_END, 1, capture_seq);
+        frame_byte(FRAME_OK);
+        frame_end();
+    }
+}
+
+#endif /* SPI_TRACE */
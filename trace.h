@@ -0,0 +1,103 @@
+#ifndef _SDLOCKER_TRACE_
+#define _SDLOCKER_TRACE_
+
+
+/*
+ *  SPI trace: the last TRACE_LEN card commands, data blocks and busy
+ *  waits, kept in a ring in SRAM and shown by the trace console command.
+ *
+ *  Built only with make TRACE=1; otherwise SPI_TRACE is 0, the TRACE_xxx
+ *  hooks expand to nothing and the ring takes no memory.
+ */
+#ifndef SPI_TRACE
+#define SPI_TRACE       0
+#endif
+
+#define TRACE_LEN       24          /* records in the ring */
+#define TRACE_REC_LEN   13          /* bytes per record in a FRAME_TRACE payload */
+
+#define TRACE_DATA_IN   0x01        /* record types besides commands (0x40 | n) */
+#define TRACE_DATA_OUT  0x02
+#define TRACE_STOP_TRAN 0x03
+#define TRACE_NONE      0xff        /* no token seen */
+
+
+/*
+ *  SPI capture, in the same builds: every byte on the bus during one
+ *  console command, for replay against the driver on a host (sdlockctl
+ *  capture, host/sdreplay).  trace 3 arms it and the next command is
+ *  captured from its start to its prompt.  The records go out in
+ *  FRAME_SPI frames whenever CAPTURE_LEN have been taken, and a FRAME_END
+ *  follows the last frame.  Sending a frame stops the command for a while;
+ *  that time is taken off the timer, so the command's timeouts do not see
+ *  it, and is recorded in a CAPTURE_PAUSE record.  The card's own clock
+ *  keeps running, so busy waits captured across a pause end early.
+ */
+#define CAPTURE_LEN     32          /* records per FRAME_SPI frame */
+#define CAPTURE_REC_LEN 5           /* flags mosi miso dt(2) */
+#define CAPTURE_CS_MAIN 0x01        /* flags: chip select of the main socket low */
+#define CAPTURE_CS_SECOND 0x02      /* and of the second socket */
+#define CAPTURE_PAUSE   0x80        /* no byte; dt is the time spent sending a frame */
+#define CAPTURE_DT_MS   0x8000      /* dt is in ms, not us */
+
+
+/*
+ *  Replay: host/sdreplay builds the firmware for Linux with SPI_REPLAY
+ *  set, and xchg() hands each byte to replay_xchg() instead of the SPI
+ *  hardware.
+ */
+#ifndef SPI_REPLAY
+#define SPI_REPLAY      0
+#endif
+
+
+/*
+ *  One record.  In a FRAME_TRACE payload it is sent as t_us(4) arg(4) cmd
+ *  r1 token busy(2), little-endian.
+ */
+struct trace_rec {
+    uint32_t t_us;                  /* timer_us() when the response came */
+    uint32_t arg;                   /* command argument */
+    uint8_t cmd;                    /* 0x40 | n for CMDn, or TRACE_xxx */
+    uint8_t r1;                     /* R1, or the data response of TRACE_DATA_OUT */
+    uint8_t token;                  /* data start or error token of TRACE_DATA_IN */
+    uint16_t busy;                  /* card busy afterwards, in 16 us units */
+};
+
+
+#if SPI_TRACE
+extern void trace_cmd(uint8_t cmd, uint32_t arg, uint8_t r1);
+extern void trace_token(uint8_t token);
+extern void trace_busy(uint32_t us);
+extern void trace_show(void);
+extern void trace_send(void);
+extern void trace_clear(void);
+
+extern uint8_t capture_on;
+extern void capture_arm(void);
+extern void capture_begin(void);
+extern void capture_xchg(uint8_t mosi, uint8_t miso, uint8_t flags);
+extern void capture_end(void);
+
+#define TRACE_CMD(c, a, r)  trace_cmd(c, a, r)
+#define TRACE_DATA(t, tok)  do { trace_cmd(t, 0, TRACE_NONE); trace_token(tok); } while (0)
+#define TRACE_TOKEN(tok)    trace_token(tok)
+#define TRACE_BUSY(us)      trace_busy(us)
+#define CAPTURE_BEGIN()     capture_begin()
+#define CAPTURE_XCHG(o, i, f)  do { if (capture_on) capture_xchg(o, i, f); } while (0)
+#define CAPTURE_END()       capture_end()
+#else
+#define TRACE_CMD(c, a, r)
+#define TRACE_DATA(t, tok)
+#define TRACE_TOKEN(tok)
+#define TRACE_BUSY(us)
+#define CAPTURE_BEGIN()
+#define CAPTURE_XCHG(o, i, f)
+#define CAPTURE_END()
+#endif
+
+#if SPI_REPLAY
+extern uint8_t replay_xchg(uint8_t mosi, uint8_t flags);
+#endif
+
+#endif /* _SDLOCKER_TRACE_ */
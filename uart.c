@@ -1,6 +1,8 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdio.h>
 #include "uart.h"
+#define BAUD_TOL 3                      /* 115200 at 16 MHz is 2.1% off */
 #include <util/setbaud.h>
 
 
@@ -8,6 +10,114 @@ FILE uart_output = FDEV_SETUP_STREAM(uart_putchar, NULL, _FDEV_SETUP_WRITE);
 FILE uart_input = FDEV_SETUP_STREAM(NULL, uart_getchar, _FDEV_SETUP_READ);
 
 
+/*
+ *  Received bytes are queued by the RX interrupt, so a host may send
+ *  the next commands while the current one is still running.
+ */
+static volatile uint8_t rx_buf[UART_RX_SIZE];
+static volatile uint8_t rx_head;
+static volatile uint8_t rx_tail;
+
+/*
+ *  While a sink is open the next sink_left bytes go to sink_buf instead,
+ *  a ring of sink_size bytes.  sink_in and sink_out count bytes put in
+ *  and taken out; they wrap, but never more than sink_size apart.
+ */
+static uint8_t *sink_buf;
+static uint16_t sink_mask;
+static volatile uint32_t sink_left;
+static volatile uint16_t sink_in;
+static volatile uint16_t sink_out;
+static volatile uint16_t sink_lost;
+
+static volatile uint8_t flow_stopped;
+static volatile uint8_t flow_pending;   /* XON or XOFF waiting for the transmitter */
+
+
+/*
+ *  Send a byte from either the main line or an interrupt; checking for
+ *  room and writing UDR0 must not be split by a flow control byte.
+ */
+static void uart_tx(uint8_t c) {
+    uint8_t sreg;
+
+    for (;;) {
+        sreg = SREG;
+        cli();
+        if (UCSR0A & _BV(UDRE0)) {
+            break;
+        }
+        SREG = sreg;
+    }
+    UDR0 = c;
+    SREG = sreg;
+}
+
+
+static void flow_set(uint8_t stop) {
+    if (flow_stopped == stop) {
+        return;
+    }
+    flow_stopped = stop;
+#if UART_FLOW_RTS
+    if (stop) {
+        UART_RTS_PORT |= _BV(UART_RTS_BIT);
+    } else {
+        UART_RTS_PORT &= ~_BV(UART_RTS_BIT);
+    }
+#else
+    if (UCSR0A & _BV(UDRE0)) {
+        UDR0 = stop ? UART_XOFF : UART_XON;
+        flow_pending = 0;
+    } else {
+        flow_pending = stop ? UART_XOFF : UART_XON;
+        UCSR0B |= _BV(UDRIE0);          /* sent by the UDRE interrupt */
+    }
+#endif
+}
+
+
+ISR(USART_UDRE_vect) {
+    UCSR0B &= ~_BV(UDRIE0);
+    if (flow_pending) {
+        UDR0 = flow_pending;
+        flow_pending = 0;
+    }
+}
+
+
+ISR(USART_RX_vect) {
+    uint8_t c;
+    uint8_t next;
+    uint16_t used;
+
+    c = UDR0;
+    if (sink_left) {
+        used = sink_in - sink_out;
+        if (used > sink_mask) {         /* full; the host did not stop in time */
+            sink_lost++;
+        } else {
+            sink_buf[sink_in & sink_mask] = c;
+            sink_in++;
+            used++;
+        }
+        sink_left--;
+        if (used >= sink_mask + 1 - UART_SINK_SLACK) {
+            flow_set(1);
+        }
+        return;
+    }
+    next = (rx_head + 1) & (UART_RX_SIZE - 1);
+    if (next != rx_tail) {              /* drop the byte if the queue is full */
+        rx_buf[rx_head] = c;
+        rx_head = next;
+    }
+    if (((rx_head - rx_tail) & (UART_RX_SIZE - 1)) >= UART_RX_SIZE - UART_RX_SLACK) {
+        flow_set(1);
+    }
+}
+
+
 void uart_init(void) {
     UBRR0H = UBRRH_VALUE;
     UBRR0L = UBRRL_VALUE;
@@ -18,8 +128,12 @@ void uart_init(void) {
     UCSR0A &= ~(_BV(U2X0));
 #endif
 
+#if UART_FLOW_RTS
+    UART_RTS_PORT &= ~_BV(UART_RTS_BIT);    /* low: clear to send */
+    UART_RTS_DDR |= _BV(UART_RTS_BIT);
+#endif
     UCSR0C = _BV(UCSZ01) | _BV(UCSZ00); /* 8-bit data */
-    UCSR0B = _BV(RXEN0) | _BV(TXEN0);   /* Enable RX and TX */
+    UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);   /* Enable RX and TX, RX interrupt */
 }
 
 
@@ -27,17 +141,105 @@ void uart_putchar(char c, FILE *stream) {
     if (c == '\n') {
         uart_putchar('\r', stream);
     }
-    loop_until_bit_is_set(UCSR0A, UDRE0);
-    UDR0 = c;
+    uart_tx(c);
+}
+
+
+/*
+ *  Send one byte as is, without the LF to CRLF translation; for binary frames.
+ */
+void uart_putbyte(uint8_t c) {
+    uart_tx(c);
 }
 
 
 char uart_getchar(FILE *stream) {
-    loop_until_bit_is_set(UCSR0A, RXC0); /* Wait until data exists. */
-    return UDR0;
+    char c;
+
+    while (rx_head == rx_tail)          /* Wait until data exists. */
+        ;
+    c = rx_buf[rx_tail];
+    rx_tail = (rx_tail + 1) & (UART_RX_SIZE - 1);
+    cli();
+    if (flow_stopped && (((rx_head - rx_tail) & (UART_RX_SIZE - 1)) <= UART_RX_SIZE / 2)) {
+        flow_set(0);
+    }
+    sei();
+    return c;
 }
 
 
 uint8_t uart_pending_data() {
-    return bit_is_set(UCSR0A, RXC0); /* Wait until data exists. */
+    return rx_head != rx_tail;
+}
+
+
+/*
+ *  Send the next total bytes received to buf, a ring of size bytes (a
+ *  power of two), instead of the queue; bytes already queued go first.
+ *  The caller takes data out with uart_sink_avail() and uart_sink_take().
+ *  Once total bytes have come in, the queue is used again by itself.
+ */
+void uart_sink_start(uint8_t *buf, uint16_t size, uint32_t total) {
+    cli();
+    sink_buf = buf;
+    sink_mask = size - 1;
+    sink_in = 0;
+    sink_out = 0;
+    sink_lost = 0;
+    while ((rx_tail != rx_head) && total && (sink_in < size)) {
+        buf[sink_in++] = rx_buf[rx_tail];
+        rx_tail = (rx_tail + 1) & (UART_RX_SIZE - 1);
+        total--;
+    }
+    sink_left = total;
+    if (flow_stopped && ((uint16_t)(size - sink_in) > UART_SINK_SLACK)) {
+        flow_set(0);
+    }
+    sei();
+}
+
+
+/*
+ *  Bytes in the sink not yet taken; they start at (bytes taken) % size.
+ */
+uint16_t uart_sink_avail(void) {
+    uint16_t n;
+
+    cli();
+    n = sink_in - sink_out;
+    sei();
+    return n;
+}
+
+
+/*
+ *  Free n bytes of the sink; the host is started again once half of it
+ *  is free.
+ */
+void uart_sink_take(uint16_t n) {
+    cli();
+    sink_out += n;
+    if (flow_stopped && ((uint16_t)(sink_in - sink_out) <= (sink_mask + 1) / 2)) {
+        flow_set(0);
+    }
+    sei();
+}
+
+
+/*
+ *  Close the sink, whether or not all of its bytes came in; returns the
+ *  number of bytes dropped because it was full.
+ */
+uint16_t uart_sink_end(void) {
+    uint16_t lost;
+
+    cli();
+    sink_left = 0;
+    lost = sink_lost;
+    if (flow_stopped) {
+        flow_set(0);
+    }
+    sei();
+    return lost;
 }
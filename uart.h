@@ -2,7 +2,29 @@
 #define _SDLOCKER_UART_
 
 
-#define BAUD 38400L
+#ifndef BAUD
+#define BAUD 38400L         /* set by the Makefile to suit F_CPU */
+#endif
+#define UART_RX_SIZE 64     /* receive queue, must be a power of two */
+#define UART_RX_SLACK 16    /* queue space left when the host is stopped */
+#define UART_SINK_SLACK 64  /* sink space left when the host is stopped */
+
+
+/*
+ *  Flow control: the host is stopped before the receive queue (or a sink,
+ *  see uart_sink_start()) overflows and started again once it has
+ *  drained.  With UART_FLOW_RTS (make FLOW=rts) the board drives RTS on
+ *  PD4, high to stop, for the adapter's CTS input; otherwise it sends
+ *  XOFF and XON, which the host tty must honour (IXON).
+ */
+#ifndef UART_FLOW_RTS
+#define UART_FLOW_RTS 0
+#endif
+#define UART_RTS_PORT PORTD
+#define UART_RTS_DDR DDRD
+#define UART_RTS_BIT 4
+#define UART_XON 0x11
+#define UART_XOFF 0x13
 
 
 extern FILE uart_output;
@@ -11,7 +33,13 @@ extern FILE uart_input;
 
 extern void uart_init(void);
 extern void uart_putchar(char c, FILE *stream);
+extern void uart_putbyte(uint8_t c);
 extern char uart_getchar(FILE *stream);
 extern uint8_t uart_pending_data();
 
+extern void uart_sink_start(uint8_t *buf, uint16_t size, uint32_t total);
+extern uint16_t uart_sink_avail(void);
+extern void uart_sink_take(uint16_t n);
+extern uint16_t uart_sink_end(void);
+
 #endif /* _SDLOCKER_UART_ */